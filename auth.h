@@ -1,48 +1,64 @@
 /*********************************
  * Authentication code.  Mostly used for just shadowauth().
  *
+ * shadowauth() is reentrant (see old/auth.h, which hashes & compares the passwords for both
+ * servers), so any number of threads (see the pool in server.c) can check passwords at once
+ * without a lock.
+ *
+ * Password hashes come from whatever backends the server added (see old/auth.h): a compiled
+ * account database if there is one, then /etc/shadow, out of an in-memory index of it once
+ * SpCacheStart() has been called (see spcache.h), otherwise from getspnam_r().
+ *
  * I'm sure this code can be more clean, but...not really going to happen here.
  *********************************/
 #ifndef __AUTH_H
 #define __AUTH_H
 
-// Files needed to authenticate against /etc/shadow
-#include <shadow.h>
-#include <crypt.h>
-
 // Has useful functions
 #include "global.h"
 
+// Index of /etc/shadow, so a lookup doesn't read the whole file
+#include "spcache.h"
+
+// Account backends, and hashing & comparing passwords (shared with old/server)
+#include "old/auth.h"
+
+/**
+ * cache_lookup()
+ * ctx:         Not used                                        [in]
+ * u:           Username to look up                             [in]
+ * stored:      Buffer for the password hash (CRYPT_OUTPUT_SIZE) [out]
+ *
+ * Backend for /etc/shadow that asks the shadow index first (see spcache.h), and only reads
+ * /etc/shadow itself (getspnam_r()) if the index can't say.
+ **/
+int cache_lookup(void *ctx, const char *u, char *stored){
+        int ret = 0;
+
+        if((ret = SpCacheFind(u, stored, CRYPT_OUTPUT_SIZE)) != -1)
+                return ret;
+
+        return shadow_lookup(ctx, u, stored);
+}
+
 /**
  * shadowauth()
  * u:   Username to authenticate        [in]
  * p:   Given password for user         [in]
  *
- * Authenticates user against /etc/shadow file.
+ * Authenticates user against the account backends (see auth_backend_add() in old/auth.h),
+ * /etc/shadow unless there's an account database.  Safe to call from any number of threads.
  *
  * Retuns 1 on success, 0 on failure.
  **/
 int shadowauth(const char *u, const char *p){
-        // Shadow password structure (see shadow.h)
-        struct spwd *spw = NULL;
-
-        // salt = $#$....$ (i.e.: $1$abcdefg)
-        char *salt = (char*)malloc(sizeof(char) * 11);
-        memset(salt, '\0', 11);
-
+        char stored[CRYPT_OUTPUT_SIZE];
         int ret = 0;
 
-        // Populate shadow structure based on given username
-        if((spw = getspnam(u)) != NULL){
-                // sp_pwdp = entire password, salt is the first 11 characters
-                strncat(salt, (spw->sp_pwdp), 11);
-
-                // If we encrypt p with salt, and its the same as sp_pwdp, success
-                if(streq(crypt(p, salt), spw->sp_pwdp))
-                        ret = 1;
-        }
+        if(auth_find(u, stored))
+                ret = auth_verify(p, stored);
 
-        free(salt);
+        memset(stored, '\0', sizeof(stored));
 
         return ret;
 }
@@ -0,0 +1,691 @@
+/****************************
+ * AuthPool.h
+ *
+ * Client library for logging in against the server (what the PAM module uses).
+ *
+ * Opening a connection and waiting for the greeting costs more than the login itself, and a busy
+ * host can have a lot of logins going at once.  An AuthPool keeps up to `size` connections to the
+ * server open, each one pipelining (see server.c): a login goes out as one "<id> <username>
+ * <password>" frame, and the answer comes back tagged with the same id, in whatever order the
+ * server finishes them.  So one connection carries up to AUTHPOOL_INFLIGHT logins at once, and
+ * each login goes to whichever connection has the fewest going.
+ *
+ * Passwords are sent as they are, so the server has to be a unix socket ("unix:/path", see
+ * resolve.h) that trusts us (see server.c): its greeting is a single LOCAL frame, and the
+ * connection is ready as soon as that comes in.  A server that greets us any other way won't
+ * check our logins, so the connection is dropped before anything is sent on it.
+ *
+ * Everything runs on the pool's own thread, on a client-side event loop (see event.h):
+ * connects are non-blocking, and AuthPoolAuthenticate() just queues the login and returns.  The
+ * callback is called on the pool's thread with the answer:
+ *	 1	Logged in
+ *	 0	Wrong username/password
+ *	-1	Couldn't get an answer (server busy, down, etc.)
+ *
+ * AuthPoolAuthenticateWait() is the blocking version.  AuthPoolDestroy() closes everything, and
+ * fails whatever hasn't been answered yet.
+ ****************************/
+#ifndef __AUTHPOOL_H
+#define __AUTHPOOL_H
+
+#include "event.h"
+#include <ctype.h>
+
+#define AUTHPOOL_SIZE		2	// Default number of connections
+#define AUTHPOOL_MAX		64
+#define AUTHPOOL_INFLIGHT	256	// Logins going at once on one connection (server's PIPE_MAX)
+#define AUTHPOOL_RETRIES	1	// Times a login is tried again if its connection drops
+#define AUTHPOOL_MAXFRAME	64	// Server only sends the greeting & short answers
+
+#define AUTH_USER_MAX		64
+#define AUTH_PASS_MAX		256
+
+// Where a pooled connection is
+enum {
+	AUTHCONN_HELLO,		// Connecting / waiting on the LOCAL greeting
+	AUTHCONN_READY		// Pipelining, logins can be sent
+};
+
+typedef void (*AuthCallback)(void *arg, int result);
+
+typedef struct __authreq {
+	// Must be first, the request gets to the pool's thread as a NetTask
+	NetTask task;
+
+	char user[AUTH_USER_MAX + 1];
+	char pass[AUTH_PASS_MAX + 1];
+
+	AuthCallback cb;
+	void *arg;
+
+	int retries;
+
+	// Where the end of its frame is in what's been queued on its connection (see AuthPoolSend())
+	uint64_t at;
+
+	struct __authreq *next;
+} AuthReq;
+
+/**
+ * struct __authconn {}
+ *
+ * c->data of a pooled connection.  A login's id is its slot in sent[], and a slot is only given
+ * out again once its answer has come back.
+ **/
+typedef struct __authconn {
+	NetConn *conn;
+
+	AuthReq *sent[AUTHPOOL_INFLIGHT];
+	int free[AUTHPOOL_INFLIGHT];
+	int nfree;
+
+	// Bytes ever queued on the connection
+	uint64_t queued;
+
+	int used;
+} AuthConn;
+
+typedef struct __authpool {
+	// Must be first, handlers get the loop and cast it back
+	NetLoop loop;
+
+	pthread_t thread;
+
+	// Server, looked up again (through the resolver cache) for every connect
+	char host[NET_RESOLVE_HOSTMAX + 1];
+	int port;
+
+	// Address to connect to next, moves on when a connect fails
+	NetAddrs addrs;
+	int next;
+
+	int size;
+	int live;
+	int connecting;
+
+	// Every open connection, and the ones that are pipelining
+	AuthConn *all[AUTHPOOL_MAX];
+	int nall;
+	AuthConn *ready[AUTHPOOL_MAX];
+	int nready;
+
+	// AuthPoolDestroy() has been called
+	int stopping;
+
+	// Logins waiting for a connection
+	AuthReq *head;
+	AuthReq *tail;
+
+	// Stats (pool's thread only)
+	uint64_t connects;
+	uint64_t requests;
+	uint64_t reused;
+	uint64_t failed;
+	uint64_t peak;
+} AuthPool;
+
+/**
+ * AuthPoolConnect()
+ * p:	Pool to add a connection to	[in/out]
+ *
+ * Starts a non-blocking connect to the server.  The connection joins the ready list once it's
+ * been greeted and has switched to pipelining.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int AuthPoolConnect(AuthPool *p){
+	struct sockaddr_storage *addr = NULL;
+	int s = -1, i = 0;
+
+	// Keeps the last answer if the name stops resolving
+	NetResolve(p->host, p->port, 0, &p->addrs);
+
+	// Never had one
+	if(p->addrs.count <= 0){
+		D(("No address for %s", p->host));
+		return 0;
+	}
+
+	i = p->next % p->addrs.count;
+	addr = &p->addrs.addr[i];
+
+	if((s = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1){
+		perror("socket()");
+		return 0;
+	}
+
+	if((connect(s, (struct sockaddr*)addr, p->addrs.len[i]) == -1) && (errno != EINPROGRESS)){
+		perror("connect()");
+		close(s);
+
+		p->next++;
+		return 0;
+	}
+
+	p->live++;
+	p->connecting++;
+	p->connects++;
+
+	// NULL without on_close() being called means it was never set up (and s is closed)
+	if(!NetConnOpen(&p->loop, s, addr)){
+		p->live--;
+		p->connecting--;
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * AuthPoolFinish()
+ * p:		Pool the login was on	[in/out]
+ * r:		Login that's done	[in]
+ * result:	Answer (see above)	[in]
+ **/
+void AuthPoolFinish(AuthPool *p, AuthReq *r, int result){
+	if(result == -1)
+		p->failed++;
+
+	r->cb(r->arg, result);
+
+	memset(r, 0, sizeof(AuthReq));
+	free(r);
+}
+
+/**
+ * AuthPoolFailAll()
+ * p:	Pool that can't reach the server	[in/out]
+ *
+ * Fails every login that's waiting for a connection.
+ **/
+void AuthPoolFailAll(AuthPool *p){
+	AuthReq *r = NULL;
+
+	while((r = p->head)){
+		p->head = r->next;
+		AuthPoolFinish(p, r, -1);
+	}
+
+	p->tail = NULL;
+}
+
+/**
+ * AuthPoolSend()
+ * p:	Pool the connection belongs to	[in/out]
+ * a:	Connection with a free slot	[in/out]
+ * r:	Login to send			[in]
+ *
+ * Returns 0 if the login couldn't be queued, 1 on success.
+ **/
+int AuthPoolSend(AuthPool *p, AuthConn *a, AuthReq *r){
+	char buff[16 + AUTH_USER_MAX + AUTH_PASS_MAX];
+	int id = a->free[--a->nfree];
+	int len = 0, ok = 0;
+
+	len = snprintf(buff, sizeof(buff), "%d %s %s", id, r->user, r->pass);
+	ok = NetConnQueue(a->conn, buff, len);
+
+	memset(buff, '\0', sizeof(buff));
+
+	if(!ok){
+		a->free[a->nfree++] = id;
+		return 0;
+	}
+
+	a->queued += NET_HDRLEN + len;
+
+	a->sent[id] = r;
+	r->at = a->queued;
+
+	if(a->used)
+		p->reused++;
+
+	a->used = 1;
+
+	if((uint64_t)(AUTHPOOL_INFLIGHT - a->nfree) > p->peak)
+		p->peak = AUTHPOOL_INFLIGHT - a->nfree;
+
+	return 1;
+}
+
+/**
+ * AuthPoolDispatch()
+ * p:	Pool to hand out logins for	[in/out]
+ *
+ * Sends waiting logins on the least busy connections, opening another connection (up to size)
+ * if they're all full.
+ **/
+void AuthPoolDispatch(AuthPool *p){
+	AuthConn *a = NULL;
+	AuthReq *r = NULL;
+	int i = 0;
+
+	while(p->head && p->nready){
+		// Connection with the most free slots
+		a = p->ready[0];
+
+		for(i = 1; i < p->nready; i++)
+			if(p->ready[i]->nfree > a->nfree)
+				a = p->ready[i];
+
+		if(!a->nfree)
+			break;
+
+		r = p->head;
+
+		if(!(p->head = r->next))
+			p->tail = NULL;
+
+		if(!AuthPoolSend(p, a, r)){
+			AuthPoolFinish(p, r, -1);
+			NetConnClose(&p->loop, a->conn);
+
+			continue;
+		}
+
+		NetConnUpdate(&p->loop, a->conn);
+	}
+
+	// Still waiting?  One connection being greeted is enough, it can take AUTHPOOL_INFLIGHT of them
+	if(p->head && !p->connecting && (p->live < p->size))
+		AuthPoolConnect(p);
+
+	// Nothing left to connect with?  Then nobody is going to answer these
+	if(!p->live)
+		AuthPoolFailAll(p);
+}
+
+/**
+ * AuthPoolQueue()
+ * p:		Pool to queue on			[in/out]
+ * r:		Login to queue				[in]
+ * front:	Put it first (it's being retried)	[in]
+ **/
+void AuthPoolQueue(AuthPool *p, AuthReq *r, int front){
+	if(front){
+		r->next = p->head;
+		p->head = r;
+
+		if(!p->tail)
+			p->tail = r;
+	} else{
+		r->next = NULL;
+
+		if(p->tail)
+			p->tail->next = r;
+		else
+			p->head = r;
+
+		p->tail = r;
+	}
+}
+
+/**
+ * AuthPoolSubmit()
+ *
+ * NetTask handler, a login has come in from another thread.
+ **/
+void AuthPoolSubmit(NetLoop *l, NetTask *t){
+	AuthPool *p = (AuthPool*)l;
+
+	p->requests++;
+
+	if(p->stopping){
+		AuthPoolFinish(p, (AuthReq*)t, -1);
+		return;
+	}
+
+	AuthPoolQueue(p, (AuthReq*)t, 0);
+	AuthPoolDispatch(p);
+}
+
+int AuthPoolOnOpen(NetLoop *l, NetConn *c){
+	AuthPool *p = (AuthPool*)l;
+	AuthConn *a = NULL;
+	int i = 0;
+
+	if(!(a = (AuthConn*)calloc(1, sizeof(AuthConn))))
+		return 0;
+
+	a->conn = c;
+
+	// Hand out low ids first
+	for(i = AUTHPOOL_INFLIGHT - 1; i >= 0; i--)
+		a->free[a->nfree++] = i;
+
+	c->data = a;
+	c->state = AUTHCONN_HELLO;
+
+	p->all[p->nall++] = a;
+
+	return 1;
+}
+
+/**
+ * AuthPoolAnswer()
+ * p:		Pool the connection belongs to		[in/out]
+ * a:		Pipelining connection			[in/out]
+ * data:	"<id> OK", "<id> FAIL" or "<id> BUSY"	[in]
+ * len:		Length of data				[in]
+ *
+ * Returns 0 if the answer makes no sense (connection should be closed), 1 otherwise.
+ **/
+int AuthPoolAnswer(AuthPool *p, AuthConn *a, char *data, int len){
+	AuthReq *r = NULL;
+	int id = 0, i = 0, result = -1;
+
+	for(i = 0; (i < len) && (i < 4) && isdigit((unsigned char)data[i]); i++)
+		id = (id * 10) + (data[i] - '0');
+
+	if(!i || (i >= len) || (data[i++] != ' ') || (id >= AUTHPOOL_INFLIGHT) || !(r = a->sent[id]))
+		return 0;
+
+	if(((len - i) == 2) && !memcmp(data + i, "OK", 2))
+		result = 1;
+	else if(((len - i) == 4) && !memcmp(data + i, "FAIL", 4))
+		result = 0;
+
+	a->sent[id] = NULL;
+	a->free[a->nfree++] = id;
+
+	AuthPoolFinish(p, r, result);
+
+	return 1;
+}
+
+int AuthPoolOnFrame(NetLoop *l, NetConn *c, char *data, int len){
+	AuthPool *p = (AuthPool*)l;
+	AuthConn *a = (AuthConn*)c->data;
+
+	switch(c->state){
+		case AUTHCONN_HELLO:
+			// Trusted local peer (unix socket): one frame for a greeting, and it's pipelining already
+			if((len != 5) || memcmp(data, "LOCAL", 5)){
+				D(("%s doesn't trust us, not sending it any passwords (use a unix socket)", c->ip));
+				return 0;
+			}
+
+			c->state = AUTHCONN_READY;
+			p->connecting--;
+			p->ready[p->nready++] = a;
+			break;
+
+		case AUTHCONN_READY:
+			if(!AuthPoolAnswer(p, a, data, len))
+				return 0;
+
+			break;
+	}
+
+	if(p->head)
+		AuthPoolDispatch(p);
+
+	return 1;
+}
+
+void AuthPoolOnClose(NetLoop *l, NetConn *c){
+	AuthPool *p = (AuthPool*)l;
+	AuthConn *a = (AuthConn*)c->data;
+	AuthReq *r = NULL;
+	uint64_t written = 0;
+	int i = 0;
+
+	// on_open() failed, AuthPoolConnect() takes care of the counts
+	if(!a)
+		return;
+
+	p->live--;
+	c->data = NULL;
+
+	for(i = 0; i < p->nready; i++){
+		if(p->ready[i] == a){
+			p->ready[i] = p->ready[--p->nready];
+			break;
+		}
+	}
+
+	for(i = 0; i < p->nall; i++){
+		if(p->all[i] == a){
+			p->all[i] = p->all[--p->nall];
+			break;
+		}
+	}
+
+	// Whatever's still waiting in the queue never got to the server (a send that's in flight
+	// counts as sent)
+	written = a->queued - (uint64_t)(c->outlen - c->outpos - c->sending);
+
+	// Dropped with logins going, try the ones the server never got again on another connection.
+	// One it may have got could have been checked already, and trying it again would count
+	// against the user twice (i.e.: towards a lockout)
+	for(i = 0; i < AUTHPOOL_INFLIGHT; i++){
+		if(!(r = a->sent[i]))
+			continue;
+
+		if(!p->stopping && (r->at > written) && (r->retries++ < AUTHPOOL_RETRIES))
+			AuthPoolQueue(p, r, 1);
+		else
+			AuthPoolFinish(p, r, -1);
+	}
+
+	free(a);
+
+	// Never got going (refused, etc.), so don't connect again from here or a dead server
+	// would be retried forever.  Connections still being greeted pick up what's waiting.  The
+	// next connect tries the next address
+	if(c->state < AUTHCONN_READY){
+		p->connecting--;
+		p->next++;
+
+		if(!p->live)
+			AuthPoolFailAll(p);
+
+		return;
+	}
+
+	if(p->head && !p->stopping)
+		AuthPoolDispatch(p);
+}
+
+/**
+ * AuthPoolStop()
+ *
+ * NetTask handler, AuthPoolDestroy() wants the pool's thread to finish.
+ **/
+void AuthPoolStop(NetLoop *l, NetTask *t){
+	AuthPool *p = (AuthPool*)l;
+
+	p->stopping = 1;
+
+	// AuthPoolOnClose() takes each one out of all[], and fails its logins
+	while(p->nall)
+		NetConnClose(l, p->all[0]->conn);
+
+	AuthPoolFailAll(p);
+	NetLoopStop(l);
+}
+
+/**
+ * AuthPoolThread()
+ * arg:	Pool to run	[in]
+ **/
+void *AuthPoolThread(void *arg){
+	NetLoopRun(&((AuthPool*)arg)->loop);
+
+	return NULL;
+}
+
+/**
+ * AuthPoolInit()
+ * p:		Pool to start					[out]
+ * addr:	Server's name or address			[in]
+ * port:	Server's port					[in]
+ * size:	Number of connections (0 = AUTHPOOL_SIZE)	[in]
+ *
+ * Opens the connections (so they're greeted before the first login comes in), and starts the
+ * pool's thread.  addr should be "unix:/path", nothing else gets a LOCAL greeting.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int AuthPoolInit(AuthPool *p, char *addr, int port, int size){
+	int i = 0;
+
+	memset(p, 0, sizeof(AuthPool));
+
+	p->size = (size > 0) ? size : AUTHPOOL_SIZE;
+
+	if(p->size > AUTHPOOL_MAX)
+		p->size = AUTHPOOL_MAX;
+
+	if((strlen(addr) > NET_RESOLVE_HOSTMAX) || !NetResolve(addr, port, 0, &p->addrs)){
+		D(("Unable to resolve %s", addr));
+		return 0;
+	}
+
+	strcpy(p->host, addr);
+	p->port = port;
+
+	if(!NetLoopInit(&p->loop, -1))
+		return 0;
+
+	p->loop.on_open = AuthPoolOnOpen;
+	p->loop.on_frame = AuthPoolOnFrame;
+	p->loop.on_close = AuthPoolOnClose;
+
+	NetLoopLimits(&p->loop, AUTHPOOL_MAXFRAME, 0);
+
+	for(i = 0; i < p->size; i++)
+		AuthPoolConnect(p);
+
+	if(pthread_create(&p->thread, NULL, AuthPoolThread, p) != 0){
+		perror("pthread_create()");
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * AuthPoolAuthenticate()
+ * p:		Pool to log in with		[in/out]
+ * user:	Username			[in]
+ * pass:	Password			[in]
+ * cb:		Called with the answer		[in]
+ * arg:		Passed on to cb			[in]
+ *
+ * Queues a login and returns right away.  cb is called on the pool's thread.  Can be called
+ * from any thread.
+ *
+ * The frame is "<id> <user> <pass>", so a username has to be there and can't have a space in it
+ * (the password is the rest of the frame, anything goes).  Those are turned down here, a frame the
+ * server can't read would cost every other login on the connection.
+ *
+ * Returns 0 if the login couldn't be queued (cb won't be called), 1 on success.
+ **/
+int AuthPoolAuthenticate(AuthPool *p, const char *user, const char *pass, AuthCallback cb, void *arg){
+	AuthReq *r = NULL;
+
+	if(!*user || strchr(user, ' ') || (strlen(user) > AUTH_USER_MAX) || (strlen(pass) > AUTH_PASS_MAX))
+		return 0;
+
+	if(!(r = (AuthReq*)calloc(1, sizeof(AuthReq))))
+		return 0;
+
+	strcpy(r->user, user);
+	strcpy(r->pass, pass);
+
+	r->cb = cb;
+	r->arg = arg;
+	r->task.fn = AuthPoolSubmit;
+
+	NetLoopPost(&p->loop, &r->task);
+
+	return 1;
+}
+
+/**
+ * AuthPoolDestroy()
+ * p:	Pool to shut down	[in/out]
+ *
+ * Closes every connection and stops the pool's thread.  Logins that haven't been answered yet are
+ * failed (-1) before it returns.  Nothing can be using the pool anymore, from any thread.
+ **/
+void AuthPoolDestroy(AuthPool *p){
+	NetTask stop;
+
+	memset(&stop, 0, sizeof(stop));
+	stop.fn = AuthPoolStop;
+
+	// Anything posted before this is handled (and failed) first
+	NetLoopPost(&p->loop, &stop);
+
+	pthread_join(p->thread, NULL);
+
+	NetLoopFree(&p->loop);
+}
+
+/**
+ * struct __authwait {}
+ *
+ * Used by AuthPoolAuthenticateWait() to wait for the callback.
+ **/
+typedef struct __authwait {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	int done;
+	int result;
+} AuthWait;
+
+void AuthPoolWaitDone(void *arg, int result){
+	AuthWait *w = (AuthWait*)arg;
+
+	pthread_mutex_lock(&w->lock);
+
+	w->result = result;
+	w->done = 1;
+
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * AuthPoolAuthenticateWait()
+ *
+ * Same as AuthPoolAuthenticate(), but waits for the answer and returns it.
+ **/
+int AuthPoolAuthenticateWait(AuthPool *p, const char *user, const char *pass){
+	AuthWait w;
+
+	memset(&w, 0, sizeof(w));
+
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+
+	if(!AuthPoolAuthenticate(p, user, pass, AuthPoolWaitDone, &w))
+		return -1;
+
+	pthread_mutex_lock(&w.lock);
+
+	while(!w.done)
+		pthread_cond_wait(&w.cond, &w.lock);
+
+	pthread_mutex_unlock(&w.lock);
+
+	pthread_mutex_destroy(&w.lock);
+	pthread_cond_destroy(&w.cond);
+
+	return w.result;
+}
+
+/**
+ * AuthPoolStats()
+ * p:	Pool to show stats of	[in]
+ **/
+void AuthPoolStats(AuthPool *p){
+	D(("%lu logins, %lu on a connection that was already used, %lu connects, %lu failed, peak %lu going on one connection",
+		p->requests, p->reused, p->connects, p->failed, p->peak));
+}
+
+#endif
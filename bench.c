@@ -0,0 +1,416 @@
+/****************************
+ * Bench.c
+ *
+ * Connection scaling benchmark for the server.
+ *
+ * Opens n connections at once (non-blocking, all driven by one epoll loop), keeps every one of
+ * them open until it has received the server's greeting, then closes them all.  Shows how long
+ * that took and how many connections per second the server got through.
+ *
+ * With -l, measures latency instead, one request at a time, for each server given (e.g. the same
+ * server on a unix socket and on TCP loopback):
+ *	connect		connect() until the connection can take a login (greeted & pipelining)
+ *	round trip	one pipelined login, sent until answered, on an open connection
+ *	throughput	logins/s with LATENCY_WINDOW of them going at once
+ * The login is for a user that doesn't exist, so no time goes into checking a password.  Over TCP
+ * (or as a user the server doesn't trust) it's answered DENIED without going to the server's pool
+ * at all (see server.c), so only the unix socket numbers include the pool's hop.  A server given
+ * as "shm:/path" is its unix socket, moved over to shared memory (see shmring.h).
+ *
+ * Usage: bench <address> <port> [connections ...]
+ *	  bench -l <count> <address | shm:/path> <port> [<address> <port> ...]
+ ****************************/
+#include "event.h"
+
+#define GREETING_FRAMES	2
+#define LATENCY_USER	"nosuchuser"
+#define LATENCY_WINDOW	64
+
+typedef struct __benchconn {
+	int fd;
+	int frames;
+	NetReader in;
+} benchconn;
+
+/**
+ * bench_connect()
+ * net:		Address of the server	[in]
+ *
+ * Starts a non-blocking connect().  Returns the socket, or -1 on failure.
+ **/
+int bench_connect(NetAddrs *net){
+	int s = -1, local = (net->addr[0].ss_family == AF_UNIX);
+
+	// A unix socket's connect() is done right away, or fails with EAGAIN if the backlog is full,
+	// so let it block until there's room
+	if((s = socket(net->addr[0].ss_family, SOCK_STREAM | SOCK_CLOEXEC | (local ? 0 : SOCK_NONBLOCK), 0)) == -1){
+		perror("socket()");
+		return -1;
+	}
+
+	if((connect(s, (struct sockaddr*)&net->addr[0], net->len[0]) == -1) && (errno != EINPROGRESS)){
+		perror("connect()");
+		close(s);
+		return -1;
+	}
+
+	if(local)
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+
+	return s;
+}
+
+/**
+ * bench_run()
+ * net:		Address of the server		[in]
+ * n:		Number of connections to open	[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int bench_run(NetAddrs *net, int n){
+	struct epoll_event ev, events[NET_EVENTS];
+	benchconn *conns = NULL, *c = NULL;
+
+	int epfd = -1, i = 0, k = 0, opened = 0, done = 0, failed = 0, len = 0, ret = 0;
+	char *data = NULL;
+
+	uint64_t start = 0, connected = 0, end = 0;
+
+	if(!(conns = (benchconn*)calloc(n, sizeof(benchconn))))
+		return 0;
+
+	if((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1){
+		perror("epoll_create1()");
+		free(conns);
+		return 0;
+	}
+
+	start = NetNow();
+
+	for(i = 0; i < n; i++){
+		if((conns[i].fd = bench_connect(net)) == -1){
+			failed++;
+			continue;
+		}
+
+		// The greeting is tiny, no need for a full-size buffer
+		NetReaderInit(&conns[i].in, 256);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = &conns[i];
+
+		epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+
+		opened++;
+	}
+
+	connected = NetNow();
+
+	while((done + failed) < n){
+		if((k = epoll_wait(epfd, events, NET_EVENTS, 5000)) <= 0){
+			if((k == -1) && (errno == EINTR))
+				continue;
+
+			printf("Timed out with %d of %d connections greeted\n", done, n);
+			break;
+		}
+
+		for(i = 0; i < k; i++){
+			c = (benchconn*)events[i].data.ptr;
+
+			if(c->frames >= GREETING_FRAMES)
+				continue;
+
+			// A trusted local peer only gets LOCAL
+			while(NetReaderFill(&c->in, c->fd) > 0)
+				while((ret = NetReaderNext(&c->in, &data, &len)) == 1)
+					c->frames += ((len == 5) && !memcmp(data, "LOCAL", 5)) ? GREETING_FRAMES : 1;
+
+			if(c->frames >= GREETING_FRAMES)
+				done++;
+			else if(events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)){
+				failed++;
+				c->frames = GREETING_FRAMES;
+			}
+		}
+	}
+
+	end = NetNow();
+
+	printf("%8d conns: %6d ok %6d failed | connect %8.1f ms | all greeted %8.1f ms | %9.0f conns/s\n",
+		n, done, failed + (n - done - failed), (connected - start) / 1e6, (end - start) / 1e6,
+		done / ((end - start) / 1e9));
+
+	for(i = 0; i < n; i++){
+		if(conns[i].fd != -1)
+			close(conns[i].fd);
+
+		if(conns[i].in.buff)
+			NetReaderFree(&conns[i].in);
+	}
+
+	close(epfd);
+	free(conns);
+
+	return 1;
+}
+
+/**
+ * bench_send()
+ * s:		Blocking socket	[in]
+ * msg:		Frame to send	[in]
+ *
+ * NetSend() without the logging, which would be most of what's being timed.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int bench_send(int s, char *msg){
+	char buff[NET_HDRLEN + 128];
+	int len = snprintf(buff, sizeof(buff), "%0*d%s", NET_HDRLEN, (int)strlen(msg), msg);
+
+	return (len < (int)sizeof(buff)) && (write(s, buff, len) == len);
+}
+
+/**
+ * bench_ready()
+ * s:	Blocking socket that just connected	[in]
+ * r:	Reader for s				[in/out]
+ *
+ * Waits on the greeting, and switches to pipelining (trusted local peers get LOCAL, and are
+ * pipelining already).
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int bench_ready(int s, NetReader *r){
+	char buff[64];
+
+	if(NetReaderRecv(r, s, buff, sizeof(buff)) == -1)
+		return 0;
+
+	if(streq(buff, "LOCAL"))
+		return 1;
+
+	if((NetReaderRecv(r, s, buff, sizeof(buff)) == -1) || !bench_send(s, "PIPELINE"))
+		return 0;
+
+	return (NetReaderRecv(r, s, buff, sizeof(buff)) != -1) && streq(buff, "PIPELINE");
+}
+
+int bench_cmp(const void *a, const void *b){
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * bench_show()
+ * what:	What was timed		[in]
+ * t:		Times (ns), sorted here	[in/out]
+ * n:		Number of times		[in]
+ **/
+void bench_show(char *what, uint64_t *t, int n){
+	uint64_t sum = 0;
+	int i = 0;
+
+	qsort(t, n, sizeof(uint64_t), bench_cmp);
+
+	for(i = 0; i < n; i++)
+		sum += t[i];
+
+	printf("  %-10s avg %8.1f us | min %8.1f us | p50 %8.1f us | p99 %8.1f us\n", what,
+		(sum / (double)n) / 1e3, t[0] / 1e3, t[n / 2] / 1e3, t[(n * 99) / 100] / 1e3);
+}
+
+/**
+ * struct __benchlink {}
+ *
+ * Connection for -l: a socket, or shared memory rings set up over one (see shmring.h).
+ **/
+typedef struct __benchlink {
+	int sock;
+	NetReader r;
+
+	int useshm;
+	NetShm shm;
+} benchlink;
+
+/**
+ * bench_open()
+ * net:	Address of the server			[in]
+ * k:	Link to open (useshm & r set up)	[in/out]
+ *
+ * Returns 0 on failure, 1 once the link can take logins.
+ **/
+int bench_open(NetAddrs *net, benchlink *k){
+	if((k->sock = NetConnectAny(net, 0, NULL)) == -1)
+		return 0;
+
+	k->r.head = k->r.tail = 0;
+
+	if(bench_ready(k->sock, &k->r) && (!k->useshm || NetShmConnect(k->sock, &k->shm)))
+		return 1;
+
+	close(k->sock);
+	k->sock = -1;
+
+	return 0;
+}
+
+/**
+ * bench_close()
+ * k:	Link to close (if open)	[in/out]
+ **/
+void bench_close(benchlink *k){
+	if(k->sock == -1)
+		return;
+
+	if(k->useshm)
+		NetShmUnmap(&k->shm);
+
+	close(k->sock);
+	k->sock = -1;
+}
+
+/**
+ * bench_put() / bench_get()
+ *
+ * Send a frame / wait on the next one, over whichever transport k is.
+ **/
+int bench_put(benchlink *k, char *msg){
+	return k->useshm ? NetShmSend(&k->shm, msg, strlen(msg)) : bench_send(k->sock, msg);
+}
+
+int bench_get(benchlink *k, char *buff, int size){
+	return k->useshm ? NetShmRecv(&k->shm, buff, size) : NetReaderRecv(&k->r, k->sock, buff, size);
+}
+
+/**
+ * bench_latency()
+ * addr:	Server to time ("shm:/path" = unix socket moved to shared memory)	[in]
+ * port:	Its port								[in]
+ * n:		Number of requests							[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int bench_latency(char *addr, int port, int n){
+	char buff[128], name[NET_RESOLVE_HOSTMAX + 1];
+	uint64_t *t = NULL, start = 0;
+	NetAddrs net;
+	benchlink k;
+	int i = 0, sent = 0, ok = 0;
+
+	memset(&k, 0, sizeof(k));
+	k.sock = -1;
+
+	if((k.useshm = !strncmp(addr, "shm:", 4)))
+		snprintf(name, sizeof(name), "unix:%s", addr + 4);
+	else
+		snprintf(name, sizeof(name), "%s", addr);
+
+	if(!NetResolve(name, port, 0, &net) || !(t = (uint64_t*)calloc(n, sizeof(uint64_t))) || !NetReaderInit(&k.r, 256)){
+		free(t);
+		return 0;
+	}
+
+	printf("%s%s\n", NetAddrString(&net.addr[0], buff, sizeof(buff)), k.useshm ? " (shared memory)" : "");
+
+	for(i = 0; i < n; i++){
+		start = NetNow();
+		ok = bench_open(&net, &k);
+		t[i] = NetNow() - start;
+
+		bench_close(&k);
+
+		if(!ok)
+			goto done;
+	}
+
+	bench_show("connect", t, n);
+
+	ok = 0;
+
+	if(!bench_open(&net, &k))
+		goto done;
+
+	for(i = 0; i < n; i++){
+		snprintf(buff, sizeof(buff), "%d %s x", i % 1000, LATENCY_USER);
+
+		start = NetNow();
+
+		if(!bench_put(&k, buff) || (bench_get(&k, buff, sizeof(buff)) == -1))
+			goto done;
+
+		t[i] = NetNow() - start;
+	}
+
+	bench_show("round trip", t, n);
+
+	// Throughput: keep LATENCY_WINDOW logins going
+	start = NetNow();
+
+	for(i = 0; i < n; i++){
+		while((sent < n) && ((sent - i) < LATENCY_WINDOW)){
+			snprintf(buff, sizeof(buff), "%d %s x", sent++ % 1000, LATENCY_USER);
+
+			if(!bench_put(&k, buff))
+				goto done;
+		}
+
+		if(bench_get(&k, buff, sizeof(buff)) == -1)
+			goto done;
+	}
+
+	printf("  %-10s %.0f logins/s (%d at a time)\n", "throughput", n / ((NetNow() - start) / 1e9), LATENCY_WINDOW);
+
+	ok = 1;
+
+done:
+	if(!ok)
+		printf("  Failed after %d requests\n", i);
+
+	bench_close(&k);
+	NetReaderFree(&k.r);
+	free(t);
+
+	return ok;
+}
+
+int main(int argc, char *argv[]){
+	int sizes[] = {100, 1000, 10000};
+	NetAddrs net;
+	int i = 0, n = 0;
+
+	if(argc < 3){
+		printf("Usage: %s <address> <port> [connections ...]\n", argv[0]);
+		printf("       %s -l <count> <address | shm:/path> <port> [<address> <port> ...]\n", argv[0]);
+		return 0;
+	}
+
+	NetRaiseFdLimit();
+
+	if(streq(argv[1], "-l")){
+		if(((n = atoi(argv[2])) <= 0) || (argc < 5))
+			return 0;
+
+		for(i = 3; (i + 1) < argc; i += 2)
+			bench_latency(argv[i], atoi(argv[i + 1]), n);
+
+		return 0;
+	}
+
+	if(!NetResolve(argv[1], atoi(argv[2]), 0, &net)){
+		printf("Bad address: %s\n", argv[1]);
+		return 0;
+	}
+
+	if(argc > 3){
+		for(i = 3; i < argc; i++)
+			bench_run(&net, atoi(argv[i]));
+	} else{
+		for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+			bench_run(&net, sizes[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,499 @@
+/****************************
+ * Bulk.h
+ *
+ * Bulk transfer: moves a whole file over a connection, enciphered.
+ *
+ * Frames top out at NET_MAXFRAME bytes, which is no good for files.  A bulk transfer is one
+ * "BULK <bytes>" frame, followed by that many bytes of enciphered data with no framing, and the
+ * receiver answers with a "BULK OK <bytes> <sum>" frame once it has all of it (sum is a checksum
+ * of the plain-text, so the sender knows it arrived intact).
+ *
+ * The cipher is the Vigenere cipher (see vc.h) done on bytes instead of printable characters:
+ *	C[n] = (P[n] + K[n % keylen]) % 256
+ * so any chunk of the stream can be enciphered/deciphered on its own, in place, from its offset.
+ *
+ * Each side is a three stage pipeline over NET_BULK_BUFFS page-aligned chunks:
+ *	Sender:		read chunk N+2 from the file	encipher chunk N+1	send chunk N
+ *	Receiver:	recv chunk N+2			decipher chunk N+1	write chunk N
+ * The first & last stages are I/O and get their own threads, the middle one runs on the caller's
+ * thread.  Passing pipelined = 0 runs the three one after the other instead (for comparison).
+ ****************************/
+#ifndef __BULK_H
+#define __BULK_H
+
+#include "reader.h"
+
+#include <pthread.h>
+
+#define NET_BULK_CHUNK	(256 * 1024)	// Has to be a multiple of 8 (see NetBulkSum())
+#define NET_BULK_BUFFS	4
+#define NET_BULK_KEYMAX	256
+
+// Where a chunk is (each stage takes chunks in the state before it)
+enum {
+	BULK_EMPTY,	// Free for the first stage
+	BULK_FILLED,	// Read/received, waiting to be (de)ciphered
+	BULK_READY	// (De)ciphered, waiting to be sent/written
+};
+
+typedef struct __netbulkbuf {
+	char *data;
+	int len;
+	uint64_t off;
+	int state;
+} NetBulkBuf;
+
+typedef struct __netbulk NetBulk;
+
+typedef int (*NetBulkStep)(NetBulk *b, NetBulkBuf *buf);
+
+struct __netbulk {
+	int sock;
+	int fd;
+
+	uint64_t size;
+	uint64_t chunks;
+
+	// Key repeated out to NET_BULK_CHUNK + keylen bytes, so a chunk never has to wrap around it
+	char *keystream;
+	int keylen;
+
+	NetBulkBuf bufs[NET_BULK_BUFFS];
+
+	// Receiver: frame reader that might have read past the BULK frame
+	NetReader *r;
+
+	// Checksum of the plain-text, in stream order
+	uint64_t sum;
+
+	NetBulkStep steps[3];
+
+	int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/**
+ * NetBulkSum()
+ * sum:		Checksum so far			[in]
+ * data:	Plain-text			[in]
+ * len:		Number of bytes in data		[in]
+ *
+ * Cheap, order-dependent checksum over 8 byte words (only the last chunk has a partial word).
+ *
+ * Returns the new checksum.
+ **/
+uint64_t NetBulkSum(uint64_t sum, const char *data, int len){
+	uint64_t w = 0;
+	int i = 0;
+
+	for(i = 0; i + 8 <= len; i += 8){
+		memcpy(&w, data + i, 8);
+		sum = ((sum << 7) | (sum >> 57)) ^ w;
+	}
+
+	for(; i < len; i++)
+		sum = ((sum << 7) | (sum >> 57)) ^ (unsigned char)data[i];
+
+	return sum;
+}
+
+/**
+ * NetBulkInit()
+ * b:		Transfer to set up		[out]
+ * sock:	Connection to send/recv on	[in]
+ * fd:		File to read/write		[in]
+ * key:		Key to (de)cipher with		[in]
+ * keylen:	Length of key			[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetBulkInit(NetBulk *b, int sock, int fd, const char *key, int keylen){
+	long page = sysconf(_SC_PAGESIZE);
+	int i = 0;
+
+	memset(b, 0, sizeof(NetBulk));
+
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+
+	b->sock = sock;
+	b->fd = fd;
+
+	if((keylen <= 0) || (keylen > NET_BULK_KEYMAX))
+		return 0;
+
+	if(!(b->keystream = (char*)malloc(NET_BULK_CHUNK + keylen)))
+		return 0;
+
+	for(i = 0; i < NET_BULK_CHUNK + keylen; i++)
+		b->keystream[i] = key[i % keylen];
+
+	b->keylen = keylen;
+
+	for(i = 0; i < NET_BULK_BUFFS; i++){
+		if(posix_memalign((void**)&b->bufs[i].data, (page > 0) ? page : 4096, NET_BULK_CHUNK) != 0){
+			b->bufs[i].data = NULL;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * NetBulkFree()
+ * b:	Transfer to get rid of	[in/out]
+ **/
+void NetBulkFree(NetBulk *b){
+	int i = 0;
+
+	for(i = 0; i < NET_BULK_BUFFS; i++){
+		if(b->bufs[i].data){
+			memset(b->bufs[i].data, '\0', NET_BULK_CHUNK);
+			free(b->bufs[i].data);
+		}
+	}
+
+	if(b->keystream){
+		memset(b->keystream, '\0', NET_BULK_CHUNK + b->keylen);
+		free(b->keystream);
+	}
+
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->cond);
+
+	memset(b, 0, sizeof(NetBulk));
+}
+
+/**
+ * NetBulkStage()
+ * b:		Transfer to run a stage of	[in/out]
+ * stage:	Which stage (BULK_EMPTY, ...)	[in]
+ *
+ * Runs one stage over every chunk, in order, waiting for each chunk to get through the stage
+ * before this one.
+ **/
+void NetBulkStage(NetBulk *b, int stage){
+	NetBulkBuf *buf = NULL;
+	uint64_t i = 0;
+	int ok = 0, failed = 0;
+
+	for(i = 0; i < b->chunks; i++){
+		buf = &b->bufs[i % NET_BULK_BUFFS];
+
+		pthread_mutex_lock(&b->lock);
+
+		while((buf->state != stage) && !b->failed)
+			pthread_cond_wait(&b->cond, &b->lock);
+
+		failed = b->failed;
+
+		pthread_mutex_unlock(&b->lock);
+
+		if(failed)
+			return;
+
+		if(stage == BULK_EMPTY){
+			buf->off = i * NET_BULK_CHUNK;
+			buf->len = ((b->size - buf->off) < NET_BULK_CHUNK) ? (int)(b->size - buf->off) : NET_BULK_CHUNK;
+		}
+
+		ok = b->steps[stage](b, buf);
+
+		pthread_mutex_lock(&b->lock);
+
+		if(ok)
+			buf->state = (stage + 1) % 3;
+		else
+			b->failed = 1;
+
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->lock);
+
+		if(!ok)
+			return;
+	}
+}
+
+void *NetBulkFirst(void *arg){
+	NetBulkStage((NetBulk*)arg, BULK_EMPTY);
+
+	return NULL;
+}
+
+void *NetBulkLast(void *arg){
+	NetBulkStage((NetBulk*)arg, BULK_READY);
+
+	return NULL;
+}
+
+/**
+ * NetBulkRun()
+ * b:		Transfer with its steps set	[in/out]
+ * pipelined:	Overlap the three stages	[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetBulkRun(NetBulk *b, int pipelined){
+	pthread_t first, last;
+	uint64_t i = 0;
+	int j = 0;
+
+	b->chunks = (b->size + NET_BULK_CHUNK - 1) / NET_BULK_CHUNK;
+
+	if(!pipelined){
+		NetBulkBuf *buf = &b->bufs[0];
+
+		for(i = 0; (i < b->chunks) && !b->failed; i++){
+			buf->off = i * NET_BULK_CHUNK;
+			buf->len = ((b->size - buf->off) < NET_BULK_CHUNK) ? (int)(b->size - buf->off) : NET_BULK_CHUNK;
+
+			for(j = 0; (j < 3) && !b->failed; j++)
+				b->failed = !b->steps[j](b, buf);
+		}
+
+		return !b->failed;
+	}
+
+	if(pthread_create(&first, NULL, NetBulkFirst, b) != 0)
+		return 0;
+
+	if(pthread_create(&last, NULL, NetBulkLast, b) != 0){
+		pthread_mutex_lock(&b->lock);
+		b->failed = 1;
+		pthread_cond_broadcast(&b->cond);
+		pthread_mutex_unlock(&b->lock);
+
+		pthread_join(first, NULL);
+		return 0;
+	}
+
+	NetBulkStage(b, BULK_FILLED);
+
+	pthread_join(first, NULL);
+	pthread_join(last, NULL);
+
+	return !b->failed;
+}
+
+/**
+ * Sender's steps
+ **/
+int NetBulkRead(NetBulk *b, NetBulkBuf *buf){
+	ssize_t got = 0;
+	int pos = 0;
+
+	while(pos < buf->len){
+		if((got = pread(b->fd, buf->data + pos, buf->len - pos, buf->off + pos)) <= 0){
+			if((got == -1) && (errno == EINTR))
+				continue;
+
+			perror("pread()");
+			return 0;
+		}
+
+		pos += got;
+	}
+
+	return 1;
+}
+
+/**
+ * NetBulkCipher()
+ * data:	Chunk to (de)cipher in place		[in/out]
+ * key:		Keystream lined up with data		[in]
+ * len:		Number of bytes in data			[in]
+ * decipher:	Subtract the key instead of adding it	[in]
+ *
+ * Does 8 bytes at a time, each byte % 256 on its own (the top bits are kept out of the add, so
+ * nothing carries into the next byte).
+ **/
+void NetBulkCipher(char *data, const char *key, int len, int decipher){
+	const uint64_t hi = 0x8080808080808080ULL, lo = 0x7f7f7f7f7f7f7f7fULL;
+	uint64_t d = 0, k = 0;
+	int i = 0;
+
+	for(i = 0; i + 8 <= len; i += 8){
+		memcpy(&d, data + i, 8);
+		memcpy(&k, key + i, 8);
+
+		if(decipher)
+			d = ((d | hi) - (k & lo)) ^ ((d ^ ~k) & hi);
+		else
+			d = ((d & lo) + (k & lo)) ^ ((d ^ k) & hi);
+
+		memcpy(data + i, &d, 8);
+	}
+
+	for(; i < len; i++)
+		data[i] = decipher ? (char)(data[i] - key[i]) : (char)(data[i] + key[i]);
+}
+
+int NetBulkEncipher(NetBulk *b, NetBulkBuf *buf){
+	b->sum = NetBulkSum(b->sum, buf->data, buf->len);
+
+	NetBulkCipher(buf->data, b->keystream + (buf->off % b->keylen), buf->len, 0);
+
+	return 1;
+}
+
+int NetBulkSendChunk(NetBulk *b, NetBulkBuf *buf){
+	ssize_t sent = 0;
+	int pos = 0, more = ((buf->off + buf->len) < b->size) ? MSG_MORE : 0;
+
+	while(pos < buf->len){
+		NetStatsAdd(sends);
+
+		if((sent = send(b->sock, buf->data + pos, buf->len - pos, MSG_NOSIGNAL | more)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			NetSockErr(errno);
+			return 0;
+		}
+
+		pos += sent;
+	}
+
+	return 1;
+}
+
+/**
+ * Receiver's steps
+ **/
+int NetBulkRecvChunk(NetBulk *b, NetBulkBuf *buf){
+	int pos = 0, left = 0;
+
+	// Whatever the frame reader already pulled in past the BULK frame comes first
+	if(b->r && ((left = b->r->tail - b->r->head) > 0)){
+		pos = (left < buf->len) ? left : buf->len;
+
+		memcpy(buf->data, b->r->buff + b->r->head, pos);
+		b->r->head += pos;
+	}
+
+	return (pos == buf->len) || NetRecvAll(b->sock, buf->data + pos, buf->len - pos);
+}
+
+int NetBulkDecipher(NetBulk *b, NetBulkBuf *buf){
+	NetBulkCipher(buf->data, b->keystream + (buf->off % b->keylen), buf->len, 1);
+
+	b->sum = NetBulkSum(b->sum, buf->data, buf->len);
+
+	return 1;
+}
+
+int NetBulkWrite(NetBulk *b, NetBulkBuf *buf){
+	ssize_t put = 0;
+	int pos = 0;
+
+	// Nowhere to put it (i.e.: just checking it arrives)
+	if(b->fd < 0)
+		return 1;
+
+	while(pos < buf->len){
+		if((put = write(b->fd, buf->data + pos, buf->len - pos)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			perror("write()");
+			return 0;
+		}
+
+		pos += put;
+	}
+
+	return 1;
+}
+
+/**
+ * NetBulkSend()
+ * sock:	Connection to send on			[in]
+ * r:		Reader for sock (for the answer)	[in/out]
+ * fd:		File to send				[in]
+ * size:	Number of bytes of fd to send		[in]
+ * key:		Key to encipher with			[in]
+ * keylen:	Length of key				[in]
+ * pipelined:	Overlap read/encipher/send		[in]
+ *
+ * Sends size bytes of fd as a bulk transfer, and waits for the receiver to confirm it.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetBulkSend(int sock, NetReader *r, int fd, uint64_t size, const char *key, int keylen, int pipelined){
+	char buff[64];
+	unsigned long long got = 0, sum = 0;
+	NetBulk b;
+	int ok = 0;
+
+	if(!NetBulkInit(&b, sock, fd, key, keylen)){
+		NetBulkFree(&b);
+		return 0;
+	}
+
+	b.size = size;
+	b.steps[BULK_EMPTY] = NetBulkRead;
+	b.steps[BULK_FILLED] = NetBulkEncipher;
+	b.steps[BULK_READY] = NetBulkSendChunk;
+
+	snprintf(buff, sizeof(buff), "BULK %llu", (unsigned long long)size);
+
+	if(NetSend(sock, buff) && NetBulkRun(&b, pipelined) && (NetReaderRecv(r, sock, buff, sizeof(buff)) != -1)){
+		if((sscanf(buff, "BULK OK %llu %llu", &got, &sum) == 2) && (got == size) && (sum == b.sum))
+			ok = 1;
+		else
+			D(("Bulk transfer didn't arrive intact (%s)", buff));
+	}
+
+	NetBulkFree(&b);
+
+	return ok;
+}
+
+/**
+ * NetBulkRecv()
+ * sock:	Connection to receive on		[in]
+ * r:		Reader for sock				[in/out]
+ * fd:		File to write to (-1 = throw it away)	[in]
+ * key:		Key to decipher with			[in]
+ * keylen:	Length of key				[in]
+ * pipelined:	Overlap recv/decipher/write		[in]
+ *
+ * Takes a bulk transfer (starting with its BULK frame), and confirms it to the sender.
+ *
+ * Returns the number of bytes received, or -1 on failure.
+ **/
+int64_t NetBulkRecv(int sock, NetReader *r, int fd, const char *key, int keylen, int pipelined){
+	char buff[64];
+	unsigned long long size = 0;
+	NetBulk b;
+	int64_t ret = -1;
+
+	if((NetReaderRecv(r, sock, buff, sizeof(buff)) == -1) || (sscanf(buff, "BULK %llu", &size) != 1))
+		return -1;
+
+	if(!NetBulkInit(&b, sock, fd, key, keylen)){
+		NetBulkFree(&b);
+		return -1;
+	}
+
+	b.size = size;
+	b.r = r;
+	b.steps[BULK_EMPTY] = NetBulkRecvChunk;
+	b.steps[BULK_FILLED] = NetBulkDecipher;
+	b.steps[BULK_READY] = NetBulkWrite;
+
+	if(NetBulkRun(&b, pipelined)){
+		snprintf(buff, sizeof(buff), "BULK OK %llu %llu", size, (unsigned long long)b.sum);
+
+		if(NetSend(sock, buff))
+			ret = (int64_t)size;
+	}
+
+	NetBulkFree(&b);
+
+	return ret;
+}
+
+#endif
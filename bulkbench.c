@@ -0,0 +1,164 @@
+/****************************
+ * BulkBench.c
+ *
+ * Bulk transfer benchmark (see bulk.h).
+ *
+ * Sends a file of the given size over loopback to a receiver thread, first with the stages run
+ * one after the other, then pipelined, and shows end-to-end MB/s for each (from the BULK frame
+ * going out to the receiver confirming the checksum).  The file is made up in memory (memfd), and
+ * the receiver throws the data away after deciphering it, so disks don't get in the way.
+ *
+ * Usage: bulkbench [MB] [runs]
+ ****************************/
+#include "event.h"
+#include "bulk.h"
+
+#include <sys/mman.h>
+#include <sys/random.h>
+
+typedef struct __bulkpeer {
+	int listen;
+	int pipelined;
+
+	char *key;
+	int keylen;
+
+	int64_t got;
+} bulkpeer;
+
+void *bulk_receiver(void *arg){
+	bulkpeer *p = (bulkpeer*)arg;
+	NetReader r;
+	int s = -1;
+
+	p->got = -1;
+
+	if((s = accept(p->listen, NULL, NULL)) == -1){
+		perror("accept()");
+		return NULL;
+	}
+
+	if(NetReaderInit(&r, 256)){
+		p->got = NetBulkRecv(s, &r, -1, p->key, p->keylen, p->pipelined);
+		NetReaderFree(&r);
+	}
+
+	close(s);
+
+	return NULL;
+}
+
+/**
+ * bulk_run()
+ * listen:	Listening socket for the receiver	[in]
+ * port:	Port it's on				[in]
+ * fd:		File to send				[in]
+ * size:	Size of the file			[in]
+ * pipelined:	Run the stages overlapped		[in]
+ *
+ * Returns MB/s, or 0 on failure.
+ **/
+double bulk_run(int listen, int port, int fd, uint64_t size, int pipelined){
+	char key[32];
+	pthread_t thread;
+	bulkpeer peer;
+	NetReader r;
+	uint64_t start = 0, end = 0;
+	int s = 0, ok = 0;
+
+	if(getrandom(key, sizeof(key), 0) != sizeof(key))
+		return 0;
+
+	memset(&peer, 0, sizeof(peer));
+
+	peer.listen = listen;
+	peer.pipelined = pipelined;
+	peer.key = key;
+	peer.keylen = sizeof(key);
+
+	if(pthread_create(&thread, NULL, bulk_receiver, &peer) != 0)
+		return 0;
+
+	if(!(s = NetClientCreate("127.0.0.1", port)) || !NetReaderInit(&r, 256)){
+		pthread_join(thread, NULL);
+		return 0;
+	}
+
+	start = NetNow();
+	ok = NetBulkSend(s, &r, fd, size, key, sizeof(key), pipelined);
+	end = NetNow();
+
+	NetReaderFree(&r);
+	close(s);
+
+	pthread_join(thread, NULL);
+
+	if(!ok || (peer.got != (int64_t)size))
+		return 0;
+
+	return (size / (1024.0 * 1024.0)) / ((end - start) / 1e9);
+}
+
+int main(int argc, char *argv[]){
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	uint64_t size = 0, i = 0, x = 88172645463325252ULL;
+	uint64_t *page = NULL;
+	double seq = 0, pipe = 0, mbs = 0;
+	int fd = -1, listen = 0, port = 0, runs = 0, n = 0;
+
+	size = (uint64_t)((argc > 1) ? atoi(argv[1]) : 256) * 1024 * 1024;
+	runs = (argc > 2) ? atoi(argv[2]) : 3;
+
+	if((fd = memfd_create("bulkbench", 0)) == -1){
+		perror("memfd_create()");
+		return 1;
+	}
+
+	if(ftruncate(fd, size) == -1){
+		perror("ftruncate()");
+		return 1;
+	}
+
+	// Something that isn't all zeroes (xorshift)
+	if((page = (uint64_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+		perror("mmap()");
+		return 1;
+	}
+
+	for(i = 0; i < size / 8; i++){
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		page[i] = x;
+	}
+
+	munmap(page, size);
+
+	// Any free port
+	if(!(listen = NetServerListen("127.0.0.1", 0, 1, 0)) || (getsockname(listen, (struct sockaddr*)&addr, &len) == -1))
+		return 1;
+
+	port = ntohs(addr.sin_port);
+
+	for(n = 0; n < runs; n++){
+		if((mbs = bulk_run(listen, port, fd, size, 0)) > seq)
+			seq = mbs;
+
+		if((mbs = bulk_run(listen, port, fd, size, 1)) > pipe)
+			pipe = mbs;
+
+		if(!seq || !pipe){
+			printf("Transfer failed\n");
+			return 1;
+		}
+	}
+
+	printf("%lu MB, %d KB chunks, best of %d: sequential %8.1f MB/s | pipelined %8.1f MB/s (%.2fx)\n",
+		(unsigned long)(size / (1024 * 1024)), NET_BULK_CHUNK / 1024, runs, seq, pipe, pipe / seq);
+
+	close(listen);
+	close(fd);
+
+	return 0;
+}
@@ -1,6 +1,78 @@
-#include "network.h"
+#include "authpool.h"
+
+/**
+ * Counts answers from pooled_logins().
+ **/
+struct __logins {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	int left;
+	int ok;
+	int fail;
+	int error;
+} logins = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0};
+
+void login_done(void *arg, int result){
+	pthread_mutex_lock(&logins.lock);
+
+	if(result == 1)
+		logins.ok++;
+	else if(result == 0)
+		logins.fail++;
+	else
+		logins.error++;
+
+	if(--logins.left == 0)
+		pthread_cond_signal(&logins.cond);
+
+	pthread_mutex_unlock(&logins.lock);
+}
+
+/**
+ * pooled_logins()
+ *
+ * Runs n logins at once over an AuthPool, the way the PAM module does.
+ **/
+int pooled_logins(char *addr, int port, char *user, char *pass, int n){
+	AuthPool pool;
+	uint64_t start = 0;
+	int i = 0;
+
+	if(!AuthPoolInit(&pool, addr, port, 0))
+		return 0;
+
+	logins.left = n;
+	start = NetNow();
+
+	for(i = 0; i < n; i++)
+		if(!AuthPoolAuthenticate(&pool, user, pass, login_done, NULL))
+			login_done(NULL, -1);
+
+	pthread_mutex_lock(&logins.lock);
+
+	while(logins.left > 0)
+		pthread_cond_wait(&logins.cond, &logins.lock);
+
+	pthread_mutex_unlock(&logins.lock);
+
+	D(("%d logins in %.1f ms: %d OK, %d FAIL, %d errors", n, (NetNow() - start) / 1e6,
+		logins.ok, logins.fail, logins.error));
+
+	// Stats belong to the pool's thread, but every login is done by now
+	AuthPoolStats(&pool);
+	NetResolveStats();
+
+	AuthPoolDestroy(&pool);
+
+	return 1;
+}
 
 int main(int argc, char *argv[]){
+	// Number of logins given?  Then run them through a connection pool
+	if(argc > 5)
+		return !pooled_logins(argv[1], atoi(argv[2]), argv[3], argv[4], atoi(argv[5]));
+
 	D(("Creating client socket..."));
 
 	int socket = NetClientCreate(argv[1], atoi(argv[2]));
@@ -10,14 +82,40 @@ int main(int argc, char *argv[]){
 
 	D(("Socket created %d", socket));
 
-	char *buff = mem(65535);
+	char *buff = mem(NET_MAXFRAME + 1);
+
+	NetReader r;
 
-	NetRecv(socket, buff);
+	if(!NetReaderInit(&r, 0))
+		return 0;
+
+	// Both messages can come in the same read, the reader hands them out one at a time
+	NetReaderRecv(&r, socket, buff, NET_MAXFRAME + 1);
 D(("-- buff = %s", buff));
-//	mem0str(buff);
-	NetRecv(socket, buff);
+
+	// Server trusts us (local unix socket): no second greeting, and logins are pipelined
+	if(streq(buff, "LOCAL")){
+		if(argc > 4){
+			snprintf(buff, NET_MAXFRAME + 1, "0 %s %s", argv[3], argv[4]);
+			NetSend(socket, buff);
+
+			if(NetReaderRecv(&r, socket, buff, NET_MAXFRAME + 1) != -1)
+				D(("Server responded with %s", buff));
+		}
+	} else{
+		NetReaderRecv(&r, socket, buff, NET_MAXFRAME + 1);
 D(("-- buff = %s", buff));
 
+		// Server would only answer DENIED, and the password would have gone over the wire for nothing
+		if(argc > 4)
+			D(("Not logging in, the server only checks passwords over a trusted unix socket"));
+	}
+
+	NetReaderFree(&r);
+
+	NetStatsPrint();
+	NetResolveStats();
+
 	mem0str(buff);
 
 	return 0;
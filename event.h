@@ -0,0 +1,969 @@
+/****************************
+ * Event.h
+ *
+ * Event loop for the server.
+ *
+ * One thread handles every connection: sockets are non-blocking, and whenever something happens
+ * the loop reads everything there is (see reader.h) and sends whatever is waiting to go out.
+ * Nothing blocks, so there's no limit on connections other than the fd limit (see
+ * NetRaiseFdLimit()).
+ *
+ * There are two backends with the same interface:
+ *	epoll		(default) Edge-triggered, each socket registered once for EPOLLIN | EPOLLOUT
+ *	io_uring	(-DNET_URING) See uring.h
+ *
+ * What a connection does is up to the handlers given to the loop:
+ *	on_open()	New connection (queue a greeting, set the first state, etc.)
+ *	on_frame()	A complete frame came in
+ *	on_close()	Connection is about to go away
+ *
+ * on_open() & on_frame() return 0 to close the connection.  NetConn.state is left to the
+ * handlers to use for where the connection is in its conversation.
+ *
+ * Other threads (see pool.h) hand results back with NetLoopPost(), which wakes the loop through
+ * an eventfd.  Posted tasks run on the loop's thread, so they can touch connections freely.
+ *
+ * Memory per connection is bounded (see NetLoopLimits()): frames over the loop's max frame size
+ * are refused from their header, a connection only holds a read buffer (a slab, see slab.h)
+ * while it has part of a frame buffered, and what's queued to go out is capped at the budget.
+ *
+ * A connection from a trusted local peer can move from its socket to shared memory rings (see
+ * shmring.h), the handlers don't see a difference.
+ *
+ * Handlers give a connection a deadline with NetConnDeadline() for whatever it's waiting on the
+ * peer for (see timer.h), a connection that's still waiting when it comes due is closed.
+ ****************************/
+#ifndef __EVENT_H
+#define __EVENT_H
+
+// First, so global.h gets to set _GNU_SOURCE (accept4()) before any system header
+#include "reader.h"
+#include "slab.h"
+#include "timer.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+// Events handled per epoll_wait()
+#define NET_EVENTS	256
+
+// Default cap on what can be queued to go out to one connection
+#define NET_CONN_BUDGET	(64 * 1024)
+
+typedef struct __netconn NetConn;
+typedef struct __netloop NetLoop;
+typedef struct __nettask NetTask;
+typedef struct __netshmconn NetShmConn;
+
+/**
+ * struct __nettask {}
+ *
+ * Something for the loop's thread to run (see NetLoopPost()).  If conn is set, it's held until
+ * fn has run, and flushed afterwards.
+ **/
+struct __nettask {
+	void (*fn)(NetLoop *l, NetTask *t);
+
+	NetConn *conn;
+	NetTask *next;
+};
+
+struct __netconn {
+	int fd;
+	int state;
+
+	NetLoop *loop;
+
+	// Close once everything queued has been sent (and no task is still working on a reply)
+	int closing;
+
+	// Posted tasks still on their way for it (see PoolSubmit())
+	int tasks;
+
+	// Other side is done sending, nothing more is read (see NetLoopRead())
+	int rdhup;
+
+	// Closed, but tasks still point at it (freed once refs drops to 0)
+	int closed;
+	int refs;
+
+	// Next closed connection waiting to be freed (see NetLoopReap())
+	NetConn *dead;
+
+	NetReader in;
+
+	// Frames waiting to be sent
+	char *out;
+	int outlen;
+	int outpos;
+	int outsize;
+
+	// io_uring only: registered buffer in use (-1 = none), send in flight & the buffer it's using
+	int slot;
+	int sending;
+	char *outprev;
+
+	char ip[INET6_ADDRSTRLEN];
+
+	// Unix socket peers: who's on the other end (SO_PEERCRED, see NetConnOpen())
+	int local;
+	struct ucred cred;
+
+	// Moved to shared memory rings (see shmring.h)
+	NetShmConn *shm;
+
+	// Deadline (see NetConnDeadline())
+	NetTimer timer;
+
+	void *data;
+};
+
+struct __netloop {
+	int epfd;
+	int listen;
+	int running;
+
+	// Which shard this loop is (see shard.h)
+	int id;
+
+	// io_uring backend's state (see uring.h)
+	void *ring;
+
+	// Tasks posted from other threads
+	int wakefd;
+	pthread_mutex_t lock;
+	NetTask *tasks;
+	NetTask *tasks_tail;
+
+	// Closed connections, freed after the events that might still point at them are done
+	NetConn *dead;
+
+	// Per-connection limits (see NetLoopLimits()) & read buffers
+	int maxframe;
+	int budget;
+	NetSlabs slabs;
+
+	// Connections' deadlines
+	NetTimers timers;
+
+	int (*on_open)(NetLoop *l, NetConn *c);
+	int (*on_frame)(NetLoop *l, NetConn *c, char *data, int len);
+	void (*on_close)(NetLoop *l, NetConn *c);
+
+	// Stats
+	uint64_t conns;
+	uint64_t peak;
+	uint64_t accepted;
+	uint64_t closed;
+	uint64_t freed;
+	uint64_t posted;
+	uint64_t timeouts;
+};
+
+// Provided by the backend
+int NetConnAttach(NetLoop *l, NetConn *c);
+int NetConnFlush(NetConn *c);
+void NetConnShut(NetLoop *l, NetConn *c);
+void NetConnFree(NetConn *c);
+
+// Provided by shmring.h
+int NetShmFlush(NetConn *c);
+void NetShmClose(NetLoop *l, NetConn *c);
+
+/**
+ * NetNow()
+ *
+ * Returns a monotonic timestamp in nanoseconds.
+ **/
+uint64_t NetNow(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * NetSetNonBlock()
+ * sock:	Socket to make non-blocking	[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetSetNonBlock(int sock){
+	int flags = fcntl(sock, F_GETFL, 0);
+
+	if((flags == -1) || (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)){
+		perror("fcntl()");
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * NetRaiseFdLimit()
+ *
+ * Raises the soft limit on open files up to the hard limit (each connection is one fd).
+ *
+ * Returns the new limit.
+ **/
+int NetRaiseFdLimit(){
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == -1){
+		perror("getrlimit()");
+		return 0;
+	}
+
+	rl.rlim_cur = rl.rlim_max;
+
+	if(setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		perror("setrlimit()");
+
+	getrlimit(RLIMIT_NOFILE, &rl);
+
+	D(("Open file limit is %lu", (unsigned long)rl.rlim_cur));
+
+	return (int)rl.rlim_cur;
+}
+
+/**
+ * NetLoopSetup()
+ * l:		Loop to set up				[out]
+ * listen:	Listening socket (-1 = none, client side)	[in]
+ *
+ * Backend-independent part of NetLoopInit().
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetLoopSetup(NetLoop *l, int listen){
+	memset(l, 0, sizeof(NetLoop));
+
+	l->listen = listen;
+	l->epfd = -1;
+
+	l->maxframe = NET_MAXFRAME;
+	l->budget = NET_CONN_BUDGET;
+
+	NetSlabInit(&l->slabs, NET_HDRLEN + l->maxframe);
+	NetTimersInit(&l->timers, NetNow());
+
+	if((listen >= 0) && !NetSetNonBlock(listen))
+		return 0;
+
+	pthread_mutex_init(&l->lock, NULL);
+
+	if((l->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1){
+		perror("eventfd()");
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * NetLoopLimits()
+ * l:		Loop to set the limits of (no connections yet)		[in/out]
+ * maxframe:	Largest frame a peer can send (0 = NET_MAXFRAME)	[in]
+ * budget:	Bytes that can wait to go out to one connection (0 = NET_CONN_BUDGET)	[in]
+ *
+ * A connection costs sizeof(NetConn) while idle, plus one slab of NET_HDRLEN + maxframe while
+ * it's got part of a frame in, plus up to budget while sends are backed up.  So maxframe should
+ * be as small as the protocol allows.
+ **/
+void NetLoopLimits(NetLoop *l, int maxframe, int budget){
+	l->maxframe = ((maxframe > 0) && (maxframe <= NET_MAXFRAME)) ? maxframe : NET_MAXFRAME;
+	l->budget = (budget > 0) ? budget : NET_CONN_BUDGET;
+
+	NetSlabFree(&l->slabs);
+	NetSlabInit(&l->slabs, NET_HDRLEN + l->maxframe);
+}
+
+/**
+ * NetConnQueue()
+ * c:		Connection to send to		[in/out]
+ * data:	Data to send			[in]
+ * len:		Number of bytes in data		[in]
+ *
+ * Adds a frame (see NetSendn()) to what's waiting to be sent to c.  It goes out the next time
+ * the loop flushes the connection.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetConnQueue(NetConn *c, const char *data, int len){
+	int need = NET_HDRLEN + len;
+	char *tmp = NULL;
+
+	if((len < 0) || (len > NET_MAXFRAME)){
+		D(("Refusing to queue %d bytes for socket %d (max is %d)", len, c->fd, NET_MAXFRAME));
+		return 0;
+	}
+
+	// Peer isn't reading what it's sent, don't keep piling it up
+	if((c->outlen - c->outpos + need) > c->loop->budget){
+		D(("Socket %d is over its budget (%d bytes waiting)", c->fd, c->outlen - c->outpos));
+		return 0;
+	}
+
+	// Make room, dropping what's already been sent first (not while the kernel is reading it)
+	if((c->outpos > 0) && !c->sending){
+		memmove(c->out, c->out + c->outpos, c->outlen - c->outpos);
+
+		c->outlen -= c->outpos;
+		c->outpos = 0;
+	}
+
+	if(c->outlen + need + 1 > c->outsize){
+		int size = (c->outsize > 0) ? c->outsize : 256;
+
+		while(size < c->outlen + need + 1)
+			size *= 2;
+
+		if(c->sending){
+			// The buffer being sent has to stay put until the send is done
+			if(!(tmp = (char*)malloc(size)))
+				return 0;
+
+			memcpy(tmp, c->out, c->outlen);
+
+			if(c->outprev)
+				free(c->out);
+			else
+				c->outprev = c->out;
+		} else if(!(tmp = (char*)realloc(c->out, size)))
+			return 0;
+
+		c->out = tmp;
+		c->outsize = size;
+	}
+
+	snprintf(c->out + c->outlen, NET_HDRLEN + 1, "%0*d", NET_HDRLEN, len);
+	memcpy(c->out + c->outlen + NET_HDRLEN, data, len);
+
+	c->outlen += need;
+
+	NetStatsAdd(frames_sent);
+
+	return 1;
+}
+
+/**
+ * NetConnQueueStr()
+ *
+ * Same as NetConnQueue(), for strings.
+ **/
+int NetConnQueueStr(NetConn *c, const char *data){
+	return NetConnQueue(c, data, strlen(data));
+}
+
+/**
+ * NetConnSent()
+ * c:	Connection that's sent everything it had	[in/out]
+ *
+ * Idle connections shouldn't hold on to a buffer.
+ **/
+void NetConnSent(NetConn *c){
+	free(c->out);
+
+	c->out = NULL;
+	c->outlen = c->outpos = c->outsize = 0;
+}
+
+/**
+ * NetConnHold()
+ * c:	Connection a task is going to point at	[in/out]
+ *
+ * Keeps c from being freed (it can still be closed) until NetConnRelease().  Loop's thread only.
+ **/
+void NetConnHold(NetConn *c){
+	c->refs++;
+}
+
+/**
+ * NetConnRelease()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection to let go of		[in/out]
+ **/
+void NetConnRelease(NetLoop *l, NetConn *c){
+	if((--c->refs <= 0) && c->closed){
+		c->dead = l->dead;
+		l->dead = c;
+	}
+}
+
+/**
+ * NetLoopReap()
+ * l:	Loop to free closed connections for	[in/out]
+ **/
+void NetLoopReap(NetLoop *l){
+	NetConn *c = NULL;
+
+	while((c = l->dead)){
+		l->dead = c->dead;
+		NetConnFree(c);
+
+		l->freed++;
+	}
+}
+
+/**
+ * NetConnClose()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection to close		[in]
+ **/
+void NetConnClose(NetLoop *l, NetConn *c){
+	if(c->closed)
+		return;
+
+	if(c->shm)
+		NetShmClose(l, c);
+
+	NetTimerDel(&l->timers, &c->timer);
+
+	c->closed = 1;
+
+	l->conns--;
+	l->closed++;
+
+	if(l->on_close)
+		l->on_close(l, c);
+
+	NetConnShut(l, c);
+
+	if(c->refs <= 0){
+		c->dead = l->dead;
+		l->dead = c;
+	}
+}
+
+/**
+ * NetConnDeadline()
+ * c:	Connection to set the deadline of	[in/out]
+ * ms:	How long it has (0 = no deadline)	[in]
+ *
+ * Replaces whatever deadline c had.  Loop's thread only.
+ **/
+void NetConnDeadline(NetConn *c, int ms){
+	if(ms <= 0)
+		NetTimerDel(&c->loop->timers, &c->timer);
+	else
+		NetTimerAdd(&c->loop->timers, &c->timer, ms, NetNow());
+}
+
+/**
+ * NetLoopExpire()
+ * l:	Loop to run the deadlines of	[in/out]
+ *
+ * Closes every connection whose deadline has come.
+ **/
+void NetLoopExpire(NetLoop *l){
+	NetTimer *t = NULL;
+	NetConn *c = NULL;
+
+	NetTimerAdvance(&l->timers, NetNow());
+
+	while((t = NetTimerPop(&l->timers))){
+		c = (NetConn*)((char*)t - offsetof(NetConn, timer));
+
+		D(("%s (socket %d) timed out", c->ip, c->fd));
+
+		l->timeouts++;
+
+		NetConnClose(l, c);
+	}
+}
+
+/**
+ * NetConnUpdate()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection to update		[in]
+ *
+ * Sends whatever has been queued, and closes the connection if it failed or is done.  Closing
+ * connections wait for their tasks as well, so call it once a task's been counted off.
+ **/
+void NetConnUpdate(NetLoop *l, NetConn *c){
+	if(c->closed)
+		return;
+
+	if(((c->shm ? NetShmFlush(c) : NetConnFlush(c)) == -1) ||
+	   (c->closing && !c->sending && (c->outpos >= c->outlen) && (c->tasks <= 0)))
+		NetConnClose(l, c);
+}
+
+/**
+ * NetConnOpen()
+ * l:		Loop to add the connection to			[in/out]
+ * s:		Newly accepted (or connecting) socket		[in]
+ * addr:	Address of the other side (NULL = look it up)	[in]
+ *
+ * Sets up a connection for s, and hands it to on_open().  Client-side loops call this themselves
+ * with a non-blocking socket that's still connecting.
+ *
+ * Returns the connection, or NULL if it was closed right away.
+ **/
+NetConn *NetConnOpen(NetLoop *l, int s, struct sockaddr_storage *addr){
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+	NetConn *c = NULL;
+
+	if(!(c = (NetConn*)calloc(1, sizeof(NetConn)))){
+		close(s);
+		return NULL;
+	}
+
+	c->fd = s;
+	c->loop = l;
+	c->slot = -1;
+
+	if(!addr){
+		memset(&peer, 0, sizeof(peer));
+		getpeername(s, (struct sockaddr*)&peer, &len);
+
+		addr = &peer;
+	}
+
+	// Unix sockets have no address worth showing, the kernel says which process it is instead
+	if(addr->ss_family == AF_UNIX){
+		len = sizeof(c->cred);
+
+		if(getsockopt(s, SOL_SOCKET, SO_PEERCRED, &c->cred, &len) == 0){
+			c->local = 1;
+			snprintf(c->ip, sizeof(c->ip), "local uid %u pid %d", (unsigned)c->cred.uid, (int)c->cred.pid);
+		} else
+			strcpy(c->ip, "local");
+	} else if(addr->ss_family == AF_INET6)
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*)addr)->sin6_addr, c->ip, sizeof(c->ip));
+	else
+		inet_ntop(AF_INET, &((struct sockaddr_in*)addr)->sin_addr, c->ip, sizeof(c->ip));
+
+	if(!NetConnAttach(l, c)){
+		close(s);
+		free(c);
+		return NULL;
+	}
+
+	l->accepted++;
+
+	if(++l->conns > l->peak)
+		l->peak = l->conns;
+
+	if(l->on_open && !l->on_open(l, c)){
+		NetConnClose(l, c);
+		return NULL;
+	}
+
+	NetConnUpdate(l, c);
+
+	return c;
+}
+
+/**
+ * NetLoopFrames()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection that read something	[in/out]
+ *
+ * Hands every complete frame in c's reader to on_frame().
+ *
+ * Returns 0 if the connection should be closed, 1 otherwise.
+ **/
+int NetLoopFrames(NetLoop *l, NetConn *c){
+	char *data = NULL;
+	int len = 0, ret = 0;
+
+	while((ret = NetReaderNext(&c->in, &data, &len)) == 1)
+		if(l->on_frame && !l->on_frame(l, c, data, len))
+			return 0;
+
+	return (ret != -1);
+}
+
+/**
+ * NetLoopPost()
+ * l:	Loop to run the task on	[in/out]
+ * t:	Task to run		[in]
+ *
+ * Hands t to the loop's thread.  Can be called from any thread.
+ **/
+void NetLoopPost(NetLoop *l, NetTask *t){
+	uint64_t one = 1;
+
+	t->next = NULL;
+
+	pthread_mutex_lock(&l->lock);
+
+	if(l->tasks_tail)
+		l->tasks_tail->next = t;
+	else
+		l->tasks = t;
+
+	l->tasks_tail = t;
+
+	pthread_mutex_unlock(&l->lock);
+
+	if(write(l->wakefd, &one, sizeof(one)) == -1)
+		NetSockErr(errno);
+}
+
+/**
+ * NetLoopTasks()
+ * l:	Loop to run posted tasks for	[in/out]
+ **/
+void NetLoopTasks(NetLoop *l){
+	NetTask *t = NULL, *next = NULL;
+	NetConn *c = NULL;
+	uint64_t count = 0;
+
+	// Reset the eventfd before taking the list, so a post that comes in after this wakes us again
+	while(read(l->wakefd, &count, sizeof(count)) > 0);
+
+	pthread_mutex_lock(&l->lock);
+
+	t = l->tasks;
+	l->tasks = l->tasks_tail = NULL;
+
+	pthread_mutex_unlock(&l->lock);
+
+	for(; t != NULL; t = next){
+		// fn is allowed to free t
+		next = t->next;
+		c = t->conn;
+
+		t->fn(l, t);
+
+		l->posted++;
+
+		// Counted off first, a closing connection may have been waiting on this task (c isn't
+		// freed until NetLoopReap())
+		if(c){
+			c->tasks--;
+			NetConnRelease(l, c);
+			NetConnUpdate(l, c);
+		}
+	}
+}
+
+/**
+ * NetLoopStop()
+ * l:	Loop to stop	[in/out]
+ **/
+void NetLoopStop(NetLoop *l){
+	l->running = 0;
+}
+
+/**
+ * NetLoopTeardown()
+ * l:	Stopped loop, every connection closed	[in/out]
+ *
+ * Backend-independent part of NetLoopFree().
+ **/
+void NetLoopTeardown(NetLoop *l){
+	NetLoopReap(l);
+	NetSlabFree(&l->slabs);
+
+	close(l->wakefd);
+	l->wakefd = -1;
+
+	pthread_mutex_destroy(&l->lock);
+}
+
+/**
+ * NetLoopStats()
+ * l:	Loop to show stats of	[in]
+ **/
+void NetLoopStats(NetLoop *l){
+	D(("Loop %d: %lu connections open (peak %lu), %lu accepted, %lu closed, %lu tasks posted",
+		l->id, l->conns, l->peak, l->accepted, l->closed, l->posted));
+
+	D(("Loop %d: %lu deadlines set, %lu timed out; %lu timers moved down, %lu set now",
+		l->id, l->timers.added, l->timeouts, l->timers.moved, l->timers.count));
+
+	D(("Loop %d: %lu bytes per idle connection, %lu per connection reading; %lu slabs of %d bytes in use (peak %lu), %d cached",
+		l->id, (unsigned long)sizeof(NetConn), (unsigned long)sizeof(NetConn) + l->slabs.size,
+		l->slabs.inuse, l->slabs.size, l->slabs.peak, l->slabs.nfree));
+}
+
+/**
+ * NetLoopRead()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection that can be read	[in/out]
+ *
+ * Reads everything the socket has, handing each frame to on_frame().  Used by epoll, and by
+ * io_uring for connections without a registered buffer (see uring.h).
+ *
+ * Returns 0 if the connection should be closed, 1 otherwise.
+ **/
+int NetLoopRead(NetLoop *l, NetConn *c){
+	char *slab = NULL;
+	int got = 0;
+
+	// Only connections that are in the middle of a frame hold a buffer
+	if(!c->in.buff){
+		if(!(slab = NetSlabGet(&l->slabs)))
+			return 0;
+
+		NetReaderUse(&c->in, slab, l->slabs.size, l->maxframe);
+	}
+
+	do{
+		if((got = NetReaderFill(&c->in, c->fd)) == -1){
+			if(!c->in.eof)
+				return 0;
+
+			// Half closed, what it sent before that still gets handled (and answered)
+			c->rdhup = 1;
+			got = 0;
+		}
+
+		if(!NetLoopFrames(l, c))
+			return 0;
+	} while(got > 0);
+
+	// Every frame's been handled, the slab can go to someone else
+	if(c->in.head == c->in.tail){
+		NetSlabPut(&l->slabs, c->in.buff);
+		c->in.buff = NULL;
+	}
+
+	return 1;
+}
+
+#include "shmring.h"
+
+#ifdef NET_URING
+#include "uring.h"
+#else
+
+/**
+ * NetLoopInit()
+ * l:		Loop to set up					[out]
+ * listen:	Listening socket (-1 = none, see NetConnOpen())	[in]
+ *
+ * The handlers have to be set by the caller afterwards.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetLoopInit(NetLoop *l, int listen){
+	struct epoll_event ev;
+
+	if(!NetLoopSetup(l, listen))
+		return 0;
+
+	if((l->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1){
+		perror("epoll_create1()");
+		return 0;
+	}
+
+	// The listening socket is the only one without a NetConn...
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;
+
+	if((listen >= 0) && (epoll_ctl(l->epfd, EPOLL_CTL_ADD, listen, &ev) == -1)){
+		perror("epoll_ctl()");
+		return 0;
+	}
+
+	// ...and the eventfd is told apart by pointing at the loop
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = l;
+
+	if(epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->wakefd, &ev) == -1){
+		perror("epoll_ctl()");
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * NetLoopFree()
+ * l:	Loop to free (stopped, every connection closed)	[in/out]
+ *
+ * Doesn't free l itself.  Closed connections that a task still points at (see NetConnHold())
+ * aren't freed.
+ **/
+void NetLoopFree(NetLoop *l){
+	if(l->epfd >= 0)
+		close(l->epfd);
+
+	l->epfd = -1;
+
+	NetLoopTeardown(l);
+}
+
+/**
+ * NetConnAttach()
+ * l:	Loop to watch the connection	[in/out]
+ * c:	New connection			[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetConnAttach(NetLoop *l, NetConn *c){
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+
+	if(epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1){
+		perror("epoll_ctl()");
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * NetConnFlush()
+ * c:	Connection to send to	[in/out]
+ *
+ * Sends as much of what's queued as the socket will take.
+ *
+ * Returns -1 if the connection failed, 0 if something is still waiting, 1 if everything was sent.
+ **/
+int NetConnFlush(NetConn *c){
+	ssize_t sent = 0;
+
+	while(c->outpos < c->outlen){
+		NetStatsAdd(sends);
+
+		sent = send(c->fd, c->out + c->outpos, c->outlen - c->outpos, MSG_NOSIGNAL);
+
+		if(sent > 0){
+			c->outpos += sent;
+		} else if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+			return 0;
+		} else if(errno != EINTR){
+			NetSockErr(errno);
+			return -1;
+		}
+	}
+
+	NetConnSent(c);
+
+	return 1;
+}
+
+/**
+ * NetConnShut()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection being closed		[in/out]
+ **/
+void NetConnShut(NetLoop *l, NetConn *c){
+	// close() takes it out of the epoll set as well
+	close(c->fd);
+	c->fd = -1;
+}
+
+/**
+ * NetConnFree()
+ * c:	Closed connection nothing points at anymore	[in]
+ **/
+void NetConnFree(NetConn *c){
+	NetSlabPut(&c->loop->slabs, c->in.buff);
+
+	free(c->out);
+	free(c);
+}
+
+/**
+ * NetLoopAccept()
+ * l:	Loop to accept connections for	[in/out]
+ *
+ * Accepts every connection that's waiting (edge-triggered, so they all have to be taken now).
+ **/
+void NetLoopAccept(NetLoop *l){
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	int s = -1;
+
+	while(1){
+		len = sizeof(addr);
+
+		if((s = accept4(l->listen, (struct sockaddr*)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			// EMFILE and such leave the rest in the backlog until the next connection comes in
+			if((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				perror("accept4()");
+
+			break;
+		}
+
+		NetConnOpen(l, s, &addr);
+	}
+}
+
+/**
+ * NetLoopRun()
+ * l:	Loop to run	[in/out]
+ *
+ * Handles events until NetLoopStop() is called (or epoll_wait() fails).
+ **/
+void NetLoopRun(NetLoop *l){
+	struct epoll_event events[NET_EVENTS];
+	NetConn *c = NULL;
+	int n = 0, i = 0, ok = 1;
+
+	l->running = 1;
+
+	while(l->running){
+		if((n = epoll_wait(l->epfd, events, NET_EVENTS, NetTimerWait(&l->timers, NetNow()))) == -1){
+			if(errno == EINTR)
+				continue;
+
+			perror("epoll_wait()");
+			break;
+		}
+
+		for(i = 0; i < n; i++){
+			if(!(c = (NetConn*)events[i].data.ptr)){
+				NetLoopAccept(l);
+				continue;
+			}
+
+			if(events[i].data.ptr == (void*)l){
+				NetLoopTasks(l);
+				continue;
+			}
+
+			// Closed earlier in this batch, but a task is still holding on to it
+			if(c->closed)
+				continue;
+
+			ok = !(events[i].events & EPOLLERR);
+
+			if(ok && (events[i].events & EPOLLIN))
+				ok = NetLoopRead(l, c);
+
+			// Other side is done sending (anything it sent before that has been read above), the
+			// replies still go out before it's closed
+			if(events[i].events & EPOLLRDHUP)
+				c->rdhup = 1;
+
+			// Both ways are gone, there's nobody to send to
+			if(events[i].events & EPOLLHUP)
+				ok = 0;
+
+			if(c->rdhup)
+				c->closing = 1;
+
+			if(ok)
+				NetConnUpdate(l, c);
+			else
+				NetConnClose(l, c);
+		}
+
+		NetLoopExpire(l);
+		NetLoopReap(l);
+	}
+}
+
+#endif
+
+#endif
@@ -6,6 +6,11 @@
 #ifndef __GLOBAL_H
 #define __GLOBAL_H
 
+// accept4(), CPU affinity & such (has to come before any system header)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 // Various includes
 //	System files
 #include <stdio.h>
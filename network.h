@@ -16,27 +16,51 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "resolve.h"
+
+// Frames are a NET_HDRLEN digit length, followed by that many bytes of data
+#define NET_HDRLEN	4
+#define NET_MAXFRAME	9999
+
+// Default listen() backlog (the kernel caps it at net.core.somaxconn)
+#define NET_BACKLOG	SOMAXCONN
+
+/**
+ * struct __netstats {}
+ *
+ * Counts send/recv syscalls and the frames they carry, to see what a message costs.
+ **/
+struct __netstats {
+	uint64_t sends;
+	uint64_t recvs;
+	uint64_t frames_sent;
+	uint64_t frames_recv;
+} NetStats;
+
+#define NetStatsAdd(x) __atomic_fetch_add(&NetStats.x, 1, __ATOMIC_RELAXED)
 
 /**
  * NetGetIP()
  * addr:	Address to get the IP of	[in]
  *
- * Converts addr into an IP, and returns it...else, returns NULL
+ * Converts addr into an IP (IPv4 or IPv6, through the resolver cache), and returns it...else,
+ * returns NULL.  The string is good until this thread calls NetGetIP() again.
  **/
 char *NetGetIP(char *addr){
-	struct hostent *h;
-	struct in_addr a;
+	static __thread char ip[INET6_ADDRSTRLEN];
+	NetAddrs addrs;
 
-	if((h = gethostbyname(addr))){
-		while(*h->h_addr_list){
-			memcpy((char*)&a, *h->h_addr_list++, sizeof(a));
+	if(!NetResolve(addr, 0, 0, &addrs))
+		return NULL;
 
-			D(("IP address of %s is %s", addr, inet_ntoa(a)));
-			return inet_ntoa(a);
-		}
-	}
+	NetAddrString(&addrs.addr[0], ip, sizeof(ip));
 
-	return '\0';
+	D(("IP address of %s is %s", addr, ip));
+
+	return ip;
 }
 
 /**
@@ -83,18 +107,65 @@ int NetSetOpt(int sock, int opt){
 }
 
 /**
- * NetServerCreate()
- * port:	The port number to create the server on	[in]
+ * NetUnixClear()
+ * un:	Unix socket about to be bound	[in]
+ *
+ * A socket file left behind by a server that's gone makes bind() fail, so it's removed if nothing
+ * answers on it.  Anything that isn't a socket, or that a server is still listening on, is left.
+ *
+ * Returns 0 if the path is in use, 1 if it's free to bind().
+ **/
+int NetUnixClear(struct sockaddr_un *un){
+	struct stat st;
+	int s = -1, ok = 0;
+
+	if(lstat(un->sun_path, &st) == -1)
+		return (errno == ENOENT);
+
+	if(!S_ISSOCK(st.st_mode)){
+		D(("%s is in the way of the unix socket", un->sun_path));
+		return 0;
+	}
+
+	if((s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return 0;
+
+	if((connect(s, (struct sockaddr*)un, sizeof(struct sockaddr_un)) == -1) && (errno == ECONNREFUSED)){
+		D(("Removing stale unix socket %s", un->sun_path));
+		ok = (unlink(un->sun_path) == 0);
+	} else
+		D(("Unix socket %s is already in use", un->sun_path));
+
+	close(s);
+
+	return ok;
+}
+
+/**
+ * NetServerListen()
+ * addr:	Address to listen on				[in]
+ * port:	The port number to create the server on		[in]
+ * backlog:	Connections the kernel can hold for accept()	[in]
+ * reuseport:	Let other sockets listen on addr:port too	[in]
+ *
+ * With reuseport, every socket bound to addr:port gets its own accept queue, and the kernel
+ * spreads new connections across them.  Unix sockets (see resolve.h) can't be shared that way,
+ * reuseport is ignored for them.
  *
  * Returns 0 on failure, socket FD on success.
  **/
-int NetServerCreate(char *addr, int port){
+int NetServerListen(char *addr, int port, int backlog, int reuseport){
 	int sock = -1;
-	int enable = 1;
 
-	struct sockaddr_in net;
+	NetAddrs addrs;
 
-	if((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1){
+	if(!NetResolve(addr, port, 1, &addrs))
+		return 0;
+
+	if((addrs.addr[0].ss_family == AF_UNIX) && !NetUnixClear((struct sockaddr_un*)&addrs.addr[0]))
+		return 0;
+
+	if((sock = socket(addrs.addr[0].ss_family, SOCK_STREAM, 0)) == -1){
 		perror("socket()");
 		return 0;
 	}
@@ -103,22 +174,21 @@ int NetServerCreate(char *addr, int port){
 
 	NetSetOpt(sock, SO_REUSEADDR);
 
-	mem0(&net);
+	if(reuseport && (addrs.addr[0].ss_family != AF_UNIX) && (NetSetOpt(sock, SO_REUSEPORT) == -1)){
+		perror("setsockopt(SO_REUSEPORT)");
+		close(sock);
 
-	net.sin_family = AF_INET;
-	net.sin_port = htons(port);
-	//net.sin_addr.s_addr = INADDR_ANY;
-	inet_pton(AF_INET, NetGetIP(addr), &net.sin_addr);
+		return 0;
+	}
 
-	if(bind(sock, (struct sockaddr*)&net, sizeof(net)) == -1){
+	if(bind(sock, (struct sockaddr*)&addrs.addr[0], addrs.len[0]) == -1){
 		perror("bind()");
 		close(sock);
 
 		return 0;
 	}
 
-//	if(listen(sock, SO_MAXCONN) == -1){
-	if(listen(sock, 10) == -1){
+	if(listen(sock, (backlog > 0) ? backlog : NET_BACKLOG) == -1){
 		perror("listen()");
 		close(sock);
 
@@ -129,173 +199,200 @@ int NetServerCreate(char *addr, int port){
 
 	return sock;
 }
+
+/**
+ * NetServerCreate()
+ * port:	The port number to create the server on	[in]
+ *
+ * Same as NetServerListen(), with the default backlog.
+ *
+ * Returns 0 on failure, socket FD on success.
+ **/
+int NetServerCreate(char *addr, int port){
+	return NetServerListen(addr, port, NET_BACKLOG, 0);
+}
+
 /**
  * NetClientCreate()
- * ip:		IP address to connect to	[in]
- * port:	Port number to connect to	[in]
+ * ip:		Name or IP address to connect to	[in]
+ * port:	Port number to connect to		[in]
+ *
+ * Tries every address ip resolves to (see NetConnectAny()).
  *
  * Returns 0 on failure, socket FD on success.
  **/
 int NetClientCreate(char *ip, int port){
-	struct sockaddr_in net;
+	char buff[INET6_ADDRSTRLEN];
+	NetAddrs addrs;
 
-	int sock = 0;
+	int sock = 0, which = 0;
 
-	if((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1){
-		perror("socket()");
+	if(!NetResolve(ip, port, 0, &addrs))
 		return 0;
-	}
-
-	mem0(&net);
-
-	net.sin_family = AF_INET;
-	net.sin_port = htons(port);
-
-	if(inet_pton(AF_INET, NetGetIP(ip), &net.sin_addr) == -1){
-		perror("inet_pton()");
-		close(sock);
 
+	if((sock = NetConnectAny(&addrs, 0, &which)) == -1){
+		D(("Unable to connect to %s:%d", ip, port));
 		return 0;
 	}
 
-	if(connect(sock, (struct sockaddr*)&net, sizeof(net)) == -1){
-		perror("connect()");
-		close(sock);
-
-		return 0;
-	}
-
-	D(("Established connection to %s:%d", ip, port));
+	D(("Established connection to %s:%d (%s)", ip, port, NetAddrString(&addrs.addr[which], buff, sizeof(buff))));
 
 	return sock;
 }
 
 /**
- * NetSend()
+ * NetSendn()
  * sock:	Socket FD to send data to	[in]
  * data:	Buffer of data to send to sock	[in]
+ * len:		Number of bytes in data		[in]
+ *
+ * Sends a frame: the length of data (4 digits, 0 padded, i.e.: 25 = 0025), followed by data.
+ * Header & data go out in one writev() call (more only if the socket takes less than all of it).
  *
- * Sends all of the data to sock, returns 0 on failure, 1 on success.
+ * Returns 0 on failure, 1 on success.
  **/
-int NetSend(int sock, char *data){
-	// Length of data
-	int len = strlen(data);
-
-	D(("Sending %d bytes of data to socket %d:\n%s", len, sock, data));
-
-	// Current position of data buffer
-	int pos = 0;
+int NetSendn(int sock, const char *data, int len){
+	char hdr[NET_HDRLEN + 1];
 
-	// Amount of data that was sent
-	int sent = 0;
+	struct iovec iov[2];
+	int cnt = 2;
 
-	// Amount of data left (by default, all of data)
-	int left = len;
+	ssize_t sent = 0;
 
-	// Error number
-	int err = 0;
+	if((len < 0) || (len > NET_MAXFRAME)){
+		D(("Refusing to send %d bytes to socket %d (max is %d)", len, sock, NET_MAXFRAME));
+		return 0;
+	}
 
-	// Padding for data
-	char *tmp = mem(len + 4);
-	mem0str(tmp);
+	D(("Sending %d bytes of data to socket %d", len, sock));
 
-	// Pad data, with up to 4 0's prepended (i.e.: 25 = 0025), followed by all of the data
-	sprintf(tmp, "%04d%s", len, data);
+	snprintf(hdr, sizeof(hdr), "%0*d", NET_HDRLEN, len);
 
-	// Increment length by 4 (due to the padding)
-	len += 4;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = NET_HDRLEN;
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = len;
 
-	// While we are currently not at the end of the buffer
-	while(pos <= len){
-		// Send some data through the wire (4 bytes at a time)
-		sent = send(sock, tmp+pos, 4, 0);
+	// While there's still something left in either buffer
+	while(cnt > 0){
+		NetStatsAdd(sends);
 
-		// Check if an error occured
-		if(sent > 0){
-			// Data was sent, so update positions
-			pos += sent;
-			left -= sent;
-		} else{
-			err = errno;
+		sent = writev(sock, iov + (2 - cnt), cnt);
 
+		if(sent < 0){
 			// Some errors are okay, as they are non-fatal to the transmission
-			if(!NetSockErrOk(err))
+			if(!NetSockErrOk(errno))
 				return 0;
+
+			continue;
 		}
-	}
 
-	// Empty temporary buffer
-	mem0str(tmp);
+		// Skip past what made it out
+		while((cnt > 0) && (sent >= (ssize_t)iov[2 - cnt].iov_len)){
+			sent -= iov[2 - cnt].iov_len;
+			cnt--;
+		}
 
-	// Empty data buffer
-	mem0str(&data);
+		if(cnt > 0){
+			iov[2 - cnt].iov_base = (char*)iov[2 - cnt].iov_base + sent;
+			iov[2 - cnt].iov_len -= sent;
+		}
+	}
+
+	NetStatsAdd(frames_sent);
 
 	// Success
 	return 1;
 }
 
 /**
- * NetRecv()
- * socket:	Socket to receive data from	[in]
- * buff:	Buffer to store data into	[out]
+ * NetSend()
+ * sock:	Socket FD to send data to	[in]
+ * data:	String to send to sock		[in]
  *
- * Receives data from socket, storing it in buff.  Returns 0 on failure, 1 on success
+ * Same as NetSendn(), for strings.
  **/
-int NetRecv(int sock, char *buff){
-	// Just to make sure the buffer is empty
-	mem0str(buff);
-
-	// Current position in buffer (by the time this is used, we'll be at the fourth position)
-	int pos = 4;
-
-	// Amount of bytes read
-	int read = 0;
+int NetSend(int sock, char *data){
+	return NetSendn(sock, data, strlen(data));
+}
 
-	// Error number
-	int err = 0;
+/**
+ * NetRecvAll()
+ * sock:	Socket to read from		[in]
+ * buff:	Buffer to store data in		[out]
+ * len:		Number of bytes to read		[in]
+ *
+ * Keeps calling recv() until len bytes have been read.  Returns 0 on failure (or if the other
+ * side hung up), 1 on success.
+ **/
+int NetRecvAll(int sock, char *buff, int len){
+	ssize_t got = 0;
+	int pos = 0;
 
-	// Get the length of the buffer
-	char *tmp = mem(4);
-	mem0str(tmp);
+	while(pos < len){
+		NetStatsAdd(recvs);
 
-	recv(sock, tmp, 4, 0);
+		got = recv(sock, buff + pos, len - pos, 0);
 
-	// Convert the string for buffer length to integer (stripping padding 0's as well), then free memory
-	int len = atoi(tmp);
+		if(got > 0){
+			pos += got;
+		} else if(got == 0){
+			D(("Socket %d closed by other side", sock));
+			return 0;
+		} else if(!NetSockErrOk(errno)){
+			perror("recv()");
+			return 0;
+		}
+	}
 
-	// Re-allocate space for tmp buffer
-	tmp = remem(len);
+	return 1;
+}
 
-	mem0str(tmp);
+/**
+ * NetRecv()
+ * sock:	Socket to receive data from		[in]
+ * buff:	Buffer to store data into		[out]
+ * size:	Size of buff (including room for \0)	[in]
+ *
+ * Receives one frame from sock (see NetSendn()), storing it in buff followed by a \0.
+ *
+ * Returns the number of bytes of data received, or -1 on failure (including a frame that won't
+ * fit in buff).
+ **/
+int NetRecv(int sock, char *buff, int size){
+	char hdr[NET_HDRLEN + 1] = {'\0'};
+	int len = 0;
 
-	// Amount of data left to read
-	int left = len;
+	// Get the length of the frame
+	if(!NetRecvAll(sock, hdr, NET_HDRLEN))
+		return -1;
 
-	while(left > 0){
-		read = recv(sock, tmp, 4, 0);
+	// Convert the string for buffer length to integer (stripping padding 0's as well)
+	len = atoi(hdr);
 
-		if(read > 0){
-			left -= read;
-			pos += read;
+	if((len < 0) || (len >= size)){
+		D(("Frame of %d bytes won't fit in a %d byte buffer", len, size));
+		return -1;
+	}
 
-//			D(("Read %d bytes, now at position %d, with %d bytes left.", read, pos, left));
-//			D(("Data fetched: %s", tmp));
-			strcat(buff, tmp);
-		} else{
-			err = errno;
+	if(!NetRecvAll(sock, buff, len))
+		return -1;
 
-			if(!NetSockErrOk(err)){
-				perror("recv()");
-				mem0(tmp);
+	buff[len] = '\0';
 
-				return 0;
-			}
-		}
+	NetStatsAdd(frames_recv);
 
-		mem0str(tmp);
-	}
+	return len;
+}
 
-	return 1;
+/**
+ * NetStatsPrint()
+ *
+ * Shows how many send/recv syscalls have been made, and how many frames they carried.
+ **/
+void NetStatsPrint(){
+	D(("%lu frames sent in %lu send calls, %lu frames received in %lu recv calls",
+		NetStats.frames_sent, NetStats.sends, NetStats.frames_recv, NetStats.recvs));
 }
 
 /**
@@ -0,0 +1,235 @@
+#ifndef __ACCTDB_H
+#define __ACCTDB_H
+
+/*********************************
+ * Compiled account database.
+ *
+ * /etc/shadow is a text file that getspnam_r() reads from the top every time, which is fine for a
+ * few hundred users and hopeless for a few million.  An account database is built ahead of time
+ * (see acctdb/main.c) into a file the server can use exactly as it is on disk:
+ *
+ *	header		(acctdb_header, sizes & offsets of everything else)
+ *	index		(slots power of 2 acctdb_slot, at most half of them used)
+ *	records		(acctdb_record + "user\0hash\0", each starting on an 8 byte boundary)
+ *
+ * A username's FNV-1a hash picks its slot, and a full slot that isn't it sends the lookup on to
+ * the next one (linear probing).  The index is never more than half full, so a lookup looks at
+ * 1.5 slots on average (2.5 for a user that isn't there), however many accounts there are.  Each
+ * slot keeps the top 32 bits of its user's hash, so slots that belong to someone else are skipped
+ * without touching their records.
+ *
+ * Opening the database is an open() and an mmap(), nothing is read or parsed until a lookup
+ * needs it (the kernel pages in what's used), so startup doesn't depend on how big it is.  Only
+ * the header is checked up front, records are checked against the size of the file as they're
+ * looked at, so a damaged file can't send a lookup outside of the mapping.
+ *
+ * Hashes are whatever crypt() makes, the same as /etc/shadow has, so checking a password is the
+ * same either way (see auth_verify() in auth.h).  Both servers use it (accounts_lookup()).
+ *
+ * The file is read-only once it's built (the compiler writes a new one and renames it over the
+ * old one), so any number of threads can look things up without locking.
+ *********************************/
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "debug.h"
+
+#define ACCTDB_MAGIC	"VCACCTDB"
+#define ACCTDB_VERSION	1
+
+// Records start on multiples of this, slots store record offsets in these units
+#define ACCTDB_ALIGN	8
+
+typedef struct __acctdb_header {
+	char magic[8];
+
+	uint32_t version;
+
+	// Always 0x01020304 as written, anything else is a file from a machine with other byte order
+	uint32_t order;
+
+	// Accounts & index slots (power of 2)
+	uint64_t count;
+	uint64_t slots;
+
+	// Where the index & records start, and how big the whole file is
+	uint64_t index;
+	uint64_t records;
+	uint64_t size;
+} acctdb_header;
+
+typedef struct __acctdb_slot {
+	// Top 32 bits of the user's hash
+	uint32_t tag;
+
+	// Record offset / ACCTDB_ALIGN (0 = empty, the header is always at 0)
+	uint32_t rec;
+} acctdb_slot;
+
+typedef struct __acctdb_record {
+	// Not counting the '\0' after each
+	uint16_t ulen;
+	uint16_t hlen;
+
+	// "user\0hash\0"
+	char data[];
+} acctdb_record;
+
+typedef struct __acctdb {
+	const char *map;
+	size_t size;
+
+	const acctdb_header *hdr;
+	const acctdb_slot *index;
+} acctdb;
+
+/**
+ * acctdb_hash()
+ * user:	Username to hash	[in]
+ *
+ * FNV-1a hash of the username.  The low bits pick the slot, the top 32 are the slot's tag.
+ **/
+uint64_t acctdb_hash(const char *user){
+	uint64_t h = 14695981039346656037ULL;
+
+	while(*user){
+		h ^= (unsigned char)*user++;
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/**
+ * acctdb_record_at()
+ * db:	Database to look in	[in]
+ * rec:	Slot's record offset	[in]
+ *
+ * Returns the record, or NULL if it (or its strings) would run past the end of the file.
+ **/
+const acctdb_record *acctdb_record_at(const acctdb *db, uint32_t rec){
+	const acctdb_record *r = NULL;
+	uint64_t off = (uint64_t)rec * ACCTDB_ALIGN;
+
+	if((off < db->hdr->records) || (off + sizeof(acctdb_record) > db->size))
+		return NULL;
+
+	r = (const acctdb_record*)(db->map + off);
+
+	if(off + sizeof(acctdb_record) + r->ulen + r->hlen + 2 > db->size)
+		return NULL;
+
+	return r;
+}
+
+/**
+ * acctdb_open()
+ * db:		Database to open	[out]
+ * path:	File to map		[in]
+ *
+ * Maps the database in and checks its header.  Nothing else is read.
+ *
+ * Returns 1 on success, 0 on failure.
+ **/
+int acctdb_open(acctdb *db, const char *path){
+	const acctdb_header *h = NULL;
+	struct stat st;
+	void *map = NULL;
+	int fd = -1;
+
+	memset(db, 0, sizeof(acctdb));
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return 0;
+
+	if((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(acctdb_header))){
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	// The mapping keeps the file around
+	close(fd);
+
+	if(map == MAP_FAILED)
+		return 0;
+
+	h = (const acctdb_header*)map;
+
+	if(memcmp(h->magic, ACCTDB_MAGIC, sizeof(h->magic)) || (h->version != ACCTDB_VERSION) ||
+	   (h->order != 0x01020304) || (h->size != (uint64_t)st.st_size) ||
+	   !h->slots || (h->slots & (h->slots - 1)) || (h->count > h->slots / 2) ||
+	   (h->index < sizeof(acctdb_header)) || (h->index > h->size) || (h->index % ACCTDB_ALIGN) ||
+	   (h->slots > (h->size - h->index) / sizeof(acctdb_slot)) ||
+	   (h->records < h->index + h->slots * sizeof(acctdb_slot)) || (h->records > h->size)){
+		D(("%s isn't an account database (or isn't version %d)", path, ACCTDB_VERSION));
+
+		munmap(map, st.st_size);
+		return 0;
+	}
+
+	// Lookups land all over the file, reading ahead of them would just waste memory
+	madvise(map, st.st_size, MADV_RANDOM);
+
+	db->map = (const char*)map;
+	db->size = st.st_size;
+	db->hdr = h;
+	db->index = (const acctdb_slot*)(db->map + h->index);
+
+	return 1;
+}
+
+/**
+ * acctdb_close()
+ * db:	Database to unmap	[in/out]
+ **/
+void acctdb_close(acctdb *db){
+	if(db->map)
+		munmap((void*)db->map, db->size);
+
+	memset(db, 0, sizeof(acctdb));
+}
+
+/**
+ * acctdb_find()
+ * db:		Database to look in				[in]
+ * user:	Username to look up				[in]
+ * stored:	Buffer for the user's password hash		[out]
+ * size:	Size of stored					[in]
+ *
+ * Returns 1 if the user is in the database (and the hash fit), 0 if not.
+ **/
+int acctdb_find(const acctdb *db, const char *user, char *stored, size_t size){
+	const acctdb_record *r = NULL;
+	uint64_t h = acctdb_hash(user), mask = db->hdr->slots - 1, i = 0, n = 0;
+	uint32_t tag = (uint32_t)(h >> 32);
+	size_t ulen = strlen(user);
+
+	// The index is never full, but a damaged one could be
+	for(i = h & mask, n = 0; db->index[i].rec && (n < db->hdr->slots); i = (i + 1) & mask, n++){
+		if(db->index[i].tag != tag)
+			continue;
+
+		if(!(r = acctdb_record_at(db, db->index[i].rec)))
+			return 0;
+
+		if((r->ulen != ulen) || memcmp(r->data, user, ulen))
+			continue;
+
+		if(r->hlen >= size)
+			return 0;
+
+		memcpy(stored, r->data + r->ulen + 1, r->hlen);
+		stored[r->hlen] = '\0';
+
+		return 1;
+	}
+
+	return 0;
+}
+
+#endif
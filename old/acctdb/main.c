@@ -0,0 +1,353 @@
+/****************************
+ * Account database compiler.
+ *
+ * Turns a list of accounts into the database the server maps in (see acctdb.h), so the server
+ * never has to parse anything.  Input is one account per line:
+ *
+ *	user password		(default, like server/accounts, the password is hashed here)
+ *	user:hash:...		(-s, /etc/shadow lines, the hash is kept as it is)
+ *
+ * Blank lines and lines starting with '#' are skipped, a user that shows up twice is an error.
+ * Passwords are hashed with crypt() using a new random salt each, with whatever method the -m
+ * prefix asks for ("$6$" = SHA-512 by default, "$y$" = yescrypt, ...).
+ *
+ * The database is written next to the output as <output>.tmp and renamed over the output once
+ * it's all on disk, so a server never maps a half-written one.
+ *
+ * Usage: acctdb [-s] [-m prefix] <input> <output>
+ ****************************/
+#include "../acctdb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <crypt.h>
+
+/** Used for LOGIN_NAME_MAX define **/
+#include <bits/local_lim.h>
+
+#define ACCTDB_METHOD	"$6$"
+
+/**
+ * struct __acctdb_entry {}
+ *
+ * One account, its strings point into the input (or a hash made for it).
+ **/
+typedef struct __acctdb_entry {
+	const char *user;
+	const char *hash;
+
+	uint64_t h;
+
+	// Where its record goes
+	uint64_t off;
+} acctdb_entry;
+
+/**
+ * acctdb_size()
+ * e:	Account	[in]
+ *
+ * Returns how much room e's record takes (padded to ACCTDB_ALIGN).
+ **/
+uint64_t acctdb_size(const acctdb_entry *e){
+	uint64_t len = sizeof(acctdb_record) + strlen(e->user) + strlen(e->hash) + 2;
+
+	return (len + ACCTDB_ALIGN - 1) & ~(uint64_t)(ACCTDB_ALIGN - 1);
+}
+
+/**
+ * acctdb_read()
+ * path:	File to read			[in]
+ * len:		How much was read		[out]
+ *
+ * Returns the whole file ('\0' terminated, free() it), or NULL on failure.
+ **/
+char *acctdb_read(const char *path, size_t *len){
+	FILE *fp = NULL;
+	char *buff = NULL;
+	long size = 0;
+
+	if(!(fp = fopen(path, "r")))
+		return NULL;
+
+	if((fseek(fp, 0, SEEK_END) == -1) || ((size = ftell(fp)) < 0) || (fseek(fp, 0, SEEK_SET) == -1) ||
+	   !(buff = (char*)malloc(size + 1)) || (fread(buff, 1, size, fp) != (size_t)size)){
+		free(buff);
+		fclose(fp);
+		return NULL;
+	}
+
+	fclose(fp);
+
+	buff[size] = '\0';
+	*len = size;
+
+	return buff;
+}
+
+/**
+ * acctdb_parse()
+ * line:	Line to split up ('\0' terminated, changed in place)	[in/out]
+ * shadow:	Is it an /etc/shadow line?				[in]
+ * method:	crypt() prefix to hash plain passwords with			[in]
+ * e:		Account from the line					[out]
+ *
+ * Returns 1 on success, 0 if the line isn't an account.
+ **/
+int acctdb_parse(char *line, int shadow, const char *method, acctdb_entry *e){
+	char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+	struct crypt_data *data = NULL;
+	char *sep = NULL, *end = NULL, *hash = NULL;
+
+	if(!(sep = strchr(line, shadow ? ':' : ' ')))
+		return 0;
+
+	*sep++ = '\0';
+
+	if(shadow){
+		if((end = strchr(sep, ':')))
+			*end = '\0';
+	} else{
+		// Anything after the password is ignored, same as a trailing '\r'
+		while(*sep == ' ')
+			sep++;
+
+		if((end = strpbrk(sep, " \t\r")))
+			*end = '\0';
+	}
+
+	if(!*line || (strlen(line) >= LOGIN_NAME_MAX) || (!shadow && !*sep))
+		return 0;
+
+	e->user = line;
+
+	if(shadow){
+		e->hash = sep;
+	} else{
+		if(!(data = (struct crypt_data*)calloc(1, sizeof(struct crypt_data))))
+			return 0;
+
+		// NULL random bytes = crypt_gensalt_rn() gets them from the system
+		if(crypt_gensalt_rn(method, 0, NULL, 0, salt, sizeof(salt)) && (hash = crypt_r(sep, salt, data)) &&
+		   (hash[0] != '*'))
+			e->hash = strdup(hash);
+
+		memset(sep, '\0', strlen(sep));
+		memset(data, '\0', sizeof(struct crypt_data));
+		free(data);
+
+		if(!e->hash)
+			return 0;
+	}
+
+	if(strlen(e->hash) >= CRYPT_OUTPUT_SIZE)
+		return 0;
+
+	e->h = acctdb_hash(e->user);
+
+	return 1;
+}
+
+/**
+ * acctdb_write()
+ * path:	Where the database goes			[in]
+ * e:		Accounts					[in]
+ * count:	Number of accounts				[in]
+ *
+ * Lays out & writes the database (see acctdb.h for the format).
+ *
+ * Returns 1 on success, 0 on failure.
+ **/
+int acctdb_write(const char *path, acctdb_entry *e, uint64_t count){
+	acctdb_header hdr;
+	acctdb_slot *index = NULL;
+	acctdb_record rec;
+
+	// Which account has each slot, for telling a repeated user from a tag that just matches
+	uint64_t *owner = NULL;
+
+	char pad[ACCTDB_ALIGN] = {'\0'};
+	char *tmp = NULL;
+
+	uint64_t i = 0, j = 0, mask = 0, off = 0, probes = 0, longest = 0, n = 0;
+	FILE *fp = NULL;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ACCTDB_MAGIC, sizeof(hdr.magic));
+
+	hdr.version = ACCTDB_VERSION;
+	hdr.order = 0x01020304;
+	hdr.count = count;
+
+	// At most half full
+	for(hdr.slots = 16; hdr.slots < count * 2; hdr.slots *= 2);
+
+	mask = hdr.slots - 1;
+
+	hdr.index = sizeof(acctdb_header);
+	hdr.records = hdr.index + (hdr.slots * sizeof(acctdb_slot));
+
+	index = (acctdb_slot*)calloc(hdr.slots, sizeof(acctdb_slot));
+	owner = (uint64_t*)calloc(hdr.slots, sizeof(uint64_t));
+
+	if(!index || !owner)
+		goto out;
+
+	// Records go in input order, each slot points at its record
+	for(i = 0, off = hdr.records; i < count; i++){
+		e[i].off = off;
+		off += acctdb_size(&e[i]);
+
+		if(e[i].off / ACCTDB_ALIGN > UINT32_MAX){
+			printf("Too many accounts, records would go past %llu bytes\n", (unsigned long long)UINT32_MAX * ACCTDB_ALIGN);
+			goto out;
+		}
+
+		for(j = e[i].h & mask, n = 1; index[j].rec; j = (j + 1) & mask, n++){
+			if((index[j].tag == (uint32_t)(e[i].h >> 32)) && !strcmp(e[owner[j]].user, e[i].user)){
+				printf("%s is in there twice\n", e[i].user);
+				goto out;
+			}
+		}
+
+		index[j].tag = (uint32_t)(e[i].h >> 32);
+		index[j].rec = (uint32_t)(e[i].off / ACCTDB_ALIGN);
+		owner[j] = i;
+
+		probes += n;
+
+		if(n > longest)
+			longest = n;
+	}
+
+	hdr.size = off;
+
+	if(!(tmp = (char*)malloc(strlen(path) + 5)))
+		goto out;
+
+	sprintf(tmp, "%s.tmp", path);
+
+	if(!(fp = fopen(tmp, "w"))){
+		perror(tmp);
+		goto out;
+	}
+
+	if((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) || (fwrite(index, sizeof(acctdb_slot), hdr.slots, fp) != hdr.slots))
+		goto out;
+
+	for(i = 0; i < count; i++){
+		rec.ulen = strlen(e[i].user);
+		rec.hlen = strlen(e[i].hash);
+
+		if((fwrite(&rec, sizeof(rec), 1, fp) != 1) ||
+		   (fwrite(e[i].user, 1, rec.ulen + 1, fp) != rec.ulen + 1u) ||
+		   (fwrite(e[i].hash, 1, rec.hlen + 1, fp) != rec.hlen + 1u) ||
+		   (fwrite(pad, 1, acctdb_size(&e[i]) - (sizeof(rec) + rec.ulen + rec.hlen + 2), fp) !=
+		    acctdb_size(&e[i]) - (sizeof(rec) + rec.ulen + rec.hlen + 2)))
+			goto out;
+	}
+
+	if((fflush(fp) != 0) || (fsync(fileno(fp)) == -1))
+		goto out;
+
+	if(fclose(fp) != 0){
+		fp = NULL;
+		unlink(tmp);
+		goto out;
+	}
+
+	fp = NULL;
+
+	if(rename(tmp, path) == -1){
+		perror("rename()");
+		unlink(tmp);
+		goto out;
+	}
+
+	printf("%llu accounts, %llu slots, %llu bytes (%.2f slots looked at per lookup, %llu at most)\n",
+		(unsigned long long)count, (unsigned long long)hdr.slots, (unsigned long long)hdr.size,
+		count ? (double)probes / count : 0.0, (unsigned long long)longest);
+
+	ret = 1;
+
+out:
+	if(fp){
+		fclose(fp);
+		unlink(tmp);
+	}
+
+	free(tmp);
+	free(index);
+	free(owner);
+
+	return ret;
+}
+
+int main(int argc, char *argv[]){
+	const char *method = ACCTDB_METHOD;
+	acctdb_entry *e = NULL;
+
+	char *buff = NULL, *line = NULL, *next = NULL;
+
+	uint64_t count = 0, lines = 0, i = 0;
+	size_t len = 0;
+	int shadow = 0, opt = 0, ret = 1;
+
+	while((opt = getopt(argc, argv, "sm:")) != -1){
+		if(opt == 's')
+			shadow = 1;
+		else if(opt == 'm')
+			method = optarg;
+		else
+			break;
+	}
+
+	if(argc - optind != 2){
+		printf("Usage: %s [-s] [-m prefix] <input> <output>\n", argv[0]);
+		printf("\t-s: input is /etc/shadow lines, -m: crypt() prefix for passwords (default %s)\n", ACCTDB_METHOD);
+		return 1;
+	}
+
+	if(!(buff = acctdb_read(argv[optind], &len))){
+		perror(argv[optind]);
+		return 1;
+	}
+
+	// There can't be more accounts than lines
+	for(i = 0; i < len; i++)
+		lines += (buff[i] == '\n');
+
+	if(!(e = (acctdb_entry*)calloc(lines + 1, sizeof(acctdb_entry))))
+		goto out;
+
+	for(line = buff, i = 1; line && *line; line = next, i++){
+		if((next = strchr(line, '\n')))
+			*next++ = '\0';
+
+		if(!*line || (*line == '#') || (*line == '\r'))
+			continue;
+
+		if(!acctdb_parse(line, shadow, method, &e[count])){
+			printf("Line %llu isn't an account (or its password couldn't be hashed)\n", (unsigned long long)i);
+			goto out;
+		}
+
+		count++;
+	}
+
+	if(acctdb_write(argv[optind + 1], e, count))
+		ret = 0;
+
+out:
+	if(e && !shadow)
+		for(i = 0; i < count; i++)
+			free((char*)e[i].hash);
+
+	// Plain passwords were wiped as they were hashed
+	memset(buff, '\0', len);
+
+	free(e);
+	free(buff);
+
+	return ret;
+}
@@ -0,0 +1,265 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+/*********************************
+ * Per-session memory arenas for GMP.
+ *
+ * A handshake does dozens of mpz_init()/mpz_clear() calls, and GMP reallocs the numbers as they
+ * grow (up to 8192 bits).  All of that used to go through the global malloc(), which every
+ * session thread fights over.
+ *
+ * arena_install() hands GMP our own memory functions (mp_set_memory_functions()).  A thread that
+ * has an arena (arena_use()) gets its GMP memory by bumping a pointer in that arena, and "frees"
+ * are no-ops.  When the session ends, arena_release() wipes and frees the whole thing at once.
+ * Threads without an arena (group generation, batch & refill threads) go through malloc() like
+ * before.
+ *
+ * Every block starts with a small header saying where it came from, so memory can be realloc'd
+ * or freed from a different thread than the one that allocated it (i.e.: powmq.h writing a
+ * result into a session's variable).
+ *********************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+// Size of each chunk the arena bumps through (bigger requests get their own chunk)
+#define ARENA_CHUNK	(64 * 1024)
+
+// Keep the blocks aligned for limbs (and anything else GMP wants)
+#define ARENA_ALIGN	16
+
+#define ARENA_KIND_HEAP		0x48454150
+#define ARENA_KIND_ARENA	0x4152454e
+
+typedef struct __arena_hdr {
+	uint32_t kind;
+	uint32_t pad;
+	size_t size;
+} arena_hdr;
+
+typedef struct __arena_chunk {
+	struct __arena_chunk *next;
+
+	size_t size;
+	size_t used;
+
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+} arena_chunk;
+
+typedef struct __arena {
+	arena_chunk *head;
+
+	// Stats for this arena
+	uint64_t allocs;
+	uint64_t reallocs;
+	uint64_t inplace;	// reallocs that grew the last block instead of copying
+	uint64_t chunks;
+	uint64_t bytes;
+} arena;
+
+/**
+ * struct __arena_stats {}
+ *
+ * Process-wide counters, so arena vs. malloc() usage can be compared.
+ **/
+struct __arena_stats {
+	uint64_t arena_allocs;
+	uint64_t heap_allocs;
+	uint64_t heap_frees;
+} arena_stats;
+
+// The arena the current thread allocates from (NULL = malloc())
+__thread arena *arena_cur = NULL;
+
+#define ARENA_HDR	((sizeof(arena_hdr) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_ROUND(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+ * arena_bump()
+ * a:		Arena to allocate from		[in/out]
+ * size:	Bytes needed (header included)	[in]
+ *
+ * Returns size bytes from the arena, adding a chunk if the current one is full.
+ **/
+void *arena_bump(arena *a, size_t size){
+	arena_chunk *c = a->head;
+	void *p = NULL;
+
+	size = ARENA_ROUND(size);
+
+	if(!c || ((c->size - c->used) < size)){
+		size_t csize = (size > ARENA_CHUNK) ? size : ARENA_CHUNK;
+
+		if(!(c = (arena_chunk*)malloc(sizeof(arena_chunk) + csize)))
+			return NULL;
+
+		c->size = csize;
+		c->used = 0;
+		c->next = a->head;
+
+		a->head = c;
+		a->chunks++;
+
+		__atomic_fetch_add(&arena_stats.heap_allocs, 1, __ATOMIC_RELAXED);
+	}
+
+	p = c->data + c->used;
+	c->used += size;
+
+	a->bytes += size;
+
+	return p;
+}
+
+/**
+ * arena_alloc()
+ * size:	Bytes to allocate	[in]
+ *
+ * GMP's allocate function.
+ **/
+void *arena_alloc(size_t size){
+	arena_hdr *h = NULL;
+
+	if(arena_cur){
+		h = (arena_hdr*)arena_bump(arena_cur, ARENA_HDR + size);
+
+		arena_cur->allocs++;
+		__atomic_fetch_add(&arena_stats.arena_allocs, 1, __ATOMIC_RELAXED);
+
+		if(h)
+			h->kind = ARENA_KIND_ARENA;
+	} else{
+		h = (arena_hdr*)malloc(ARENA_HDR + size);
+
+		__atomic_fetch_add(&arena_stats.heap_allocs, 1, __ATOMIC_RELAXED);
+
+		if(h)
+			h->kind = ARENA_KIND_HEAP;
+	}
+
+	if(!h){
+		fprintf(stderr, "arena_alloc(): out of memory\n");
+		abort();
+	}
+
+	h->size = size;
+
+	return (char*)h + ARENA_HDR;
+}
+
+/**
+ * arena_free()
+ * ptr:		Block to free			[in]
+ * size:	Size of the block (unused)	[in]
+ *
+ * GMP's free function.  Arena blocks are left alone (the whole arena goes away at once),
+ * malloc() blocks are wiped and freed.
+ **/
+void arena_free(void *ptr, size_t size){
+	arena_hdr *h = (arena_hdr*)((char*)ptr - ARENA_HDR);
+
+	if(h->kind != ARENA_KIND_HEAP)
+		return;
+
+	memset(ptr, 0, h->size);
+	free(h);
+
+	__atomic_fetch_add(&arena_stats.heap_frees, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * arena_realloc()
+ * ptr:		Block to resize		[in]
+ * old:		Old size (unused)	[in]
+ * size:	New size		[in]
+ *
+ * GMP's reallocate function.  If ptr is the last block handed out by the current thread's arena
+ * and there's room after it, it just grows.  Otherwise a new block is allocated, the data copied
+ * over and the old block freed.
+ **/
+void *arena_realloc(void *ptr, size_t old, size_t size){
+	arena_hdr *h = (arena_hdr*)((char*)ptr - ARENA_HDR);
+	arena_chunk *c = NULL;
+	void *p = NULL;
+
+	if(arena_cur && (h->kind == ARENA_KIND_ARENA)){
+		c = arena_cur->head;
+
+		arena_cur->reallocs++;
+
+		// Last block in the chunk?  Then it can grow in place
+		if(c && ((char*)h >= c->data) && ((char*)h < c->data + c->size) &&
+		   ((char*)ptr + ARENA_ROUND(h->size) == c->data + c->used) &&
+		   (ARENA_ROUND(size) <= ARENA_ROUND(h->size) + (c->size - c->used))){
+			c->used = ((char*)ptr - c->data) + ARENA_ROUND(size);
+			h->size = size;
+
+			arena_cur->inplace++;
+
+			return ptr;
+		}
+	}
+
+	p = arena_alloc(size);
+
+	memcpy(p, ptr, (h->size < size) ? h->size : size);
+
+	// Don't leave a copy of the old value behind
+	memset(ptr, 0, h->size);
+	arena_free(ptr, h->size);
+
+	return p;
+}
+
+/**
+ * arena_install()
+ *
+ * Points GMP at the arena functions.  Must be called before anything is allocated with GMP.
+ **/
+void arena_install(){
+	mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+}
+
+/**
+ * arena_use()
+ * a:	Arena for this thread to allocate from (NULL = malloc())	[in]
+ *
+ * Returns the arena the thread was using before, so it can be put back.
+ **/
+arena *arena_use(arena *a){
+	arena *prev = arena_cur;
+
+	arena_cur = a;
+
+	return prev;
+}
+
+/**
+ * arena_release()
+ * a:	Arena to get rid of	[in/out]
+ *
+ * Wipes and frees every chunk in the arena.  Nothing allocated from it can be used afterwards.
+ **/
+void arena_release(arena *a){
+	arena_chunk *c = a->head, *next = NULL;
+
+	if(arena_cur == a)
+		arena_cur = NULL;
+
+	while(c){
+		next = c->next;
+
+		memset(c->data, 0, c->used);
+		free(c);
+
+		__atomic_fetch_add(&arena_stats.heap_frees, 1, __ATOMIC_RELAXED);
+
+		c = next;
+	}
+
+	a->head = NULL;
+}
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef __OLD_AUTH_H
+#define __OLD_AUTH_H
+
+/*********************************
+ * Password checking, shared by both servers (server/main.c here, and server.c through ../auth.h).
+ *
+ * Accounts live in backends (/etc/shadow, an index of it, a compiled account database, see
+ * acctdb.h), asked in the order they were added, and the first one that has the user decides.
+ * Whatever the backend, the hash is what crypt() made, so checking a password is the same either
+ * way.
+ *
+ * Everything here is reentrant: the shadow entry is looked up with getspnam_r() into a buffer of
+ * our own, and passwords are hashed with crypt_r() into this thread's crypt_data, so any number of
+ * threads can check passwords at once without a lock.
+ *********************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <shadow.h>
+#include <crypt.h>
+#include "debug.h"
+#include "acctdb.h"
+
+// Room for a shadow entry (getspnam_r() says when it isn't enough, up to AUTH_SPMAX)
+#define AUTH_SPBUFF	1024
+#define AUTH_SPMAX	65536
+
+// crypt_r()'s working space, one per thread (zeroed, which is what crypt_r() wants the first time)
+__thread struct crypt_data auth_crypt;
+
+/**
+ * struct __auth_backend {}
+ *
+ * Somewhere accounts live.  lookup() puts the user's password hash (as crypt() makes it) in
+ * stored (CRYPT_OUTPUT_SIZE), and returns 1 if it has the user, 0 if not.
+ **/
+typedef struct __auth_backend {
+	const char *name;
+
+	int (*lookup)(void *ctx, const char *u, char *stored);
+	void *ctx;
+} auth_backend;
+
+#define AUTH_BACKENDS	4
+
+// Asked in the order they were added, the first one that has the user decides
+auth_backend auth_backends[AUTH_BACKENDS];
+int auth_nbackends = 0;
+
+/**
+ * auth_backend_add()
+ * name:	What to call it in the logs		[in]
+ * lookup:	Finds a user's password hash		[in]
+ * ctx:		Handed to lookup()			[in]
+ *
+ * Has to happen before anything calls auth_find().
+ *
+ * Returns 1 on success, 0 if there's no room for another one.
+ **/
+int auth_backend_add(const char *name, int (*lookup)(void*, const char*, char*), void *ctx){
+	if(auth_nbackends == AUTH_BACKENDS)
+		return 0;
+
+	auth_backends[auth_nbackends].name = name;
+	auth_backends[auth_nbackends].lookup = lookup;
+	auth_backends[auth_nbackends].ctx = ctx;
+
+	auth_nbackends++;
+
+	D(("Authenticating against %s", name));
+
+	return 1;
+}
+
+/**
+ * shadow_lookup()
+ * ctx:		Not used						[in]
+ * u:		Username to look up					[in]
+ * stored:	Buffer for the password hash (CRYPT_OUTPUT_SIZE)	[out]
+ *
+ * Backend for /etc/shadow (getspnam_r(), so it's reentrant).
+ **/
+int shadow_lookup(void *ctx, const char *u, char *stored){
+	// Shadow password structure (see shadow.h), its strings point into buff
+	struct spwd sp, *spw = NULL;
+
+	char *buff = NULL;
+
+	size_t size = AUTH_SPBUFF;
+	int ret = 0, err = 0;
+
+	// Populate shadow structure based on given username
+	while(1){
+		if(!(buff = (char*)malloc(size)))
+			return 0;
+
+		if((err = getspnam_r(u, &sp, buff, size, &spw)) != ERANGE)
+			break;
+
+		free(buff);
+		buff = NULL;
+
+		if((size *= 2) > AUTH_SPMAX)
+			return 0;
+	}
+
+	if(!err && spw && (strlen(spw->sp_pwdp) < CRYPT_OUTPUT_SIZE)){
+		strcpy(stored, spw->sp_pwdp);
+		ret = 1;
+	}
+
+	memset(buff, '\0', size);
+	free(buff);
+
+	return ret;
+}
+
+/**
+ * accounts_lookup()
+ * ctx:		Account database (acctdb)				[in]
+ * u:		Username to look up					[in]
+ * stored:	Buffer for the password hash (CRYPT_OUTPUT_SIZE)	[out]
+ *
+ * Backend for a compiled account database.
+ **/
+int accounts_lookup(void *ctx, const char *u, char *stored){
+	return acctdb_find((const acctdb*)ctx, u, stored, CRYPT_OUTPUT_SIZE);
+}
+
+/**
+ * auth_find()
+ * u:		Username to look up					[in]
+ * stored:	Buffer for the password hash (CRYPT_OUTPUT_SIZE)	[out]
+ *
+ * Returns 1 if a backend has the user, 0 if none of them do.
+ **/
+int auth_find(const char *u, char *stored){
+	int i = 0;
+
+	for(i = 0; i < auth_nbackends; i++)
+		if(auth_backends[i].lookup(auth_backends[i].ctx, u, stored))
+			return 1;
+
+	return 0;
+}
+
+/**
+ * auth_salt()
+ * hash:	Password hash from the backend			[in]
+ * salt:	Buffer for the salt (CRYPT_OUTPUT_SIZE)	[out]
+ *
+ * The salt is everything before the hash itself: "$id$salt" for MD5 ($1$), SHA-256 ($5$) and
+ * SHA-512 ($6$) (with "rounds=n$" in the middle if it's there), "$y$params$salt" for yescrypt,
+ * and the first 2 characters for traditional DES.
+ *
+ * Returns 1 on success, 0 if hash isn't something crypt() made (locked accounts are "!..." or
+ * "*", and an empty one would let any password in).
+ **/
+int auth_salt(const char *hash, char *salt){
+	const char *end = NULL;
+	size_t len = strlen(hash);
+
+	if((len < 2) || (hash[0] == '!') || (hash[0] == '*') || (len >= CRYPT_OUTPUT_SIZE))
+		return 0;
+
+	if(hash[0] == '$'){
+		// Last '$' comes right before the hash, and can't be the one that starts the id
+		if(!(end = strrchr(hash, '$')) || (end == hash))
+			return 0;
+
+		len = end - hash;
+	} else
+		len = 2;
+
+	memcpy(salt, hash, len);
+	salt[len] = '\0';
+
+	return 1;
+}
+
+/**
+ * auth_equal()
+ * a:	Hash to compare	[in]
+ * b:	Hash to compare	[in]
+ *
+ * Takes as long for hashes that differ in the first character as in the last one.
+ *
+ * Returns 1 if they're the same, 0 if not.
+ **/
+int auth_equal(const char *a, const char *b){
+	size_t len = strlen(a), i = 0;
+	unsigned char diff = 0;
+
+	if(len != strlen(b))
+		return 0;
+
+	for(i = 0; i < len; i++)
+		diff |= (unsigned char)a[i] ^ (unsigned char)b[i];
+
+	return (diff == 0);
+}
+
+/**
+ * auth_verify()
+ * p:		Given password			[in]
+ * stored:	User's password hash (auth_find())	[in]
+ *
+ * This is the expensive part (the whole of crypt()), the lookup isn't.
+ *
+ * Returns 1 if p is the password stored was made from, 0 if not.
+ **/
+int auth_verify(const char *p, const char *stored){
+	char salt[CRYPT_OUTPUT_SIZE];
+	char *hash = NULL;
+
+	int ret = 0;
+
+	if(auth_salt(stored, salt)){
+		// If we encrypt p with the salt, and its the same as the stored hash, success
+		hash = crypt_r(p, salt, &auth_crypt);
+
+		if(hash && (hash[0] != '*') && auth_equal(hash, stored))
+			ret = 1;
+	}
+
+	// Zeroed is also how crypt_r() wants it next time
+	memset(&auth_crypt, '\0', sizeof(auth_crypt));
+
+	return ret;
+}
+
+#endif
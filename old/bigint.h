@@ -53,6 +53,30 @@ void mpz2strn(mpz_t m, char *b, uint64_t i){
 	
 }
 
+/**
+ * mpz_zero()
+ * m:	The mpz_t variable to zero out	[in/out]
+ *
+ * Overwrites every limb m has allocated (not just the ones in use) and sets it to 0.
+ * m is still usable afterwards.  Used for secrets, mpz_clear() doesn't clear the memory.
+ **/
+void mpz_zero(mpz_t m){
+	if(m->_mp_alloc > 0)
+		memset(m->_mp_d, 0, m->_mp_alloc * sizeof(mp_limb_t));
+
+	m->_mp_size = 0;
+}
+
+/**
+ * mpz_wipe()
+ *
+ * Same as mpz_zero(), but also calls mpz_clear() on m.
+ **/
+void mpz_wipe(mpz_t m){
+	mpz_zero(m);
+	mpz_clear(m);
+}
+
 /**
  * birandom()
  * length:	The length of the key (i.e.: if 1024-bit key, length = 1024).	[in]
@@ -100,7 +124,7 @@ void birandom(uint64_t length, mpz_t buffer, uint8_t prime_only){
 
 	// Free resources (this is the reason why we can't just return randnum)
 	gmp_randclear(state);
-	mpz_clear(randnum);
+	mpz_wipe(randnum);
 }
 
 #endif
@@ -1,8 +1,78 @@
 #include "../network.h"
 #include "../zcrypt.h"
+#include "../resume.h"
+
+#include <fcntl.h>
+
+// Where the client keeps its resumption ticket & session keys
+#define TICKET_FILE	".vc_ticket"
+
+/**
+ * ticket_load()
+ * ticket:	Buffer for the ticket (TICKET_LEN + 1)		[out]
+ * vkey:	Buffer for the Viegnere Cipher key (VC_KEY + 1)	[out]
+ * sk:		Buffer for the D-H secret key			[out]
+ *
+ * Reads the last session's ticket & keys from TICKET_FILE, and sets MODULO to what it was.
+ *
+ * Returns 1 if there was a (complete) saved session, 0 otherwise.
+ **/
+int ticket_load(char *ticket, char *vkey, mpz_t sk){
+	char line[MEMBUFF] = {'\0'};
+	int ret = 0;
+
+	FILE *fp = fopen(TICKET_FILE, "r");
+
+	if(!fp)
+		return 0;
+
+	if(fgets(line, sizeof(line), fp) && (strlen(trim(line)) == TICKET_LEN)){
+		strcpy(ticket, line);
+
+		if(fgets(line, sizeof(line), fp)){
+			MODULO = atoi(line);
+
+			// The key can start or end with a space, so only strip the newline
+			if(fgets(line, sizeof(line), fp)){
+				line[strcspn(line, "\n")] = '\0';
+				strncpy(vkey, line, VC_KEY);
+
+				if(fgets(line, sizeof(line), fp) && (mpz_set_str(sk, trim(line), 10) == 0))
+					ret = 1;
+			}
+		}
+	}
+
+	memset(line, '\0', sizeof(line));
+	fclose(fp);
+
+	return ret;
+}
+
+/**
+ * ticket_save()
+ * ticket:	Ticket the server gave us	[in]
+ * vkey:	Viegnere Cipher key		[in]
+ * sk:		D-H secret key			[in]
+ *
+ * Saves the session to TICKET_FILE (only readable by the user) for the next run.
+ **/
+void ticket_save(char *ticket, char *vkey, mpz_t sk){
+	int fd = open(TICKET_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	FILE *fp = NULL;
+
+	if((fd == -1) || !(fp = fdopen(fd, "w"))){
+		perror("ticket_save()");
+		return;
+	}
+
+	gmp_fprintf(fp, "%s\n%d\n%s\n%Zd\n", ticket, MODULO, vkey, sk);
+
+	fclose(fp);
+}
 
 int main(int argc, char *argv[]){
-	int sockfd, nbytes, bufflen;
+	int sockfd, nbytes;
 	char *buff = (char*)malloc(sizeof(char) * MEMBUFF);
 	struct addrinfo hints, *serverinfo, *p;
 	int rv, vhkey, key;
@@ -14,7 +84,8 @@ int main(int argc, char *argv[]){
 	char *szA = (char*)malloc(sizeof(char) * MEMBUFF);
 	char *szB = (char*)malloc(sizeof(char) * MEMBUFF);
 	char *szCrypt = (char*)malloc(sizeof(char) * MEMBUFF);
-	char *szVkey = (char*)malloc(sizeof(char) * VC_KEY);
+	char *szVkey = (char*)malloc(sizeof(char) * (VC_KEY + 1));
+	char ticket[TICKET_LEN + 1] = {'\0'};
 	char *szVbuff = (char*)malloc(sizeof(char) * VC_BUFF);
 
 	memset(buff,	'\0', MEMBUFF	);
@@ -23,7 +94,7 @@ int main(int argc, char *argv[]){
 	memset(szA,	'\0', MEMBUFF	);
 	memset(szB,	'\0', MEMBUFF	);
 	memset(szCrypt,	'\0', MEMBUFF	);
-	memset(szVkey,	'\0', VC_KEY	);
+	memset(szVkey,	'\0', VC_KEY + 1);
 	memset(szVbuff,	'\0', VC_BUFF	);
 
 	mpz_t P, G, Cs, Csk, A, B, vkey;
@@ -61,6 +132,9 @@ int main(int argc, char *argv[]){
 			continue;
 		}
 
+		// Every frame is answered before the next one matters, nothing to gain from Nagle
+		setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+
 		break;
 	}
 
@@ -75,84 +149,102 @@ int main(int argc, char *argv[]){
 
 	freeaddrinfo(serverinfo);
 
-	// Get the key size to use for the system
-	bufflen = recvbufflen(sockfd);
-	recvall(sockfd, buff, bufflen);
-	//recv(sockfd, buff, bufflen, 0);
-	key = atoi(buff);
+	// Try to pick up where the last session left off (see resume.h)
+	if(ticket_load(ticket, szVkey, Csk))
+		sprintf(buff, "RESUME %s", ticket);
+	else
+		sprintf(buff, "NEW");
+
+	sendframe(sockfd, buff);
+
+	memset(buff, '\0', MEMBUFF);
+	recvframe(sockfd, buff, MEMBUFF);
 
-	// Generate a random secret key used for the D-H algorithm
-	birandom(key, Cs, 0);
+	if(streq(buff, "OK")){
+		D(("Resumed previous session"));
+	} else{
+		// Server doesn't know the ticket (or we didn't have one), so do the whole exchange
+		memset(szVkey, '\0', VC_KEY + 1);
+		MODULO = 94;
 
-	// Get P & G from the server
-	bufflen = recvbufflen(sockfd);
-	recvall(sockfd, buff, bufflen);
+		// Get the key size to use for the system
+		recvframe(sockfd, buff, MEMBUFF);
+		//recv(sockfd, buff, bufflen, 0);
+		key = atoi(buff);
+
+		// Generate a random secret key used for the D-H algorithm
+		birandom(key, Cs, 0);
+
+		// Get P & G from the server
+		recvframe(sockfd, buff, MEMBUFF);
 D(("P = %s", buff));
-	//recv(sockfd, buff, bufflen, 0);
-	str2mpz(buff, P);
+		//recv(sockfd, buff, bufflen, 0);
+		str2mpz(buff, P);
 
-	bufflen = recvbufflen(sockfd);
-	recvall(sockfd, buff, bufflen);
+		recvframe(sockfd, buff, MEMBUFF);
 D(("G = %s", buff));
-	//recv(sockfd, buff, bufflen, 0);
-	str2mpz(buff, G);
+		//recv(sockfd, buff, bufflen, 0);
+		str2mpz(buff, G);
 
-	// B = (G ^ Cs)(mod P)
-	mpz_powm_sec(B, G, Cs, P);
-	mpz2str(B, szB);
+		// B = (G ^ Cs)(mod P)
+		gen_E(B, G, Cs, P);
+		mpz2str(B, szB);
 
-	// Tell the server what our B value is
-	sendbufflen(sockfd, strlen(szB));
-	sendall(sockfd, szB);
+		// Tell the server what our B value is
+		sendframe(sockfd, szB);
 
-	// Get the server's A value
-	bufflen = recvbufflen(sockfd);
-	recvall(sockfd, buff, bufflen);
+		// Get the server's A value
+		recvframe(sockfd, buff, MEMBUFF);
 D(("A = %s", buff));
-	//recv(sockfd, buff, bufflen, 0);
-	str2mpz(buff, A);
+		//recv(sockfd, buff, bufflen, 0);
+		str2mpz(buff, A);
+
+		//
+		 // Secret key = (A ^ Cs)(mod P)
+		 // This is used to encrypt the data
+		 ///
+		gen_E(Csk, A, Cs, P);
+
+		// Get the Viegnere Cipher key strength (26, 54 or 96)
+		memset(buff, '\0', MEMBUFF);
+		recvframe(sockfd, buff, MEMBUFF);
+D(("VCKEY SIZE = %s", buff));
+		//recv(sockfd, buff, bufflen, 0);
+		MODULO = atoi(buff);
+		memset(buff, '\0', MEMBUFF);
 
-	//
-	 // Secret key = (A ^ Cs)(mod P)
-	 // This is used to encrypt the data
-	 ///
-	mpz_powm_sec(Csk, A, Cs, P);
+		// Get the Viegnere Cipher key from server and decrypt it
+		recvframe(sockfd, buff, MEMBUFF);
+D(("VCKEY = %s", buff));
+		//recv(sockfd, buff, bufflen, 0);
+		str2mpz(buff,vkey);
+		dh_decrypt(vkey, szVkey, Csk);
+	}
 
-	// Get the Viegnere Cipher key strength (26, 54 or 96)
-	bufflen = recvbufflen(sockfd);
-	memset(buff, '\0', MEMBUFF);
-	recvall(sockfd, buff, bufflen);
-D(("VCKEY SIZE = %s", buff));
-	//recv(sockfd, buff, bufflen, 0);
-	MODULO = atoi(buff);
+	// The server hands out a new ticket for every session
 	memset(buff, '\0', MEMBUFF);
+	recvframe(sockfd, buff, MEMBUFF);
 
-	// Get the Viegnere Cipher key from server and decrypt it
-	bufflen = recvbufflen(sockfd);
-	recvall(sockfd, buff, bufflen);
-D(("VCKEY = %s", buff));
-	//recv(sockfd, buff, bufflen, 0);
-	str2mpz(buff,vkey);
-	dh_decrypt(vkey, szVkey, Csk);
+	memset(ticket, '\0', sizeof(ticket));
+	zdecrypt(buff, ticket, szVkey, Csk);
+
+	ticket_save(ticket, szVkey, Csk);
 
 	// Send the username to the server
 	memset(szVbuff, '\0', VC_BUFF);
 	zencrypt("love", szVbuff, szVkey, Csk);
 D(("User (%d) = %s", strlen(szVbuff), szVbuff));
-	sendbufflen(sockfd, strlen(szVbuff));
-	sendall(sockfd, szVbuff);
+	sendframe(sockfd, szVbuff);
 
 	// Send the password to the server
 	memset(buff, '\0', sizeof(buff));
 	zencrypt("godsex", buff, szVkey, Csk);
 D(("Pass (%d) = %s", strlen(buff), buff));
-	sendbufflen(sockfd, strlen(buff));
-	sendall(sockfd, buff);
+	sendframe(sockfd, buff);
 
 	// Get the server response
 	memset(buff, '\0', strlen(buff));
-	bufflen = recvbufflen(sockfd);
-	recvall(sockfd, buff, bufflen);
+	recvframe(sockfd, buff, MEMBUFF);
 	//recv(sockfd, buff, bufflen, 0);
 	zdecrypt(buff, szVbuff, szVkey, Csk);
 D(("Server responded with %s", szVbuff));
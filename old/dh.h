@@ -34,9 +34,13 @@
  *
  * Please see appropriate source files for network information.
  ******************************************/
+#ifndef __DH_H
+#define __DH_H
+
 #include "debug.h"
 #include "bigint.h"
 #include "random.h"
+#include "fixbn.h"
 #include <stdint.h>
 #include <math.h>
 
@@ -49,9 +53,12 @@
  * m:		Modulus (P)			[in]
  *
  * Wrapper of sorts for mpz_powm_sec(), be more effective when vars (besides buff) are not needed.
+ *
+ * If m is one of the key sizes, the fixed-size math in fixbn.h is used instead (no allocations).
  **/
 void gen_E(mpz_t buff, mpz_t base, mpz_t x, mpz_t m){
-	mpz_powm_sec(buff, base, x, m);
+	if(!fixbn_powm(buff, base, x, m))
+		mpz_powm_sec(buff, base, x, m);
 }
 
 /**
@@ -239,3 +246,5 @@ void dh_decrypt(mpz_t enc, char *buffer, mpz_t sk){
 void gen_S(mpz_t buffer){
 
 }
+
+#endif
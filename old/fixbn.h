@@ -0,0 +1,130 @@
+#ifndef __FIXBN_H
+#define __FIXBN_H
+
+/*********************************
+ * Fixed-size big integers for the D-H math.
+ *
+ * Key sizes are a fixed menu (1024, 2048, 4096 or 8192 bits), so instead of going through
+ * heap-allocated mpz_t variables for every exponentiation, each size gets its own type with
+ * the limb count known at compile time.  Storage lives on the stack and the math sits directly
+ * on GMP's mpn layer (mpn_sec_powm() is the constant-time Montgomery exponentiation that
+ * mpz_powm_sec() uses internally), so nothing gets allocated.
+ *
+ * FIXBN_DEFINE(bits) creates:
+ *	fixbn<bits>		- The number itself
+ *	fixbn<bits>_set()	- mpz_t -> fixbn<bits>
+ *	fixbn<bits>_get()	- fixbn<bits> -> mpz_t
+ *	fixbn<bits>_powm()	- r = (b ^ e)(mod m)
+ *
+ * fixbn_powm() picks the right size based on the modulus.
+ *********************************/
+#include <gmp.h>
+#include <string.h>
+
+// How many limbs a key of (bits) size takes up
+#define FIXBN_LIMBS(bits)	((bits) / GMP_NUMB_BITS)
+
+#define FIXBN_DEFINE(bits)									\
+typedef struct __fixbn##bits {									\
+	mp_limb_t d[FIXBN_LIMBS(bits)];								\
+} fixbn##bits;											\
+												\
+/* Returns 0 if z doesn't fit in the type, 1 otherwise */					\
+static inline int fixbn##bits##_set(fixbn##bits *r, mpz_t z){					\
+	size_t n = mpz_size(z), i = 0;								\
+	const mp_limb_t *s = mpz_limbs_read(z);							\
+												\
+	if(n > FIXBN_LIMBS(bits))								\
+		return 0;									\
+												\
+	for(i = 0; i < FIXBN_LIMBS(bits); i++)							\
+		r->d[i] = (i < n) ? s[i] : 0;							\
+												\
+	return 1;										\
+}												\
+												\
+static inline void fixbn##bits##_get(mpz_t z, const fixbn##bits *a){				\
+	size_t i = 0;										\
+	mp_limb_t *d = mpz_limbs_write(z, FIXBN_LIMBS(bits));					\
+												\
+	for(i = 0; i < FIXBN_LIMBS(bits); i++)							\
+		d[i] = a->d[i];									\
+												\
+	mpz_limbs_finish(z, FIXBN_LIMBS(bits));							\
+}												\
+												\
+/* m must be odd and use every limb, b and e must be non-zero (same as mpn_sec_powm()) */	\
+static inline void fixbn##bits##_powm(fixbn##bits *r, const fixbn##bits *b,			\
+					const fixbn##bits *e, const fixbn##bits *m){		\
+	mp_limb_t tp[mpn_sec_powm_itch(FIXBN_LIMBS(bits), bits, FIXBN_LIMBS(bits))];		\
+												\
+	mpn_sec_powm(r->d, b->d, FIXBN_LIMBS(bits), e->d, bits, m->d, FIXBN_LIMBS(bits), tp);	\
+												\
+	/* Scratch space holds powers of the base, don't leave them on the stack (memset() of */\
+	/* something that's about to go away is optimized out, explicit_bzero() isn't) */	\
+	explicit_bzero(tp, sizeof(tp));								\
+}
+
+FIXBN_DEFINE(1024)
+FIXBN_DEFINE(2048)
+FIXBN_DEFINE(4096)
+FIXBN_DEFINE(8192)
+
+/**
+ * FIXBN_POWM()
+ *
+ * Body of fixbn_powm() for a single key size.  Kept as a macro so each case has its own
+ * compile-time limb count.
+ **/
+#define FIXBN_POWM(bits, r, b, e, m) do {							\
+	fixbn##bits fr, fb, fe, fm;								\
+												\
+	if(!fixbn##bits##_set(&fb, b) || !fixbn##bits##_set(&fe, e) || !fixbn##bits##_set(&fm, m))\
+		return 0;									\
+												\
+	fixbn##bits##_powm(&fr, &fb, &fe, &fm);							\
+	fixbn##bits##_get(r, &fr);								\
+												\
+	/* Secret exponent & the result (a shared secret) */					\
+	explicit_bzero(&fe, sizeof(fe));							\
+	explicit_bzero(&fr, sizeof(fr));							\
+} while(0)
+
+/**
+ * fixbn_powm()
+ * r:	Buffer to store the result	[out]
+ * b:	Base				[in]
+ * e:	Exponent			[in]
+ * m:	Modulus				[in]
+ *
+ * r = (b ^ e)(mod m) using the fixed-size type that matches m.
+ *
+ * Returns 1 if the fixed-size path was used, 0 if m isn't one of the key sizes (or the numbers
+ * don't meet mpn_sec_powm()'s requirements) and nothing was done.
+ **/
+int fixbn_powm(mpz_t r, mpz_t b, mpz_t e, mpz_t m){
+	// mpn_sec_powm() requires an odd modulus, and non-zero base & exponent
+	if(!mpz_odd_p(m) || (mpz_sgn(b) <= 0) || (mpz_sgn(e) <= 0))
+		return 0;
+
+	switch(mpz_size(m) * GMP_NUMB_BITS){
+		case 1024:
+			FIXBN_POWM(1024, r, b, e, m);
+			break;
+		case 2048:
+			FIXBN_POWM(2048, r, b, e, m);
+			break;
+		case 4096:
+			FIXBN_POWM(4096, r, b, e, m);
+			break;
+		case 8192:
+			FIXBN_POWM(8192, r, b, e, m);
+			break;
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef __GROUP_H
+#define __GROUP_H
+
+/*********************************
+ * D-H group cache.
+ *
+ * gen_P() and gen_G() are by far the most expensive parts of a handshake (an 8192-bit
+ * mpz_nextprime() can take seconds), and the server used to do both for every connection.
+ *
+ * Now each key size keeps one (P, G) pair that sessions share.  A group is thrown away and
+ * generated again after GROUP_MAX_USES handshakes, so P & G still change on a regular basis.
+ *
+ * Sessions that share a group also share work further down the line (see powmq.h).
+ *********************************/
+#include <pthread.h>
+#include "dh.h"
+#include "arena.h"
+#include "stats.h"
+
+// Handshakes a group is used for before new P & G are generated
+#define GROUP_MAX_USES	1024
+
+// Number of key sizes (1024, 2048, 4096, 8192)
+#define GROUP_SIZES	4
+
+typedef struct __dh_group {
+	int bits;
+
+	mpz_t P;
+	mpz_t G;
+
+	// Bumped every time P & G are regenerated, 0 means the group hasn't been generated yet
+	uint64_t gen;
+	uint64_t uses;
+
+	pthread_mutex_t lock;
+} dh_group;
+
+dh_group groups[GROUP_SIZES];
+
+/**
+ * group_index()
+ * bits:	Key size	[in]
+ *
+ * Returns which slot of groups[] holds bits, or -1 if it's not one of the key sizes.
+ **/
+int group_index(int bits){
+	switch(bits){
+		case 1024:	return 0;
+		case 2048:	return 1;
+		case 4096:	return 2;
+		case 8192:	return 3;
+	}
+
+	return -1;
+}
+
+/**
+ * group_init()
+ *
+ * Sets up the (empty) groups, P & G are generated the first time they're needed.
+ **/
+void group_init(){
+	int i = 0;
+
+	for(i = 0; i < GROUP_SIZES; i++){
+		groups[i].bits = 1024 << i;
+		groups[i].gen = 0;
+		groups[i].uses = 0;
+
+		mpz_init(groups[i].P);
+		mpz_init(groups[i].G);
+
+		pthread_mutex_init(&groups[i].lock, NULL);
+	}
+}
+
+/**
+ * group_get()
+ * bits:	Key size of the group		[in]
+ * P:		Buffer to store the modulus	[out]
+ * G:		Buffer to store the base	[out]
+ *
+ * Copies the cached group for bits into P & G, generating it first if it's new or used up.
+ *
+ * Returns the generation of the group that was handed out (0 if bits isn't a key size, in which
+ * case P & G are generated just for the caller).
+ **/
+uint64_t group_get(int bits, mpz_t P, mpz_t G){
+	int i = group_index(bits);
+	uint64_t gen = 0;
+
+	dh_group *g = NULL;
+	arena *a = NULL;
+
+	uint64_t start = 0;
+
+	if(i == -1){
+		gen_P(bits, P);
+		gen_G(bits, P, G);
+
+		return 0;
+	}
+
+	g = &groups[i];
+
+	pthread_mutex_lock(&g->lock);
+
+	if(!g->gen || (g->uses >= GROUP_MAX_USES)){
+		D(("Generating new %d-bit group", bits));
+
+		// The group outlives the session asking for it, so keep it out of the session's arena
+		a = arena_use(NULL);
+
+		start = stats_now();
+		gen_P(bits, g->P);
+		stats_record(PHASE_GEN_P, stats_now() - start);
+
+		start = stats_now();
+		gen_G(bits, g->P, g->G);
+		stats_record(PHASE_GEN_G, stats_now() - start);
+
+		arena_use(a);
+
+		g->gen++;
+		g->uses = 0;
+	}
+
+	g->uses++;
+
+	mpz_set(P, g->P);
+	mpz_set(G, g->G);
+
+	gen = g->gen;
+
+	pthread_mutex_unlock(&g->lock);
+
+	return gen;
+}
+
+#endif
@@ -0,0 +1,564 @@
+/****************************
+ * Handshake load generator.
+ *
+ * The client does one session and D()s its way through it, which says nothing about how many
+ * handshakes the server can take.  This opens sessions from a pool of threads, each going through
+ * the whole exchange (NEW, key size, P & G, B & A, modulo, Viegnere key, ticket, user & password),
+ * and reports handshakes/sec, bytes per handshake and p50/p90/p99/max for every phase, as seen
+ * from the client (see stats.h for the server's side).
+ *
+ * Sessions ask for their key size & modulo ("NEW <bits> <modulo>", see session_params() in the
+ * server), so one run can sweep every key size (1024 - 8192) and every modulo (26, 52, 94).
+ *
+ * With a rate of 0 every thread starts a new session as soon as its last one is done (closed
+ * loop), which finds the most the server can do.  With a rate, sessions are started on a fixed
+ * schedule no matter how the server keeps up (open loop), and "total" is measured from when a
+ * session was supposed to start, so a server falling behind shows up as queueing, instead of the
+ * load quietly backing off.
+ *
+ * The first session of every key size & modulo isn't counted, the server generates a group the
+ * first time a key size is asked for (a few seconds for 8192 bits).
+ *
+ * All sessions come from one address, so the server has to be started with its per-address limit
+ * off (-r 0, see ratelimit.h) or most of them get turned away, and with -k or it won't hand out
+ * keys bigger than its default (see session_params()).
+ *
+ * Usage: loadgen <address> <port> [threads] [sessions] [rate] [bits] [modulo]
+ *	(bits & modulo of 0 sweep all of them)
+ ****************************/
+#include "../network.h"
+#include "../zcrypt.h"
+#include "../stats.h"
+
+#include <pthread.h>
+
+// Who to log in as (same as the client)
+#define LOADGEN_USER	"love"
+#define LOADGEN_PASS	"godsex"
+
+#define LOADGEN_THREADS		8
+#define LOADGEN_SESSIONS	200
+
+enum {
+	LG_CONNECT,
+	LG_HELLO,
+	LG_PARAMS,
+	LG_KEYGEN,
+	LG_EXCHANGE,
+	LG_SECRET,
+	LG_VCKEY,
+	LG_TICKET,
+	LG_AUTH,
+	LG_TOTAL,
+	LG_PHASES
+};
+
+const char *lg_names[LG_PHASES] = {
+	"connect", "hello", "P & G", "keygen (B)", "B -> A", "secret", "vc key", "ticket", "auth", "total"
+};
+
+const int lg_bits[] = {1024, 2048, 4096, 8192};
+const int lg_modulos[] = {26, 52, 94};
+
+/**
+ * struct __lg_times {}
+ *
+ * What one session spent in each phase (nanoseconds), laid out like phase_times so PHASE()
+ * works on it.
+ **/
+typedef struct __lg_times {
+	uint64_t ns[LG_PHASES];
+} lg_times;
+
+/**
+ * struct __lg_conn {}
+ *
+ * A session's socket, what went over it and a buffer to build frames in.
+ **/
+typedef struct __lg_conn {
+	int fd;
+
+	uint64_t tx;
+	uint64_t rx;
+
+	char out[5 + MEMBUFF];
+} lg_conn;
+
+/**
+ * struct __lg_run {}
+ *
+ * One key size & modulo's worth of sessions, shared by all of the threads.
+ **/
+typedef struct __lg_run {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	int bits;
+	int modulo;
+
+	int sessions;
+	double rate;
+
+	// When the run started, and the next session to hand out
+	uint64_t start;
+	int next;
+
+	// Results
+	uint64_t ok;
+	uint64_t failed;
+	uint64_t errors;
+	uint64_t tx;
+	uint64_t rx;
+
+	histogram hist[LG_PHASES];
+} lg_run;
+
+/**
+ * struct __lg_row {}
+ *
+ * Summary of a run, for the table at the end.
+ **/
+typedef struct __lg_row {
+	int bits;
+	int modulo;
+
+	double rate;
+	double bytes;
+	double p50;
+	double p99;
+
+	uint64_t ok;
+	uint64_t failed;
+	uint64_t errors;
+} lg_row;
+
+/**
+ * lg_send()
+ * c:		Connection to send to	[in/out]
+ * data:	Frame to send		[in]
+ *
+ * Sends the 5 digit length & data in one go (sendall() clears what it sends, and D()s every
+ * failure, neither of which is wanted here).
+ *
+ * Returns 1 on success, 0 on failure.
+ **/
+int lg_send(lg_conn *c, const char *data){
+	int len = strlen(data), pos = 0, n = 0;
+
+	if(len >= MEMBUFF)
+		return 0;
+
+	sprintf(c->out, "%05d", len);
+	memcpy(c->out + 5, data, len);
+
+	len += 5;
+
+	while(pos < len){
+		if((n = send(c->fd, c->out + pos, len - pos, MSG_NOSIGNAL)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			return 0;
+		}
+
+		pos += n;
+	}
+
+	c->tx += len;
+
+	return 1;
+}
+
+/**
+ * lg_read()
+ * c:	Connection to read from		[in]
+ * buff:	Where to put the data	[out]
+ * len:	How much to read		[in]
+ *
+ * Returns 1 once len bytes are in, 0 on failure or if the server hung up.
+ **/
+int lg_read(lg_conn *c, char *buff, int len){
+	int pos = 0, n = 0;
+
+	while(pos < len){
+		if((n = recv(c->fd, buff + pos, len - pos, 0)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			return 0;
+		}
+
+		if(n == 0)
+			return 0;
+
+		pos += n;
+	}
+
+	return 1;
+}
+
+/**
+ * lg_recv()
+ * c:		Connection to read from			[in/out]
+ * buff:	Where to put the frame (\0 terminated)	[out]
+ * size:	Size of buff				[in]
+ *
+ * Same as recvframe(), without the D()s.
+ *
+ * Returns the length of the frame, or -1 on failure.
+ **/
+int lg_recv(lg_conn *c, char *buff, int size){
+	char hdr[6] = {'\0'};
+	int len = 0;
+
+	if(!lg_read(c, hdr, 5))
+		return -1;
+
+	if(((len = atoi(hdr)) <= 0) || (len >= size) || !lg_read(c, buff, len))
+		return -1;
+
+	buff[len] = '\0';
+	c->rx += 5 + len;
+
+	return len;
+}
+
+/**
+ * lg_recvmpz()
+ * c:		Connection to read from	[in/out]
+ * buff:	Buffer to read into	[in]
+ * m:		Where to put the number	[out]
+ *
+ * Returns 1 on success, 0 on failure.
+ **/
+int lg_recvmpz(lg_conn *c, char *buff, mpz_t m){
+	if(lg_recv(c, buff, MEMBUFF) == -1)
+		return 0;
+
+	return (mpz_set_str(m, buff, 10) == 0);
+}
+
+/**
+ * lg_session()
+ * r:		Run the session is part of	[in]
+ * t:		Session's phase times		[out]
+ * c:		Connection to use		[in/out]
+ * buff:	MEMBUFF sized buffer		[in]
+ *
+ * Goes through one whole handshake & login, the same way the client does.
+ *
+ * Returns 1 if the login worked, 0 if the server said no, -1 if the handshake didn't make it.
+ **/
+int lg_session(lg_run *r, lg_times *t, lg_conn *c, char *buff){
+	mpz_t P, G, Cs, Csk, A, B, vkey;
+
+	char user[] = LOADGEN_USER;
+	char pass[] = LOADGEN_PASS;
+	char szVkey[VC_KEY + 1] = {'\0'};
+	char cipher[VC_BUFF] = {'\0'};
+
+	int ok = 0, ret = -1;
+
+	c->fd = -1;
+
+	mpz_init2(P, r->bits);
+	mpz_init2(G, r->bits);
+	mpz_init2(A, r->bits);
+	mpz_init2(B, r->bits);
+	mpz_init2(Cs, r->bits);
+	mpz_init2(Csk, r->bits);
+	mpz_init(vkey);
+
+	PHASE(t, LG_CONNECT,
+		ok = ((c->fd = socket(r->addr.ss_family, SOCK_STREAM, 0)) != -1) &&
+			(connect(c->fd, (struct sockaddr*)&r->addr, r->addrlen) == 0));
+
+	if(!ok)
+		goto done;
+
+	// The username & password go out back to back, Nagle would hold the second one for an ACK
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &ok, sizeof(int));
+
+	// The server sends back the key size it's going to use, which has to be the one we asked for
+	sprintf(buff, "NEW %d %d", r->bits, r->modulo);
+
+	PHASE(t, LG_HELLO,
+		ok = lg_send(c, buff) && (lg_recv(c, buff, MEMBUFF) != -1) && streq(buff, "NEW") &&
+			(lg_recv(c, buff, MEMBUFF) != -1) && (atoi(buff) == r->bits));
+
+	if(!ok)
+		goto done;
+
+	PHASE(t, LG_PARAMS, ok = lg_recvmpz(c, buff, P) && lg_recvmpz(c, buff, G));
+
+	if(!ok)
+		goto done;
+
+	// B = (G ^ Cs)(mod P)
+	PHASE(t, LG_KEYGEN, birandom(r->bits, Cs, 0); gen_E(B, G, Cs, P); mpz2str(B, buff));
+
+	PHASE(t, LG_EXCHANGE, ok = lg_send(c, buff) && lg_recvmpz(c, buff, A));
+
+	if(!ok)
+		goto done;
+
+	// Secret key = (A ^ Cs)(mod P)
+	PHASE(t, LG_SECRET, gen_E(Csk, A, Cs, P));
+
+	PHASE(t, LG_VCKEY,
+		ok = (lg_recv(c, buff, MEMBUFF) != -1) && (atoi(buff) == r->modulo) && lg_recvmpz(c, buff, vkey);
+
+		if(ok)
+			dh_decrypt(vkey, szVkey, Csk));
+
+	if(!ok)
+		goto done;
+
+	MODULO = r->modulo;
+
+	// Nothing to do with the ticket, it's only here so the session costs what a real one does
+	PHASE(t, LG_TICKET, ok = (lg_recv(c, buff, MEMBUFF) != -1));
+
+	if(!ok)
+		goto done;
+
+	PHASE(t, LG_AUTH,
+		vc_encrypt(user, szVkey, cipher);
+		ok = lg_send(c, cipher);
+
+		memset(cipher, '\0', sizeof(cipher));
+		vc_encrypt(pass, szVkey, cipher);
+		ok = ok && lg_send(c, cipher) && (lg_recv(c, buff, VC_BUFF) != -1));
+
+	if(!ok)
+		goto done;
+
+	memset(cipher, '\0', sizeof(cipher));
+	vc_decrypt(buff, szVkey, cipher);
+
+	ret = streq(cipher, "OK") ? 1 : 0;
+
+done:
+	if(c->fd != -1)
+		close(c->fd);
+
+	mpz_clear(P);
+	mpz_clear(G);
+	mpz_clear(A);
+	mpz_clear(B);
+	mpz_wipe(Cs);
+	mpz_wipe(Csk);
+	mpz_clear(vkey);
+
+	return ret;
+}
+
+/**
+ * lg_thread()
+ * arg:	The run (lg_run*)	[in]
+ *
+ * Takes sessions off the run until there are none left.  With a rate, each one waits for its
+ * turn on the schedule first.
+ **/
+void *lg_thread(void *arg){
+	lg_run *r = (lg_run*)arg;
+	lg_conn *c = (lg_conn*)malloc(sizeof(lg_conn));
+	char *buff = (char*)malloc(MEMBUFF);
+	struct timespec ts;
+	lg_times t;
+	uint64_t due = 0;
+	int n = 0, ret = 0, i = 0;
+
+	while((n = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->sessions){
+		memset(&t, 0, sizeof(lg_times));
+		memset(buff, '\0', MEMBUFF);
+
+		c->tx = c->rx = 0;
+
+		if(r->rate > 0){
+			due = r->start + (uint64_t)((n / r->rate) * 1e9);
+
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		} else
+			due = stats_now();
+
+		ret = lg_session(r, &t, c, buff);
+
+		t.ns[LG_TOTAL] = stats_now() - due;
+
+		if(ret == -1){
+			__atomic_fetch_add(&r->errors, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		__atomic_fetch_add((ret ? &r->ok : &r->failed), 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&r->tx, c->tx, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&r->rx, c->rx, __ATOMIC_RELAXED);
+
+		for(i = 0; i < LG_PHASES; i++)
+			hist_record(&r->hist[i], t.ns[i]);
+	}
+
+	free(buff);
+	free(c);
+
+	return NULL;
+}
+
+/**
+ * lg_config()
+ * r:		Run to use (address, sessions & rate already set)	[in/out]
+ * threads:	How many threads to run sessions on			[in]
+ * bits:	Key size						[in]
+ * modulo:	Viegnere Cipher modulo					[in]
+ * row:		Summary of the run					[out]
+ *
+ * Runs r->sessions sessions with the given key size & modulo and prints the results.
+ *
+ * Returns 1 on success, 0 if not even the warm up session made it.
+ **/
+int lg_config(lg_run *r, int threads, int bits, int modulo, lg_row *row){
+	pthread_t *tid = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+	lg_conn *c = (lg_conn*)malloc(sizeof(lg_conn));
+	char *buff = (char*)malloc(MEMBUFF);
+	uint64_t elapsed = 0, done = 0;
+	lg_times t;
+	int i = 0, started = 0, ret = 0;
+
+	r->bits = bits;
+	r->modulo = modulo;
+	r->next = 0;
+	r->ok = r->failed = r->errors = r->tx = r->rx = 0;
+
+	memset(r->hist, 0, sizeof(r->hist));
+	memset(row, 0, sizeof(lg_row));
+
+	row->bits = bits;
+	row->modulo = modulo;
+
+	// Warm up (the server may have to generate the group)
+	if(lg_session(r, &t, c, buff) == -1){
+		printf("== %d bits, modulo %d: handshake failed\n", bits, modulo);
+		goto done;
+	}
+
+	r->start = stats_now();
+
+	for(started = 0; started < threads; started++)
+		if(pthread_create(&tid[started], NULL, lg_thread, r) != 0){
+			perror("pthread_create()");
+			break;
+		}
+
+	for(i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	if(!started)
+		goto done;
+
+	elapsed = stats_now() - r->start;
+	done = r->ok + r->failed;
+
+	row->rate = done / (elapsed / 1e9);
+	row->bytes = done ? (double)(r->tx + r->rx) / done : 0;
+	row->p50 = stats_percentile(&r->hist[LG_TOTAL], 50.0) / 1000.0;
+	row->p99 = stats_percentile(&r->hist[LG_TOTAL], 99.0) / 1000.0;
+	row->ok = r->ok;
+	row->failed = r->failed;
+	row->errors = r->errors;
+
+	printf("== %d bits, modulo %d: %lu handshakes (%lu logged in, %lu refused, %lu errors) in %.2f s: %.1f/s, %.0f bytes each (%.0f sent, %.0f received)\n",
+		bits, modulo, done, r->ok, r->failed, r->errors, elapsed / 1e9, row->rate, row->bytes,
+		done ? (double)r->tx / done : 0, done ? (double)r->rx / done : 0);
+
+	stats_table(r->hist, lg_names, LG_PHASES);
+	printf("\n");
+
+	ret = 1;
+
+done:
+	free(buff);
+	free(c);
+	free(tid);
+
+	return ret;
+}
+
+int main(int argc, char *argv[]){
+	struct addrinfo hints, *res = NULL;
+	lg_run *r = NULL;
+	lg_row rows[(sizeof(lg_bits) / sizeof(int)) * (sizeof(lg_modulos) / sizeof(int))];
+	int threads = 0, bits = 0, modulo = 0, nrows = 0, rv = 0, i = 0, j = 0;
+
+	if(argc < 3){
+		printf("Usage: %s <address> <port> [threads] [sessions] [rate] [bits] [modulo]\n", argv[0]);
+		printf("\trate: sessions/sec to start (0 = closed loop), bits & modulo: 0 = all of them\n");
+		return 1;
+	}
+
+	if(!(r = (lg_run*)malloc(sizeof(lg_run))))
+		return 1;
+
+	memset(r, 0, sizeof(lg_run));
+
+	threads = (argc > 3) ? atoi(argv[3]) : LOADGEN_THREADS;
+	r->sessions = (argc > 4) ? atoi(argv[4]) : LOADGEN_SESSIONS;
+	r->rate = (argc > 5) ? atof(argv[5]) : 0;
+	bits = (argc > 6) ? atoi(argv[6]) : 0;
+	modulo = (argc > 7) ? atoi(argv[7]) : 0;
+
+	if((threads < 1) || (r->sessions < 1)){
+		printf("Need at least one thread & session\n");
+		return 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if((rv = getaddrinfo(argv[1], argv[2], &hints, &res)) != 0){
+		printf("getaddrinfo(): %s\n", gai_strerror(rv));
+		return 1;
+	}
+
+	memcpy(&r->addr, res->ai_addr, res->ai_addrlen);
+	r->addrlen = res->ai_addrlen;
+
+	freeaddrinfo(res);
+
+	printf("%d threads, %d sessions per key size & modulo, %s\n\n", threads, r->sessions,
+		(r->rate > 0) ? "open loop" : "closed loop");
+
+	for(i = 0; i < (int)(sizeof(lg_bits) / sizeof(int)); i++){
+		if(bits && (bits != lg_bits[i]))
+			continue;
+
+		for(j = 0; j < (int)(sizeof(lg_modulos) / sizeof(int)); j++){
+			if(modulo && (modulo != lg_modulos[j]))
+				continue;
+
+			if(lg_config(r, threads, lg_bits[i], lg_modulos[j], &rows[nrows]))
+				nrows++;
+		}
+	}
+
+	if(!nrows){
+		printf("Nothing to run (bits has to be 1024 - 8192, modulo 26, 52 or 94)\n");
+		return 1;
+	}
+
+	printf("%6s %6s %12s %12s %12s %12s %8s %8s %8s\n", "bits", "modulo", "handshakes/s", "bytes each",
+		"p50 (ms)", "p99 (ms)", "ok", "refused", "errors");
+
+	for(i = 0; i < nrows; i++)
+		printf("%6d %6d %12.1f %12.0f %12.2f %12.2f %8lu %8lu %8lu\n", rows[i].bits, rows[i].modulo,
+			rows[i].rate, rows[i].bytes, rows[i].p50 / 1000.0, rows[i].p99 / 1000.0,
+			rows[i].ok, rows[i].failed, rows[i].errors);
+
+	free(r);
+
+	return 0;
+}
@@ -13,14 +13,21 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include "debug.h"
 
+// When this thread's sends & receives have to be done by (CLOCK_MONOTONIC ms, 0 = no limit)
+__thread uint64_t net_until = 0;
+
 /**
  * in_addr()
  * isa: struct sockaddr pointer for server sockaddr     [in]
@@ -34,6 +41,67 @@ void *in_addr(struct sockaddr *isa){
         return &(((struct sockaddr_in6*)isa)->sin6_addr);
 }
 
+/**
+ * net_now()
+ *
+ * Returns CLOCK_MONOTONIC in milliseconds.
+ **/
+uint64_t net_now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000);
+}
+
+/**
+ * net_deadline()
+ * secs:	How long from now (0 = no limit)	[in]
+ *
+ * Everything this thread sends & receives from now on has to be done by then, however many
+ * send()s or recv()s it takes.  A timeout per call (SO_RCVTIMEO) would let a client that sends
+ * a byte every few seconds hold on to a blocking thread forever.
+ **/
+void net_deadline(int secs){
+	net_until = (secs > 0) ? net_now() + (secs * 1000ULL) : 0;
+}
+
+/**
+ * net_wait()
+ * s:		Socket about to be used			[in]
+ * events:	POLLIN or POLLOUT				[in]
+ *
+ * Waits for s to be ready, for however much of the thread's deadline is left (see net_deadline()).
+ *
+ * Returns 1 if s can be used, 0 if the deadline's passed (errno = ETIMEDOUT) or poll() failed.
+ **/
+int net_wait(int s, short events){
+	struct pollfd pfd;
+	uint64_t now = 0;
+	int ret = 0;
+
+	if(!net_until)
+		return 1;
+
+	pfd.fd = s;
+	pfd.events = events;
+
+	while(1){
+		if((now = net_now()) >= net_until){
+			errno = ETIMEDOUT;
+			return 0;
+		}
+
+		pfd.revents = 0;
+
+		if((ret = poll(&pfd, 1, (int)(net_until - now))) > 0)
+			return 1;
+
+		if((ret == -1) && (errno != EINTR))
+			return 0;
+	}
+}
+
 /**
  * sendall()
  * s:		Socket [file descriptor] to send data to	[in]
@@ -49,7 +117,20 @@ int sendall(int s, char *buffer){
 	int left = len;
 	int curr = 0;
 
-	while((curr = send(s, buffer+pos, left, 0)) != -1){
+	while(left > 0){
+		if(!net_wait(s, POLLOUT)){
+			perror("sendall()");
+			break;
+		}
+
+		if((curr = send(s, buffer+pos, left, 0)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			perror("sendall()");
+			break;
+		}
+
 		pos += curr;
 		left -= curr;
 	}
@@ -59,29 +140,61 @@ int sendall(int s, char *buffer){
 	return pos;
 }
 
-int recvbufflen(int s){
-	char *tmp = (char*)malloc(sizeof(char) * 5);
-	memset(tmp, '\0', sizeof(tmp));
-
-	recv(s, tmp, 5, 0);
-
-	int len = atoi(tmp);
+void sendbufflen(int s, int len){
+	char tmp[6] = {'\0'};
 
-	free(tmp);
+	sprintf(tmp, "%05d", len);
 
-	return len;
+	if(!sendall(s, tmp))
+		D(("error sendbufflen() -> sendall()"));
 }
 
-void sendbufflen(int s, int len){
-	char *tmp = (char*)malloc(sizeof(char) * 5);
-	memset(tmp, '\0', sizeof(tmp));
+/**
+ * sendframe()
+ * s:		Socket to send to			[in]
+ * buffer:	The data to send (emptied after)	[in/out]
+ *
+ * Same as sendbufflen() + sendall(), but the length & data go out in one writev(), so they're one
+ * segment.  Two small writes in a row are what Nagle's algorithm holds back until the first is
+ * ACKed, and the other side only ACKs once its delayed ACK timer (~40 ms) goes off.
+ *
+ * Returns 0 on failure, otherwise total bytes sent (length included).
+ **/
+int sendframe(int s, char *buffer){
+	char tmp[6] = {'\0'};
+	struct iovec iov[2];
+	int len = strlen(buffer), pos = 0, curr = 0, off = 0;
 
 	sprintf(tmp, "%05d", len);
 
-	if(!sendall(s, tmp))
-		D(("error sendbufflen() -> sendall()"));
+	while(pos < len + 5){
+		// Whatever's left of the length, then whatever's left of the data
+		off = (pos < 5) ? pos : 5;
+
+		iov[0].iov_base = tmp + off;
+		iov[0].iov_len = 5 - off;
+		iov[1].iov_base = buffer + (pos - off);
+		iov[1].iov_len = len - (pos - off);
+
+		if(!net_wait(s, POLLOUT)){
+			perror("sendframe()");
+			break;
+		}
+
+		if((curr = writev(s, iov, 2)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			perror("sendframe()");
+			break;
+		}
 
-	free(tmp);
+		pos += curr;
+	}
+
+	memset(buffer, '\0', len);
+
+	return pos;
 }
 
 /**
@@ -101,7 +214,7 @@ D(("Receiving %d bytes from %d", len, s));
 	 **/
 	while(pos < len){
 D(("while(%d < %d)", pos, len));
-		curr = recv(s, buffer+pos, left, 0);
+		curr = net_wait(s, POLLIN) ? recv(s, buffer+pos, left, 0) : -1;
 
 		if(curr == -1){
 			perror("recvall()");
@@ -109,6 +222,12 @@ D(("while(%d < %d)", pos, len));
 			break;
 		}
 
+		// Other side hung up
+		if(curr == 0){
+			pos = 0;
+			break;
+		}
+
 		pos += curr;
 		left -= curr;
 D(("Read %d bytes (%d / %d total)", curr, pos, len));
@@ -117,6 +236,43 @@ D(("Read %d bytes (%d / %d total)", curr, pos, len));
 	return pos;
 }
 
+int recvbufflen(int s){
+	char tmp[6] = {'\0'};
+
+	// The 5 digits can be split over more than one recv()
+	if(recvall(s, tmp, 5) != 5)
+		return 0;
+
+	return atoi(tmp);
+}
+
+/**
+ * recvframe()
+ * s:		Socket to read from				[in]
+ * buffer:	Where to put the data (\0 terminated)		[out]
+ * size:	Size of buffer					[in]
+ *
+ * Reads a length & that much data, like recvbufflen() + recvall(), but a length that won't fit in
+ * buffer is refused before any of the data is read (the connection can't be used after that).
+ *
+ * Returns the number of bytes read, or -1 on failure.
+ **/
+int recvframe(int s, char *buffer, int size){
+	int len = recvbufflen(s);
+
+	if((len <= 0) || (len >= size)){
+		D(("Refusing a %d byte frame on %d (room for %d)", len, s, size - 1));
+		return -1;
+	}
+
+	if(recvall(s, buffer, len) != len)
+		return -1;
+
+	buffer[len] = '\0';
+
+	return len;
+}
+
 /*
 #define BACKLOG 10
 
@@ -0,0 +1,262 @@
+#ifndef __PAIRS_H
+#define __PAIRS_H
+
+/*********************************
+ * Pre-generated (Ss, A) pairs.
+ *
+ * Now that P & G are cached (group.h), the server's secret (Ss) and A = (G ^ Ss)(mod P) don't
+ * depend on anything the client sends, so they can be made ahead of time.
+ *
+ * Each group gets a reservoir of PAIRS_MAX pairs that a low priority thread keeps topped off
+ * (it only gets CPU time that nothing else wants).  A handshake takes a pair out of the
+ * reservoir, which leaves just the secret key computation on the critical path.
+ *
+ * Pairs are single use: taking one moves it out of the reservoir, and the session wipes it
+ * (see mpz_wipe() in bigint.h) once it's done with it.  Slots are zeroed as soon as they're
+ * emptied, and pairs made for a group that has since been regenerated are wiped and never
+ * handed out.
+ *********************************/
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "group.h"
+
+// How many pairs each group keeps on hand
+#define PAIRS_MAX	64
+
+// The refill thread is woken up when a reservoir drops below this
+#define PAIRS_LOW	16
+
+typedef struct __dh_pair {
+	mpz_t Ss;
+	mpz_t A;
+} dh_pair;
+
+typedef struct __pair_pool {
+	// Group generation the pairs belong to
+	uint64_t gen;
+
+	dh_pair pairs[PAIRS_MAX];
+	int count;
+
+	// Stats
+	uint64_t hits;
+	uint64_t misses;
+} pair_pool;
+
+pair_pool pools[GROUP_SIZES];
+
+pthread_mutex_t pairs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pairs_low = PTHREAD_COND_INITIALIZER;
+
+/**
+ * pairs_drain()
+ * pool:	Reservoir to empty	[in/out]
+ *
+ * Wipes every pair in the reservoir.  pairs_lock must be held.
+ **/
+void pairs_drain(pair_pool *pool){
+	while(pool->count > 0){
+		pool->count--;
+
+		mpz_zero(pool->pairs[pool->count].Ss);
+		mpz_zero(pool->pairs[pool->count].A);
+	}
+}
+
+/**
+ * pairs_fill()
+ * i:	Slot in groups[] & pools[] to top off	[in]
+ *
+ * Makes pairs for groups[i] until the reservoir is full.  The expensive part is done without
+ * holding pairs_lock.
+ *
+ * Returns the number of pairs added.
+ **/
+int pairs_fill(int i){
+	pair_pool *pool = &pools[i];
+	dh_group *g = &groups[i];
+	uint64_t gen = 0;
+	int added = 0;
+
+	mpz_t P, G, Ss, A;
+
+	mpz_init(P);
+	mpz_init(G);
+	mpz_init(Ss);
+	mpz_init(A);
+
+	// Don't bother with groups nobody has asked for yet
+	pthread_mutex_lock(&g->lock);
+
+	gen = g->gen;
+
+	if(gen){
+		mpz_set(P, g->P);
+		mpz_set(G, g->G);
+	}
+
+	pthread_mutex_unlock(&g->lock);
+
+	if(gen){
+		pthread_mutex_lock(&pairs_lock);
+
+		// Group was regenerated, pairs we have are useless now
+		if(pool->gen != gen){
+			pairs_drain(pool);
+
+			pool->gen = gen;
+		}
+
+		while(pool->count < PAIRS_MAX){
+			pthread_mutex_unlock(&pairs_lock);
+
+			birandom(g->bits, Ss, 0);
+			gen_E(A, G, Ss, P);
+
+			pthread_mutex_lock(&pairs_lock);
+
+			if((pool->gen != gen) || (pool->count >= PAIRS_MAX))
+				break;
+
+			mpz_swap(pool->pairs[pool->count].Ss, Ss);
+			mpz_swap(pool->pairs[pool->count].A, A);
+
+			pool->count++;
+			added++;
+		}
+
+		pthread_mutex_unlock(&pairs_lock);
+	}
+
+	mpz_wipe(Ss);
+	mpz_wipe(A);
+
+	mpz_clear(P);
+	mpz_clear(G);
+
+	return added;
+}
+
+/**
+ * pairs_thread()
+ * arg:	Not used	[in]
+ *
+ * Keeps every reservoir full.  Sleeps until one runs low (or a second passes, to catch groups
+ * that were regenerated).
+ **/
+void *pairs_thread(void *arg){
+	struct timespec ts;
+	int i = 0, added = 0;
+
+	// Only use cores that are otherwise idle
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	while(1){
+		added = 0;
+
+		for(i = 0; i < GROUP_SIZES; i++)
+			added += pairs_fill(i);
+
+		if(added)
+			D(("Added %d pairs to the reservoirs", added));
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+
+		pthread_mutex_lock(&pairs_lock);
+		pthread_cond_timedwait(&pairs_low, &pairs_lock, &ts);
+		pthread_mutex_unlock(&pairs_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * pairs_init()
+ * threads:	Number of refill threads to start	[in]
+ *
+ * group_init() must be called first.  Returns 1 on success, 0 on failure.
+ **/
+int pairs_init(int threads){
+	pthread_t t;
+	int i = 0, j = 0;
+
+	for(i = 0; i < GROUP_SIZES; i++){
+		memset(&pools[i], 0, sizeof(pair_pool));
+
+		for(j = 0; j < PAIRS_MAX; j++){
+			mpz_init(pools[i].pairs[j].Ss);
+			mpz_init(pools[i].pairs[j].A);
+		}
+	}
+
+	for(i = 0; i < threads; i++){
+		if(pthread_create(&t, NULL, pairs_thread, NULL) != 0){
+			perror("pthread_create()");
+			return 0;
+		}
+
+		pthread_detach(t);
+	}
+
+	return 1;
+}
+
+/**
+ * pairs_take()
+ * bits:	Key size of the group		[in]
+ * gen:		Group generation (group_get())	[in]
+ * Ss:		Buffer for the server secret	[out]
+ * A:		Buffer for A			[out]
+ *
+ * Moves a pair out of the reservoir for the group.  The caller owns it from then on, and should
+ * mpz_wipe() Ss when done.
+ *
+ * Returns 1 if a pair was handed out, 0 if the reservoir was empty (Ss & A are left alone).
+ **/
+int pairs_take(int bits, uint64_t gen, mpz_t Ss, mpz_t A){
+	int i = group_index(bits), ret = 0;
+	pair_pool *pool = NULL;
+	arena *a = NULL;
+
+	if(i == -1)
+		return 0;
+
+	pool = &pools[i];
+
+	pthread_mutex_lock(&pairs_lock);
+
+	if(gen && (pool->gen == gen) && (pool->count > 0)){
+		pool->count--;
+
+		// Swapping leaves the caller's (empty) values behind, so the pair only exists in one place
+		mpz_swap(pool->pairs[pool->count].Ss, Ss);
+		mpz_swap(pool->pairs[pool->count].A, A);
+
+		// The slot now holds the caller's memory (which may be in the session's arena, see
+		// arena.h), so give the slot fresh variables
+		mpz_wipe(pool->pairs[pool->count].Ss);
+		mpz_wipe(pool->pairs[pool->count].A);
+
+		a = arena_use(NULL);
+
+		mpz_init(pool->pairs[pool->count].Ss);
+		mpz_init(pool->pairs[pool->count].A);
+
+		arena_use(a);
+
+		pool->hits++;
+		ret = 1;
+	} else
+		pool->misses++;
+
+	if(pool->count < PAIRS_LOW)
+		pthread_cond_signal(&pairs_low);
+
+	pthread_mutex_unlock(&pairs_lock);
+
+	return ret;
+}
+
+#endif
@@ -0,0 +1,101 @@
+/****************************
+ * Modular exponentiation benchmark.
+ *
+ * Times fixbn_powm() (fixbn.h, fixed-size types on mpn_sec_powm()) against mpz_powm_sec() for
+ * every key size, on the same random odd moduli, bases & full-size exponents, and checks that
+ * both give the same answer every time.
+ *
+ * Usage: powbench [runs] [bits]
+ *	(bits of 0 runs all of them)
+ ****************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../dh.h"
+#include "../stats.h"
+
+#define POWBENCH_RUNS	20
+
+const int pb_bits[] = {1024, 2048, 4096, 8192};
+
+/**
+ * pb_numbers()
+ * rs:		Random state				[in/out]
+ * bits:	Key size				[in]
+ * b:		Base (1 < b < m)			[out]
+ * e:		Exponent (bits long)			[out]
+ * m:		Modulus (odd, exactly bits long)	[out]
+ **/
+void pb_numbers(gmp_randstate_t rs, int bits, mpz_t b, mpz_t e, mpz_t m){
+	mpz_urandomb(m, rs, bits);
+	mpz_setbit(m, bits - 1);
+	mpz_setbit(m, 0);
+
+	do{
+		mpz_urandomm(b, rs, m);
+	} while(mpz_cmp_ui(b, 1) <= 0);
+
+	mpz_urandomb(e, rs, bits);
+	mpz_setbit(e, bits - 1);
+}
+
+/**
+ * pb_size()
+ * rs:		Random state		[in/out]
+ * bits:	Key size to time	[in]
+ * runs:	How many of each	[in]
+ *
+ * Prints ms per powm for both, and how many results didn't match (should be 0).
+ **/
+void pb_size(gmp_randstate_t rs, int bits, int runs){
+	mpz_t b, e, m, r1, r2;
+	uint64_t fixed = 0, gmp = 0, start = 0;
+	int i = 0, wrong = 0, fallback = 0;
+
+	mpz_inits(b, e, m, r1, r2, NULL);
+
+	for(i = 0; i < runs; i++){
+		pb_numbers(rs, bits, b, e, m);
+
+		start = stats_now();
+		fallback += !fixbn_powm(r1, b, e, m);
+		fixed += stats_now() - start;
+
+		start = stats_now();
+		mpz_powm_sec(r2, b, e, m);
+		gmp += stats_now() - start;
+
+		wrong += (mpz_cmp(r1, r2) != 0);
+	}
+
+	printf("%6d %8d %14.3f %14.3f %8.2fx %8d %8d\n", bits, runs, fixed / 1e6 / runs, gmp / 1e6 / runs,
+		(double)gmp / fixed, wrong, fallback);
+
+	mpz_clears(b, e, m, r1, r2, NULL);
+}
+
+int main(int argc, char *argv[]){
+	gmp_randstate_t rs;
+	int runs = (argc > 1) ? atoi(argv[1]) : POWBENCH_RUNS;
+	int bits = (argc > 2) ? atoi(argv[2]) : 0;
+	int i = 0;
+
+	if(runs < 1){
+		printf("Usage: %s [runs] [bits]\n", argv[0]);
+		return 1;
+	}
+
+	gmp_randinit_default(rs);
+	gmp_randseed_ui(rs, time(NULL));
+
+	printf("%6s %8s %14s %14s %9s %8s %8s\n", "bits", "runs", "fixbn (ms)", "mpz_powm_sec", "speedup",
+		"wrong", "fallback");
+
+	for(i = 0; i < (int)(sizeof(pb_bits) / sizeof(int)); i++)
+		if(!bits || (bits == pb_bits[i]))
+			pb_size(rs, pb_bits[i], runs);
+
+	gmp_randclear(rs);
+
+	return 0;
+}
@@ -0,0 +1,340 @@
+#ifndef __POWMQ_H
+#define __POWMQ_H
+
+/*********************************
+ * Batched modular exponentiation.
+ *
+ * When a burst of clients connects, the server ends up doing a lot of independent powm
+ * operations (A for each session, then each session's secret key) against the same cached
+ * group (see group.h).
+ *
+ * Instead of each session doing its own, sessions drop them into a queue and wait.  A batch
+ * thread collects whatever is pending (up to batch_max jobs, or whatever showed up within
+ * wait_us of the first one) and runs them together:
+ *
+ * - Jobs are grouped by modulus, and each run of jobs with the same modulus reuses the
+ *   modulus limbs & the mpn_sec_powm() scratch space (one allocation per run instead of one
+ *   per job).  mpn_sec_powm() still does its own setup every time (the base in Montgomery form
+ *   & its window table, both depend on the base, not just the modulus), but that's under 0.5%
+ *   of an exponentiation at 1024 bits and less for bigger keys.
+ * - Each batch is worked on by a single thread, with a batch thread per CPU by default.
+ *
+ * Results are handed back to the sessions that are waiting on them.
+ *
+ * By default batches are whatever queued up while the batch threads were busy, nothing waits
+ * for one to fill up.  With a wait_us, a batch thread holds on to a short batch for up to that
+ * long, which trades latency for fewer, bigger batches.
+ *********************************/
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "dh.h"
+
+// Defaults used by the server (0 threads = one per CPU)
+#define POWMQ_THREADS	0
+#define POWMQ_BATCH	32
+#define POWMQ_WAIT	0	// Microseconds
+
+/**
+ * struct __powm_job {}
+ *
+ * One pending exponentiation: r = (b ^ e)(mod m).  Lives on the waiting session's stack.
+ **/
+typedef struct __powm_job {
+	mpz_ptr r;
+	mpz_srcptr b;
+	mpz_srcptr e;
+	mpz_srcptr m;
+
+	int done;
+
+	struct __powm_job *next;
+} powm_job;
+
+typedef struct __powm_queue {
+	pthread_mutex_t lock;
+
+	// Batch threads wait on "more", sessions wait on "done"
+	pthread_cond_t more;
+	pthread_cond_t done;
+
+	powm_job *head;
+	powm_job *tail;
+
+	int pending;
+	int batch_max;
+	long wait_us;
+
+	// Stats
+	uint64_t batches;
+	uint64_t jobs;
+	uint64_t shared;	// Jobs that reused the previous job's precomputation
+} powm_queue;
+
+/**
+ * powmq_run()
+ * job:	First job of the batch (linked list)	[in/out]
+ *
+ * Works through a batch.  Jobs sorted next to each other with the same modulus reuse the
+ * modulus limbs and scratch space of the job before them.  Everything is zeroed before it's
+ * freed.
+ *
+ * Returns the number of jobs that shared precomputation.
+ **/
+uint64_t powmq_run(powm_job *job){
+	mp_limb_t *mp = NULL, *tp = NULL, *rp = NULL;
+	mp_size_t n = 0, n_last = 0, itch = 0;
+	mpz_srcptr last = NULL;
+	uint64_t shared = 0;
+
+	for(; job != NULL; job = job->next){
+		n = mpz_size(job->m);
+
+		// Anything mpn_sec_powm() can't do goes through the regular path
+		if(!mpz_odd_p(job->m) || (mpz_sgn(job->b) <= 0) || (mpz_sgn(job->e) <= 0) ||
+		   (mpz_size(job->e) > n) || (mpz_size(job->b) > n)){
+			gen_E(job->r, (mpz_ptr)job->b, (mpz_ptr)job->e, (mpz_ptr)job->m);
+			continue;
+		}
+
+		if(last && (mpz_cmp(last, job->m) == 0)){
+			shared++;
+		} else{
+			if(tp){
+				explicit_bzero(tp, itch * sizeof(mp_limb_t));
+				explicit_bzero(rp, n_last * sizeof(mp_limb_t));
+				free(tp);
+				free(mp);
+				free(rp);
+			}
+
+			n_last = n;
+
+			// Exponents are padded up to the modulus size, so every job costs the same
+			itch = mpn_sec_powm_itch(n, n * GMP_NUMB_BITS, n);
+
+			tp = (mp_limb_t*)malloc(itch * sizeof(mp_limb_t));
+			mp = (mp_limb_t*)malloc(n * sizeof(mp_limb_t));
+			rp = (mp_limb_t*)malloc(n * sizeof(mp_limb_t));
+
+			mpn_copyi(mp, mpz_limbs_read(job->m), n);
+
+			last = job->m;
+		}
+
+		{
+			mp_limb_t ep[n];
+
+			mpn_zero(ep, n);
+			mpn_copyi(ep, mpz_limbs_read(job->e), mpz_size(job->e));
+
+			mpn_sec_powm(rp, mpz_limbs_read(job->b), mpz_size(job->b), ep, n * GMP_NUMB_BITS, mp, n, tp);
+
+			mpn_zero(ep, n);
+		}
+
+		mpn_copyi(mpz_limbs_write(job->r, n), rp, n);
+		mpz_limbs_finish(job->r, n);
+	}
+
+	// Scratch & results hold powers of secret exponents, and shared secrets (explicit_bzero(),
+	// a memset() right before free() is optimized out)
+	if(tp){
+		explicit_bzero(tp, itch * sizeof(mp_limb_t));
+		explicit_bzero(rp, n_last * sizeof(mp_limb_t));
+		free(tp);
+		free(mp);
+		free(rp);
+	}
+
+	return shared;
+}
+
+/**
+ * powmq_sort()
+ * head:	List of jobs	[in]
+ *
+ * Sorts the jobs so ones with the same modulus are next to each other (insertion sort, batches
+ * are small).  Returns the new head.
+ **/
+powm_job *powmq_sort(powm_job *head){
+	powm_job *sorted = NULL, *job = NULL, *p = NULL;
+
+	while(head){
+		job = head;
+		head = head->next;
+
+		// Put the job after the last one with the same modulus, or at the end
+		for(p = sorted; p != NULL; p = p->next){
+			if((mpz_cmp(p->m, job->m) == 0) && (!p->next || (mpz_cmp(p->next->m, job->m) != 0)))
+				break;
+
+			if(!p->next)
+				break;
+		}
+
+		if(!p){
+			job->next = NULL;
+			sorted = job;
+		} else{
+			job->next = p->next;
+			p->next = job;
+		}
+	}
+
+	return sorted;
+}
+
+/**
+ * powmq_thread()
+ * arg:	The powm_queue to work on	[in]
+ *
+ * Batch thread.  Waits for jobs, lets a batch fill up (bounded by batch_max & wait_us), then
+ * runs it and wakes up the sessions waiting on it.
+ **/
+void *powmq_thread(void *arg){
+	powm_queue *q = (powm_queue*)arg;
+	powm_job *batch = NULL, *job = NULL;
+	struct timespec ts;
+	uint64_t shared = 0;
+	int count = 0;
+
+	while(1){
+		pthread_mutex_lock(&q->lock);
+
+		while(!q->pending)
+			pthread_cond_wait(&q->more, &q->lock);
+
+		// Give other sessions a chance to join the batch
+		if((q->wait_us > 0) && (q->pending < q->batch_max)){
+			clock_gettime(CLOCK_REALTIME, &ts);
+
+			ts.tv_nsec += q->wait_us * 1000;
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+
+			while((q->pending > 0) && (q->pending < q->batch_max))
+				if(pthread_cond_timedwait(&q->more, &q->lock, &ts) == ETIMEDOUT)
+					break;
+		}
+
+		// Another batch thread may have taken them in the meantime
+		if(!q->pending){
+			pthread_mutex_unlock(&q->lock);
+			continue;
+		}
+
+		// Take up to batch_max jobs off the front of the queue
+		batch = q->head;
+		job = batch;
+
+		for(count = 1; (count < q->batch_max) && job->next; count++)
+			job = job->next;
+
+		q->head = job->next;
+
+		if(!q->head)
+			q->tail = NULL;
+
+		job->next = NULL;
+		q->pending -= count;
+
+		pthread_mutex_unlock(&q->lock);
+
+		batch = powmq_sort(batch);
+		shared = powmq_run(batch);
+
+		pthread_mutex_lock(&q->lock);
+
+		for(job = batch; job != NULL; job = job->next)
+			job->done = 1;
+
+		q->batches++;
+		q->jobs += count;
+		q->shared += shared;
+
+		pthread_cond_broadcast(&q->done);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * powmq_init()
+ * q:		Queue to set up					[out]
+ * threads:	Number of batch threads to start (0 = one per CPU)	[in]
+ * batch_max:	Most jobs to run in one batch			[in]
+ * wait_us:	Longest a job waits for a batch to fill up	[in]
+ *
+ * Returns 1 on success, 0 if a batch thread couldn't be started.
+ **/
+int powmq_init(powm_queue *q, int threads, int batch_max, long wait_us){
+	pthread_t t;
+	int i = 0;
+
+	memset(q, 0, sizeof(powm_queue));
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->more, NULL);
+	pthread_cond_init(&q->done, NULL);
+
+	q->batch_max = (batch_max > 0) ? batch_max : 1;
+	q->wait_us = wait_us;
+
+	if(threads < 1)
+		threads = (sysconf(_SC_NPROCESSORS_ONLN) > 0) ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+	D(("%d powm batch threads", threads));
+
+	for(i = 0; i < threads; i++){
+		if(pthread_create(&t, NULL, powmq_thread, q) != 0){
+			perror("pthread_create()");
+			return 0;
+		}
+
+		pthread_detach(t);
+	}
+
+	return 1;
+}
+
+/**
+ * powmq_powm()
+ * q:	Queue to submit to	[in]
+ * r:	Buffer for the result	[out]
+ * b:	Base			[in]
+ * e:	Exponent		[in]
+ * m:	Modulus			[in]
+ *
+ * Same as gen_E(), but the exponentiation is done by the next batch.  Blocks until it's done.
+ **/
+void powmq_powm(powm_queue *q, mpz_t r, mpz_t b, mpz_t e, mpz_t m){
+	powm_job job;
+
+	job.r = r;
+	job.b = b;
+	job.e = e;
+	job.m = m;
+	job.done = 0;
+	job.next = NULL;
+
+	pthread_mutex_lock(&q->lock);
+
+	if(q->tail)
+		q->tail->next = &job;
+	else
+		q->head = &job;
+
+	q->tail = &job;
+	q->pending++;
+
+	pthread_cond_signal(&q->more);
+
+	while(!job.done)
+		pthread_cond_wait(&q->done, &q->lock);
+
+	pthread_mutex_unlock(&q->lock);
+}
+
+#endif
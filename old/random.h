@@ -5,6 +5,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
 #include "debug.h"
 #include "mt.h"
 
@@ -35,6 +36,9 @@ uint64_t getrand(uint64_t c, uint64_t k, uint64_t g, uint64_t x, uint64_t y, uin
  * /KEEP ON TOP
  **/
 
+// mt.h keeps one global state, so sessions running in threads have to take turns with it
+pthread_mutex_t rnd_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * URandom()
  * bytes:	Amount of bytes to read from device	[in]
@@ -91,7 +95,7 @@ uint64_t rndseedkey(uint64_t digits){
 	 * I do too, but since it's only done to feed the real RNG, no worries.
 	 **/
 	time_t tt;
-	struct tm *ti;
+	struct tm tm, *ti;
 
 	int keybit = 0, i = 0;
 
@@ -104,7 +108,7 @@ uint64_t rndseedkey(uint64_t digits){
 	}
 
 	time(&tt);
-	ti = localtime(&tt);
+	ti = localtime_r(&tt, &tm);
 
 	// Using 64-bit numbers to make things better for the encryption side
 	uint64_t s, m, h, y, x, z;
@@ -117,11 +121,17 @@ uint64_t rndseedkey(uint64_t digits){
 	x = ((s + m + h + y) * keybit) / digits;
 	z = ((s + m + h + y) * (digits * 2)) / keybit;
 
+	pthread_mutex_lock(&rnd_lock);
+
 	// Initialize the RNG using yet another RNG (weird, huh?)
 	init_genrand64(getrand(s, m, h, y, x, z));
 
 	// Finally, get the random number
-	return genrand64_int64();
+	x = genrand64_int64();
+
+	pthread_mutex_unlock(&rnd_lock);
+
+	return x;
 }
 
 #endif
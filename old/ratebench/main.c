@@ -0,0 +1,224 @@
+/****************************
+ * Rate limiter test & benchmark.
+ *
+ * Checks that ratelimit.h turns down settings it can't keep, gives one address its burst and
+ * then rate tokens a second (from one thread and from several at once), treats IPv4 mapped
+ * addresses as IPv4, limits IPv6 per /64 and per /48, and then times rate_allow() on one address
+ * and on a million of them.
+ *
+ * Usage: ratebench [threads]
+ *	(exits 1 if any check fails)
+ ****************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "../ratelimit.h"
+#include "../stats.h"
+
+#define RATEBENCH_THREADS	4
+#define RATEBENCH_ADDRS		1000000
+#define RATEBENCH_RUNS		10000000
+
+// How long the threads hammer one bucket (us)
+#define RATEBENCH_TIME		1000000
+
+int rb_failed = 0;
+
+/**
+ * rb_check()
+ * ok:		Did it go the way it should	[in]
+ * what:	What was checked			[in]
+ **/
+void rb_check(int ok, const char *what){
+	printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+
+	if(!ok)
+		rb_failed++;
+}
+
+/**
+ * rb_v4()
+ * sin:		Address to fill in	[out]
+ * a:		Address (host order)	[in]
+ **/
+struct sockaddr *rb_v4(struct sockaddr_in *sin, uint32_t a){
+	memset(sin, 0, sizeof(struct sockaddr_in));
+
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(a);
+
+	return (struct sockaddr*)sin;
+}
+
+/**
+ * rb_v6()
+ * sin6:	Address to fill in			[out]
+ * text:	Address ("2001:db8::1", "::ffff:...")	[in]
+ **/
+struct sockaddr *rb_v6(struct sockaddr_in6 *sin6, const char *text){
+	memset(sin6, 0, sizeof(struct sockaddr_in6));
+
+	sin6->sin6_family = AF_INET6;
+	inet_pton(AF_INET6, text, &sin6->sin6_addr);
+
+	return (struct sockaddr*)sin6;
+}
+
+/**
+ * rb_burst()
+ * sa:		Address to connect from		[in]
+ * n:		Connections to try		[in]
+ *
+ * Returns how many were let through.
+ **/
+int rb_burst(const struct sockaddr *sa, int n){
+	int i = 0, allowed = 0;
+
+	for(i = 0; i < n; i++)
+		allowed += rate_allow(sa);
+
+	return allowed;
+}
+
+/**
+ * rb_thread()
+ * arg:	Where to add up what was let through (int)	[in/out]
+ **/
+void *rb_thread(void *arg){
+	struct sockaddr_in sin;
+	uint64_t end = rate_clock() + RATEBENCH_TIME;
+	int allowed = 0;
+
+	rb_v4(&sin, 0x0a000001);
+
+	while(rate_clock() < end)
+		allowed += rate_allow((struct sockaddr*)&sin);
+
+	__atomic_fetch_add((int*)arg, allowed, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+/**
+ * rb_init()
+ *
+ * Checks which settings rate_init() takes.
+ **/
+void rb_init(){
+	struct sockaddr_in sin;
+
+	rb_check(!rate_init(NAN, RATE_BURST), "rate_init() turns down NaN");
+	rb_check(!rate_init(-1, RATE_BURST), "rate_init() turns down a negative rate");
+	rb_check(!rate_init(1e-9, RATE_BURST), "rate_init() turns down a token every 31 years");
+	rb_check(!rate_init(0.001, 1 << 30), "rate_init() turns down a burst that takes 34000 years");
+	rb_check(rate_init(0, RATE_BURST) && (rb_burst(rb_v4(&sin, 0xc0a80001), 100) == 100), "rate_init() takes 0 (no limit)");
+	rb_check(rate_init(RATE_PER_SEC, RATE_BURST), "rate_init() takes the defaults");
+}
+
+/**
+ * rb_limits()
+ * threads:	Threads to share one bucket	[in]
+ *
+ * Checks that addresses get what they should, and no more.
+ **/
+void rb_limits(int threads){
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	pthread_t *tid = NULL;
+	char text[INET6_ADDRSTRLEN];
+	int allowed = 0, i = 0;
+
+	rate_init(RATE_PER_SEC, RATE_BURST);
+
+	rb_check(rb_burst(rb_v4(&sin, 0xc0a80001), 100) == RATE_BURST, "One address gets its burst");
+
+	// Half a second brings back rate / 2 tokens
+	usleep(500000);
+
+	allowed = rb_burst(rb_v4(&sin, 0xc0a80001), 100);
+	rb_check((allowed >= RATE_PER_SEC / 2) && (allowed <= RATE_PER_SEC / 2 + 1), "... and rate tokens a second after");
+
+	rb_check(rb_burst(rb_v4(&sin, 0xc0a80002), 100) == RATE_BURST, "Another address has its own bucket");
+	rb_check(!rb_burst(rb_v6(&sin6, "::ffff:192.168.0.2"), 10), "IPv4 mapped is the same address as IPv4");
+
+	rb_check(rb_burst(rb_v6(&sin6, "2001:db8:1:1::1"), 100) == RATE_BURST, "IPv6 address gets its burst");
+	rb_check(!rb_burst(rb_v6(&sin6, "2001:db8:1:1::2"), 10), "... shared by its /64");
+
+	// Every /64 in a /48 gets its burst, until the /48 runs out
+	rate_init(RATE_PER_SEC, RATE_BURST);
+
+	for(i = 0, allowed = 0; i < 1000; i++){
+		snprintf(text, sizeof(text), "2001:db8:2:%x::1", i);
+		allowed += rb_burst(rb_v6(&sin6, text), RATE_BURST);
+	}
+
+	// (a token or so can come back while it runs)
+	rb_check((allowed >= RATE_BURST * RATE_AGGREGATE) && (allowed <= RATE_BURST * RATE_AGGREGATE + 2), "A /48 gets RATE_AGGREGATE times the burst of a /64");
+	rb_check(rb_burst(rb_v6(&sin6, "2001:db8:3::1"), 100) == RATE_BURST, "... and the next /48 has its own");
+
+	// However many threads share a bucket, it doesn't give out more than it should
+	rate_init(RATE_PER_SEC, RATE_BURST);
+
+	if(!(tid = (pthread_t*)calloc(threads, sizeof(pthread_t))))
+		return;
+
+	for(i = 0, allowed = 0; i < threads; i++)
+		pthread_create(&tid[i], NULL, rb_thread, &allowed);
+
+	for(i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+
+	free(tid);
+
+	printf("%d threads on one bucket for %.1f s: %d let through\n", threads, RATEBENCH_TIME / 1e6, allowed);
+	rb_check(allowed <= RATE_BURST + (RATE_PER_SEC * RATEBENCH_TIME / 1000000) + 1, "... no more than burst + rate * time");
+}
+
+/**
+ * rb_cost()
+ *
+ * Times rate_allow() on one address, and on RATEBENCH_ADDRS of them (every set full, and
+ * buckets changing hands all the time).
+ **/
+void rb_cost(){
+	struct sockaddr_in sin;
+	uint64_t start = 0;
+	int i = 0;
+
+	rate_init(RATE_PER_SEC, RATE_BURST);
+	rb_v4(&sin, 0x0a000001);
+
+	start = stats_now();
+
+	for(i = 0; i < RATEBENCH_RUNS; i++)
+		rate_allow((struct sockaddr*)&sin);
+
+	printf("One address:        %6.1f ns per rate_allow()\n", (double)(stats_now() - start) / RATEBENCH_RUNS);
+
+	start = stats_now();
+
+	for(i = 0; i < RATEBENCH_RUNS; i++)
+		rate_allow(rb_v4(&sin, 0x0a000000 + (i % RATEBENCH_ADDRS)));
+
+	printf("%d addresses: %6.1f ns per rate_allow()\n", RATEBENCH_ADDRS, (double)(stats_now() - start) / RATEBENCH_RUNS);
+}
+
+int main(int argc, char *argv[]){
+	int threads = (argc > 1) ? atoi(argv[1]) : RATEBENCH_THREADS;
+
+	if(threads < 1){
+		printf("Usage: %s [threads]\n", argv[0]);
+		return 1;
+	}
+
+	rb_init();
+	rb_limits(threads);
+	rb_cost();
+
+	if(rb_failed)
+		printf("%d checks failed\n", rb_failed);
+
+	return (rb_failed > 0);
+}
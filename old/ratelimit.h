@@ -0,0 +1,315 @@
+#ifndef __RATELIMIT_H
+#define __RATELIMIT_H
+
+/*********************************
+ * Per-address connection rate limiting.
+ *
+ * Every connection costs the server a thread and a D-H exchange (a powm or two, more for big
+ * keys), and the client doesn't have to do anything for it but connect.  Without a limit, one
+ * address opening connections in a loop takes every CPU the server has.
+ *
+ * Each source address gets a token bucket: it holds up to burst tokens, refills at rate tokens a
+ * second, and every connection takes one.  A connection that finds the bucket empty is closed
+ * right after accept(), before a thread or anything else is spent on it.
+ *
+ * Buckets are kept as GCRA ("theoretical arrival time"): instead of a token count & the time it
+ * was last topped off, a bucket is the time it will next be full.  Taking a token pushes that
+ * time 1/rate forward, and a bucket that would end up more than burst/rate in the future is out
+ * of tokens.  That's a single 64 bit word per bucket, so it's updated with one compare & swap,
+ * no locks.  It also holds a 16 bit tag of the address, so finding a bucket & updating it are
+ * the same atomic operation (a bucket can't change owners in between).
+ *
+ * The table is RATE_SETS sets of RATE_WAYS buckets (one cache line each), an address hashes to
+ * a set and takes any bucket in it.  When a set is full, the bucket that will be full soonest is
+ * given to the new address (if it's already full, nothing is lost).  Addresses are hashed with
+ * a random key, so nobody can pick addresses that all land in the same set.  Two addresses in
+ * a set with the same tag share a bucket, which happens to 1 in 32768 of them.
+ *
+ * IPv6 addresses are limited per /64, since that's what one host usually gets.  Whoever has a
+ * /48 has 65536 of those, so every /48 also has a bucket of its own, RATE_AGGREGATE times the
+ * size & rate of a /64's, and a connection needs a token from both.
+ *********************************/
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "random.h"
+
+// Default tokens per second & bucket size for each address (0 = no limit)
+#define RATE_PER_SEC	10
+#define RATE_BURST	20
+
+// A /48 gets this many /64s worth of tokens, all its addresses together
+#define RATE_AGGREGATE	16
+
+// Sets * ways buckets (8 per 64 byte line)
+#define RATE_SETS	8192
+#define RATE_WAYS	8
+
+#define RATE_TAG_BITS	16
+#define RATE_TIME_MASK	((1ULL << (64 - RATE_TAG_BITS)) - 1)	// ~8.9 years of microseconds
+
+typedef struct __rate_set {
+	// Tag << 48 | when the bucket is next full (us since rate_init(), see rate_now()), 0 = free
+	uint64_t buckets[RATE_WAYS];
+} __attribute__((aligned(64))) rate_set;
+
+typedef struct __rate_limiter {
+	// Microseconds a token takes to come back, and how far ahead a bucket can go (burst tokens)
+	uint64_t interval;
+	uint64_t tolerance;
+
+	// Same for a whole IPv6 /48
+	uint64_t agg_interval;
+	uint64_t agg_tolerance;
+
+	uint64_t start;
+	uint64_t key;
+
+	// Stats
+	uint64_t allowed;
+	uint64_t limited;
+	uint64_t evicted;
+
+	rate_set sets[RATE_SETS];
+} rate_limiter;
+
+rate_limiter ratelimit;
+
+/**
+ * rate_clock()
+ *
+ * Returns CLOCK_MONOTONIC in microseconds.
+ **/
+uint64_t rate_clock(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * rate_now()
+ *
+ * Returns microseconds since rate_init() (starting at 1, a bucket's time is never 0).
+ **/
+uint64_t rate_now(){
+	return (rate_clock() - ratelimit.start + 1) & RATE_TIME_MASK;
+}
+
+/**
+ * rate_init()
+ * rate:	Connections per second each address gets (0 = no limit)	[in]
+ * burst:	How many it can make at once				[in]
+ *
+ * Has to happen before anything calls rate_allow().
+ *
+ * Returns 1 on success, 0 on failure (rate isn't a number >= 0, or burst tokens at that rate
+ * take longer to come back than a bucket can count, see RATE_TIME_MASK).
+ **/
+int rate_init(double rate, int burst){
+	char seed[sizeof(uint64_t) + 1];
+
+	memset(&ratelimit, 0, sizeof(rate_limiter));
+
+	if(isnan(rate) || (rate < 0))
+		return 0;
+
+	// Can't take a connection without a token
+	if(burst < 1)
+		burst = 1;
+
+	if(rate > 0){
+		// Checked as a double first, so interval * burst can't overflow below
+		if((1000000.0 / rate) * ((double)burst + 1) >= (double)RATE_TIME_MASK)
+			return 0;
+
+		ratelimit.interval = (uint64_t)(1000000.0 / rate);
+
+		if(!ratelimit.interval)
+			ratelimit.interval = 1;
+
+		ratelimit.tolerance = ratelimit.interval * burst;
+
+		// A bucket's time is tat + interval, it has to fit next to the tag
+		if(ratelimit.tolerance + ratelimit.interval >= RATE_TIME_MASK)
+			return 0;
+
+		ratelimit.agg_interval = ratelimit.interval / RATE_AGGREGATE;
+
+		if(!ratelimit.agg_interval)
+			ratelimit.agg_interval = 1;
+
+		ratelimit.agg_tolerance = ratelimit.agg_interval * burst * RATE_AGGREGATE;
+	}
+
+	ratelimit.start = rate_clock();
+
+	// URandom() fills in bytes + 1 characters
+	if(URandom(sizeof(uint64_t) - 1, seed) == 0)
+		return 0;
+
+	memcpy(&ratelimit.key, seed, sizeof(uint64_t));
+
+	return 1;
+}
+
+/**
+ * rate_hash()
+ * a:	Address (or the prefix of one that's limited)	[in]
+ * len:	Bytes of a to use				[in]
+ *
+ * Hashes the address with the limiter's key.  The length goes in too, so a /48 never shares a
+ * bucket with a /64 or an IPv4 address that happens to have the same bytes.
+ **/
+uint64_t rate_hash(const unsigned char *a, int len){
+	uint64_t h = 0;
+	int i = 0;
+
+	for(i = 0; i < len; i++)
+		h = (h << 8) | a[i];
+
+	// splitmix64's finalizer, keyed, so every bit of the address affects the set & tag
+	h ^= ratelimit.key + (uint64_t)len;
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return h;
+}
+
+/**
+ * rate_take()
+ * h:		Hash of the address (rate_hash())		[in]
+ * interval:	Microseconds a token takes to come back	[in]
+ * tolerance:	How far ahead the bucket can go		[in]
+ *
+ * Takes a token from the bucket h belongs to (giving it one if it has none).
+ *
+ * Returns 1 if there was a token, 0 if the bucket is empty.
+ **/
+int rate_take(uint64_t h, uint64_t interval, uint64_t tolerance){
+	rate_set *s = &ratelimit.sets[h & (RATE_SETS - 1)];
+	uint64_t tag = 0, now = 0, v = 0, tat = 0, oldest = 0;
+	int i = 0, victim = 0, tries = 0;
+
+	// Top bits of the hash (the set came from the bottom ones), never 0 so a used bucket is never 0
+	tag = ((h >> (64 - RATE_TAG_BITS)) | 1) << (64 - RATE_TAG_BITS);
+
+	now = rate_now();
+
+	// Only gets around again if another thread changed the set under us
+	for(tries = 0; tries < RATE_WAYS; tries++){
+		victim = -1;
+		oldest = RATE_TIME_MASK;
+
+		for(i = 0; i < RATE_WAYS; i++){
+			v = __atomic_load_n(&s->buckets[i], __ATOMIC_ACQUIRE);
+
+			if((v & ~RATE_TIME_MASK) == tag)
+				break;
+
+			if((v & RATE_TIME_MASK) < oldest){
+				oldest = v & RATE_TIME_MASK;
+				victim = i;
+			}
+		}
+
+		if(i < RATE_WAYS){
+			tat = v & RATE_TIME_MASK;
+
+			// A bucket that's been full a while is just full
+			if(tat < now)
+				tat = now;
+
+			if(tat + interval - now > tolerance)
+				return 0;
+
+			if(__atomic_compare_exchange_n(&s->buckets[i], &v, tag | (tat + interval), 0,
+			   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				break;
+
+			continue;
+		}
+
+		// Not in the set, take the bucket that will be full soonest (free ones are 0)
+		v = __atomic_load_n(&s->buckets[victim], __ATOMIC_ACQUIRE);
+
+		if((v & RATE_TIME_MASK) != oldest)
+			continue;
+
+		if(__atomic_compare_exchange_n(&s->buckets[victim], &v, tag | (now + interval), 0,
+		   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			// Someone else's tokens went with it
+			if(oldest > now)
+				__atomic_fetch_add(&ratelimit.evicted, 1, __ATOMIC_RELAXED);
+
+			break;
+		}
+	}
+
+	// Lost every race (or took the token), either way it's a token
+	return 1;
+}
+
+/**
+ * rate_allow()
+ * sa:	Address a connection came from	[in]
+ *
+ * Takes a token from the address's bucket (IPv4, or the /64 of an IPv6 one, and then the /48's
+ * too).  Safe to call from any number of threads.
+ *
+ * Returns 1 if the connection can go ahead, 0 if the address is out of tokens.
+ **/
+int rate_allow(const struct sockaddr *sa){
+	const unsigned char *a = NULL;
+	int len = 0, ok = 0;
+
+	if(!ratelimit.interval)
+		return 1;
+
+	if(sa->sa_family == AF_INET6){
+		a = ((const struct sockaddr_in6*)sa)->sin6_addr.s6_addr;
+
+		// IPv4 mapped (::ffff:a.b.c.d) is the same address as a.b.c.d
+		if(IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6*)sa)->sin6_addr)){
+			a += 12;
+			len = 4;
+		} else
+			len = 8;
+	} else if(sa->sa_family == AF_INET){
+		a = (const unsigned char*)&((const struct sockaddr_in*)sa)->sin_addr;
+		len = 4;
+	}
+
+	ok = rate_take(rate_hash(a, len), ratelimit.interval, ratelimit.tolerance);
+
+	// The /64 had a token, its /48 has to have one too (the /64's isn't given back if it doesn't)
+	if(ok && (len == 8))
+		ok = rate_take(rate_hash(a, 6), ratelimit.agg_interval, ratelimit.agg_tolerance);
+
+	if(!ok){
+		__atomic_fetch_add(&ratelimit.limited, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	__atomic_fetch_add(&ratelimit.allowed, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+/**
+ * rate_stats()
+ * allowed:	Connections let through				[out]
+ * limited:	Connections turned away				[out]
+ * evicted:	Buckets given to another address before they were full	[out]
+ **/
+void rate_stats(uint64_t *allowed, uint64_t *limited, uint64_t *evicted){
+	*allowed = __atomic_load_n(&ratelimit.allowed, __ATOMIC_RELAXED);
+	*limited = __atomic_load_n(&ratelimit.limited, __ATOMIC_RELAXED);
+	*evicted = __atomic_load_n(&ratelimit.evicted, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef __RESUME_H
+#define __RESUME_H
+
+/*********************************
+ * Session resumption.
+ *
+ * PAM clients reconnect constantly, and each connection used to go through the whole exchange
+ * again (key size, P, G, B, A, modulo, D-H encrypted Viegnere key).
+ *
+ * After a handshake, the server hands the client a ticket (sent encrypted with the session's
+ * keys) and remembers the session's keys under it for RESUME_TTL seconds.  A client that
+ * reconnects sends "RESUME <ticket>" instead of "NEW", and gets its keys back in one round trip.
+ *
+ * Tickets are single use, a resumed session is given a new one.
+ *
+ * The cache is split into RESUME_SHARDS shards (each with its own lock) so sessions don't
+ * all fight over one lock.  Each shard holds at most RESUME_PER_SHARD sessions, and throws out
+ * the least recently issued one when it's full.
+ *********************************/
+#include <pthread.h>
+#include <time.h>
+#include "vc.h"
+#include "bigint.h"
+#include "arena.h"
+
+#define RESUME_SHARDS		16
+#define RESUME_PER_SHARD	256
+#define RESUME_BUCKETS		64	// Hash buckets per shard
+#define RESUME_TTL		300	// Seconds
+
+// Tickets are A-Z only, since those characters are in table[] for every MODULO
+#define TICKET_LEN		32
+
+typedef struct __resume_entry {
+	char ticket[TICKET_LEN + 1];
+	char vkey[VC_KEY + 1];
+
+	// The session's MODULO (vc.h)
+	int modulo;
+
+	mpz_t sk;
+
+	time_t expires;
+
+	// LRU list (head = newest) & hash bucket chain
+	struct __resume_entry *prev;
+	struct __resume_entry *next;
+	struct __resume_entry *hnext;
+} resume_entry;
+
+typedef struct __resume_shard {
+	pthread_mutex_t lock;
+
+	resume_entry *head;
+	resume_entry *tail;
+	resume_entry *buckets[RESUME_BUCKETS];
+
+	int count;
+
+	// Stats
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t expired;
+	uint64_t evicted;
+} resume_shard;
+
+resume_shard resume_cache[RESUME_SHARDS];
+
+/**
+ * resume_hash()
+ * ticket:	Ticket to hash	[in]
+ *
+ * FNV-1a hash of the ticket.  The low bits pick the shard, the rest pick the bucket.
+ **/
+uint64_t resume_hash(const char *ticket){
+	uint64_t h = 14695981039346656037ULL;
+
+	while(*ticket){
+		h ^= (unsigned char)*ticket++;
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/**
+ * resume_init()
+ *
+ * Sets up the (empty) cache.
+ **/
+void resume_init(){
+	int i = 0;
+
+	memset(resume_cache, 0, sizeof(resume_cache));
+
+	for(i = 0; i < RESUME_SHARDS; i++)
+		pthread_mutex_init(&resume_cache[i].lock, NULL);
+}
+
+/**
+ * resume_unlink()
+ * s:	Shard the entry is in	[in/out]
+ * e:	Entry to remove		[in]
+ *
+ * Takes e out of the shard's LRU list & bucket.  Lock must be held.
+ **/
+void resume_unlink(resume_shard *s, resume_entry *e){
+	resume_entry **b = &s->buckets[(resume_hash(e->ticket) / RESUME_SHARDS) % RESUME_BUCKETS];
+
+	while(*b && (*b != e))
+		b = &(*b)->hnext;
+
+	if(*b)
+		*b = e->hnext;
+
+	if(e->prev)
+		e->prev->next = e->next;
+	else
+		s->head = e->next;
+
+	if(e->next)
+		e->next->prev = e->prev;
+	else
+		s->tail = e->prev;
+
+	s->count--;
+}
+
+/**
+ * resume_free()
+ * e:	Entry to get rid of	[in]
+ *
+ * Wipes the keys held in e and frees it.
+ **/
+void resume_free(resume_entry *e){
+	arena *a = arena_use(NULL);
+
+	mpz_wipe(e->sk);
+
+	memset(e, 0, sizeof(resume_entry));
+	free(e);
+
+	arena_use(a);
+}
+
+/**
+ * resume_issue()
+ * ticket:	Buffer to store the new ticket (TICKET_LEN + 1)	[out]
+ * sk:		The session's D-H secret key			[in]
+ * vkey:	The session's Viegnere Cipher key		[in]
+ *
+ * Creates a ticket for the session and remembers its keys (and MODULO) until the ticket expires.
+ **/
+void resume_issue(char *ticket, mpz_t sk, char *vkey){
+	char rnd[TICKET_LEN + 1] = {'\0'};
+	resume_entry *e = NULL;
+	resume_shard *s = NULL;
+	uint64_t h = 0;
+	arena *a = NULL;
+	int i = 0;
+
+	URandom(TICKET_LEN, rnd);
+
+	for(i = 0; i < TICKET_LEN; i++)
+		ticket[i] = 'A' + ((unsigned char)rnd[i] % 26);
+
+	ticket[TICKET_LEN] = '\0';
+
+	memset(rnd, 0, sizeof(rnd));
+
+	// Cache entries outlive the session, so they can't come from its arena
+	a = arena_use(NULL);
+
+	e = (resume_entry*)malloc(sizeof(resume_entry));
+	memset(e, 0, sizeof(resume_entry));
+
+	strcpy(e->ticket, ticket);
+	strncpy(e->vkey, vkey, VC_KEY);
+
+	e->modulo = MODULO;
+
+	mpz_init_set(e->sk, sk);
+
+	arena_use(a);
+
+	e->expires = time(NULL) + RESUME_TTL;
+
+	h = resume_hash(ticket);
+	s = &resume_cache[h % RESUME_SHARDS];
+
+	pthread_mutex_lock(&s->lock);
+
+	// Full?  Throw out the oldest session
+	if(s->count >= RESUME_PER_SHARD){
+		resume_entry *old = s->tail;
+
+		resume_unlink(s, old);
+		resume_free(old);
+
+		s->evicted++;
+	}
+
+	e->hnext = s->buckets[(h / RESUME_SHARDS) % RESUME_BUCKETS];
+	s->buckets[(h / RESUME_SHARDS) % RESUME_BUCKETS] = e;
+
+	e->next = s->head;
+
+	if(s->head)
+		s->head->prev = e;
+	else
+		s->tail = e;
+
+	s->head = e;
+	s->count++;
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * resume_take()
+ * ticket:	Ticket the client gave us		[in]
+ * sk:		Buffer for the D-H secret key		[out]
+ * vkey:	Buffer for the Viegnere Cipher key	[out]
+ *
+ * Looks up the ticket and hands back the keys of the session it belongs to.  The ticket can't be
+ * used again afterwards.  MODULO is set back to what the session was using.
+ *
+ * Returns 1 if the session was resumed, 0 if the ticket is unknown or expired.
+ **/
+int resume_take(const char *ticket, mpz_t sk, char *vkey){
+	uint64_t h = resume_hash(ticket);
+	resume_shard *s = &resume_cache[h % RESUME_SHARDS];
+	resume_entry *e = NULL;
+	int ret = 0;
+
+	if(strlen(ticket) != TICKET_LEN)
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+
+	for(e = s->buckets[(h / RESUME_SHARDS) % RESUME_BUCKETS]; e != NULL; e = e->hnext)
+		if(streq(e->ticket, ticket))
+			break;
+
+	if(e){
+		resume_unlink(s, e);
+
+		if(e->expires > time(NULL)){
+			mpz_set(sk, e->sk);
+			strncpy(vkey, e->vkey, VC_KEY);
+
+			MODULO = e->modulo;
+
+			s->hits++;
+			ret = 1;
+		} else{
+			s->expired++;
+			s->misses++;
+		}
+	} else
+		s->misses++;
+
+	pthread_mutex_unlock(&s->lock);
+
+	if(e)
+		resume_free(e);
+
+	return ret;
+}
+
+/**
+ * resume_stats()
+ * hits:	Number of sessions resumed	[out]
+ * misses:	Number of failed resumes	[out]
+ * evicted:	Sessions pushed out of the cache	[out]
+ *
+ * Adds up the stats for every shard.
+ **/
+void resume_stats(uint64_t *hits, uint64_t *misses, uint64_t *evicted){
+	int i = 0;
+
+	*hits = *misses = *evicted = 0;
+
+	for(i = 0; i < RESUME_SHARDS; i++){
+		pthread_mutex_lock(&resume_cache[i].lock);
+
+		*hits += resume_cache[i].hits;
+		*misses += resume_cache[i].misses;
+		*evicted += resume_cache[i].evicted;
+
+		pthread_mutex_unlock(&resume_cache[i].lock);
+	}
+}
+
+#endif
@@ -1,93 +1,405 @@
 #include "../network.h"
 #include "../zcrypt.h"
+#include "../group.h"
+#include "../powmq.h"
+#include "../pairs.h"
+#include "../resume.h"
+#include "../stats.h"
+#include "../acctdb.h"
+#include "../auth.h"
+#include "../ratelimit.h"
 
-#include <shadow.h>
-#include <crypt.h>
 #include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 /** Used for LOGIN_NAME_MAX define **/
 #include <bits/local_lim.h>
 
-void sigchld_handler(int s){
-	while(waitpid(-1, NULL, WNOHANG) > 0);
-}
-
+// Key size & Viegnere Cipher modulo for clients that don't ask for any (see session_params())
 const int key = 2048 / 2;
 const int vhkey = 94;
 
+// Let clients ask for bigger keys than key (-k, for loadgen)
+int any_key = 0;
+
+// Sessions share P & G (group.h), take pre-generated (Ss, A) pairs (pairs.h) and batch their
+// exponentiations (powmq.h)
+powm_queue powmq;
+
+// Threads refilling the (Ss, A) reservoirs
+#define PAIRS_THREADS	1
+
+// How long a client gets to answer during the exchange, and while logging in (seconds)
+#define HANDSHAKE_TIMEOUT	10
+#define AUTH_TIMEOUT		10
+
+// Password checks that can run at once (one per CPU), the rest of the sessions wait their turn
+sem_t auth_slots;
+
+// Compiled account database (see acctdb.h & acctdb/main.c), used before /etc/shadow if it's there
+#define ACCOUNTS_DB	"server/accounts.db"
+
+acctdb accounts;
+
 /**
  * shadowauth()
  * u:	Username to authenticate	[in]
  * p:	Given password for user		[in]
  *
- * Authenticates user against /etc/shadow file.
+ * Authenticates user against the account backends (see auth_backend_add()), /etc/shadow unless
+ * there's an account database.  Reentrant, at most one check per CPU runs at a time (see
+ * auth_slots).
  *
  * Retuns 1 on success, 0 on failure.
  **/
 int shadowauth(const char *u, const char *p){
-	// Shadow password structure (see shadow.h)
-	struct spwd *spw = NULL;
-
-	// salt = $#$....$ (i.e.: $1$abcdefg)
-	char *salt = (char*)malloc(sizeof(char) * 11);
-	memset(salt, '\0', 11);
-
+	char stored[CRYPT_OUTPUT_SIZE];
 	int ret = 0;
 
-	// Populate shadow structure based on given username
-	if((spw = getspnam(u)) != NULL){
-		// sp_pwdp = entire password, salt is the first 11 characters
-		strncat(salt, (spw->sp_pwdp), 11);
+	if(auth_find(u, stored)){
+		while(sem_wait(&auth_slots) == -1);
+
+		ret = auth_verify(p, stored);
 
-		// If we encrypt p with salt, and its the same as sp_pwdp, success
-		if(streq(crypt(p, salt), spw->sp_pwdp))
-			ret = 1;
+		sem_post(&auth_slots);
 	}
 
-	free(salt);
+	memset(stored, '\0', sizeof(stored));
 
 	return ret;
 }
 
-int main(int argc, char *argv[]){
-//D(("shadowauth(love,godsex) = %d", shadowauth("love", "godsex")));
+/**
+ * struct __session {}
+ *
+ * What a session thread needs to know about its client.
+ **/
+typedef struct __session {
+	int fd;
+
+	char srcip[INET6_ADDRSTRLEN];
+} session;
+
+/**
+ * session_deadline()
+ * secs:	How long the next phase gets, all of it	[in]
+ *
+ * Session threads block on their socket, so a client that stops talking (or only talks a byte at
+ * a time) would hold on to one forever.  Every read & write in the phase has to be done by the
+ * deadline (see net_deadline()), and one that isn't fails the same way as if the client had hung
+ * up.
+ **/
+void session_deadline(int secs){
+	net_deadline(secs);
+}
+
+/**
+ * session_send()
+ * t:		Session's phase times		[in/out]
+ * fd:		Socket to send to		[in]
+ * buff:	Data to send (emptied after)	[in/out]
+ *
+ * Sends the length of buff & buff itself in one go (see sendframe()), timing it as part of the
+ * send phase.
+ **/
+void session_send(phase_times *t, int fd, char *buff){
+	PHASE(t, PHASE_SEND, sendframe(fd, buff));
+}
+
+/**
+ * session_recv()
+ * t:		Session's phase times		[in/out]
+ * fd:		Socket to receive from		[in]
+ * buff:	Buffer to store the data	[out]
+ * size:	Size of buff			[in]
+ *
+ * Opposite of session_send().  Returns the number of bytes received, or -1 if the frame didn't
+ * fit (see recvframe()).
+ **/
+int session_recv(phase_times *t, int fd, char *buff, int size){
+	int len = 0;
+
+	PHASE(t, PHASE_RECV, len = recvframe(fd, buff, size));
+
+	return len;
+}
+
+/**
+ * session_params()
+ * buff:	What the client opened with ("NEW" or "NEW <bits> <modulo>")	[in]
+ * bits:	Key size to use for the session					[out]
+ * modulo:	Viegnere Cipher modulo to use for the session			[out]
+ *
+ * A client can ask for any of the 3 modulos, and for a key size group.h has a group for that's no
+ * bigger than key.  A bigger key costs the server a lot more than it costs the client to ask
+ * (an 8192 bit powm is ~50x a 1024 bit one), so those are only given out with -k (the load
+ * generator sweeps them all).  Anything else gets key & vhkey.
+ **/
+void session_params(const char *buff, int *bits, int *modulo){
+	int b = 0, m = 0;
+
+	*bits = key;
+	*modulo = vhkey;
+
+	if(sscanf(buff, "NEW %d %d", &b, &m) != 2)
+		return;
+
+	if((group_index(b) == -1) || ((b > key) && !any_key) || ((m != 26) && (m != 52) && (m != 94))){
+		D(("Ignoring NEW %d %d", b, m));
+		return;
+	}
+
+	*bits = b;
+	*modulo = m;
+}
+
+/**
+ * handle_client()
+ * arg:	The client's session (freed when done)	[in]
+ *
+ * Runs the whole exchange with one client.  Each client gets its own thread.
+ **/
+void *handle_client(void *arg){
+	session *s = (session*)arg;
+
+	int connfd = s->fd;
+
+	// Generation of the group P & G came from
+	uint64_t gen = 0;
+
+	// Did the user/password check out?
+	int authed = 0;
 
-	// How big is the next buffer going to be?
-	int bufflen = 0;
+	// Did the user & password both fit?
+	int got = 1;
+
+	// Key size & modulo the session is using
+	int bits = key, modulo = vhkey;
+
+	// Did the client say anything?
+	int hello = 0;
+
+	// How long each phase of the handshake took (see stats.h)
+	phase_times times;
+	uint64_t start = stats_now();
+
+	memset(&times, 0, sizeof(phase_times));
+
+	// Resumption ticket & cache stats
+	char ticket[TICKET_LEN + 1] = {'\0'};
+	uint64_t hits = 0, misses = 0, evicted = 0;
 
-	/** Server generates P & G for both server & client, sending it to the client...so, do P & G generation in while() loop after connect detect. **/
 	// Allocate enough space for sizeof(char) * (bits + 1) [+1 to compensate for possible \0]
-	char *szP  = (char*)malloc(PGLEN);
-	char *szG  = (char*)malloc(PGLEN);
+	char *szP  = (char*)malloc(ABLEN);
+	char *szG  = (char*)malloc(ABLEN);
 	char *szA  = (char*)malloc(ABLEN);
 	char *szB  = (char*)malloc(ABLEN);
 	char *buff = (char*)malloc(MEMBUFF);
 	char *user = (char*)malloc(LOGIN_NAME_MAX);
 	char *pw   = (char*)malloc(MEMBUFF);
 	char *szVC = (char*)malloc(VC_BUFF);
-	char *szVKey = (char*)malloc(VC_KEY);
+	char *szVKey = (char*)malloc(VC_KEY + 1);
 
-	memset(szP,  '\0', PGLEN);
-	memset(szG,  '\0', PGLEN);
+	memset(szP,  '\0', ABLEN);
+	memset(szG,  '\0', ABLEN);
 	memset(szA,  '\0', ABLEN);
 	memset(szB,  '\0', ABLEN);
 	memset(buff, '\0', MEMBUFF);
 	memset(user, '\0', LOGIN_NAME_MAX);
 	memset(pw,   '\0', MEMBUFF);
 	memset(szVC, '\0', VC_BUFF);
-	memset(szVKey, '\0', VC_KEY);
+	memset(szVKey, '\0', VC_KEY + 1);
+
+	D(("Handling %s on socket %d", s->srcip, connfd));
+
+	session_deadline(HANDSHAKE_TIMEOUT);
+
+	// The client either wants a new session, or to resume one it had before (see resume.h)
+	hello = (session_recv(&times, connfd, buff, MEMBUFF) != -1);
+
+	session_params(buff, &bits, &modulo);
+
+	// This thread only runs this session, so its MODULO is the session's (resume_take() changes it)
+	MODULO = modulo;
+
+	// All of the session's GMP memory comes from here, and goes away in one shot at the end
+	arena mem;
+
+	memset(&mem, 0, sizeof(arena));
+	arena_use(&mem);
 
 	mpz_t P, G, Ss, B, A, Ssk, tmp;
 
-	mpz_init(A);
-	mpz_init(B);
-	mpz_init(P);
-	mpz_init(G);
-	mpz_init(Ss);
-	mpz_init(Ssk);	
-	mpz_init(tmp);
+	// Size everything for the key up front, so GMP doesn't have to keep growing them
+	mpz_init2(A, bits);
+	mpz_init2(B, bits);
+	mpz_init2(P, bits);
+	mpz_init2(G, bits);
+	mpz_init2(Ss, bits);
+	mpz_init2(Ssk, bits);
+	mpz_init2(tmp, bits);
+
+	if(!hello){
+		D(("%s never said anything", s->srcip));
+		goto done;
+	}
+
+	if(strneq(buff, "RESUME ", 7) && resume_take(buff + 7, Ssk, szVKey)){
+		D(("Resumed session for %s", s->srcip));
+
+		sprintf(buff, "OK");
+		session_send(&times, connfd, buff);
+	} else{
+		sprintf(buff, "NEW");
+		session_send(&times, connfd, buff);
+
+		// Send the key bit strength to the client
+		sprintf(buff, "%d", bits);
+D(("Sending %s", buff));
+		session_send(&times, connfd, buff);
+D(("Buffer sent"));
+		// Since otherwise this can cause problems, make sur buff is emptied again
+		memset(buff, '\0', 4);
+
+		// Get P & G from the group cache
+		PHASE(&times, PHASE_GROUP, gen = group_get(bits, P, G));
+
+		// Use a pre-generated server secret & A if there is one, otherwise make them now
+		if(!pairs_take(bits, gen, Ss, A)){
+			PHASE(&times, PHASE_BIRANDOM, birandom(bits, Ss, 0));
+
+			// A = (G ^ Ss)(mod P)
+			PHASE(&times, PHASE_POWM_A, powmq_powm(&powmq, A, G, Ss, P));
+		}
+
+		mpz2str(A, szA);
+
+		// Time the server spent on the above (waiting on the powm queue, etc.) isn't the client's
+		session_deadline(HANDSHAKE_TIMEOUT);
+
+		// Convert P & G to wire-transferable format, then send them to client
+		mpz2str(P, szP);
+		mpz2str(G, szG);
+
+		session_send(&times, connfd, szP);
+
+		session_send(&times, connfd, szG);
+
+		// Get the client's B value
+		if(session_recv(&times, connfd, buff, MEMBUFF) == -1){
+			D(("%s stopped before sending B", s->srcip));
+			goto done;
+		}
+D(("B = %s", buff));
+		//recv(connfd, buff, bufflen, 0);
+		str2mpz(buff, B);
+
+		// Tell the client our A value
+		session_send(&times, connfd, szA);
+
+		// We generate our secret key with the same formulas as A
+		PHASE(&times, PHASE_POWM_SK, powmq_powm(&powmq, Ssk, B, Ss, P));
+
+		// Tell the client the key size of the Viegnere Cipher (26, 54, or 96)
+		sprintf(buff, "%d", modulo);
+		session_send(&times, connfd, buff);
+
+		PHASE(&times, PHASE_VC_KEY, vc_key(VC_KEY, szVKey));
+		PHASE(&times, PHASE_DH_ENCRYPT, dh_encrypt(szVKey, buff, Ssk));
+		session_send(&times, connfd, buff);
+	}
+
+	resume_stats(&hits, &misses, &evicted);
+	D(("Resumption cache: %lu hits, %lu misses, %lu evicted", hits, misses, evicted));
+
+	// Give the client a ticket so it can skip all of this next time
+	resume_issue(ticket, Ssk, szVKey);
+
+	memset(buff, '\0', MEMBUFF);
+	zencrypt(ticket, buff, szVKey, Ssk);
+	session_send(&times, connfd, buff);
+
+	memset(ticket, '\0', sizeof(ticket));
 
-	int serverfd, connfd, len;
+	session_deadline(AUTH_TIMEOUT);
+
+	// Get the username from the client (decrypts to the same length, so it has to fit in user)
+	memset(buff, '\0', strlen(buff));
+	got = (session_recv(&times, connfd, buff, LOGIN_NAME_MAX) != -1);
+D(("USER = %s", buff));
+	//recv(connfd, buff, bufflen, 0);
+	zdecrypt(buff, user, szVKey, Ssk);
+
+//D(("User = %s", user));
+
+	memset(szVC, '\0', strlen(szVC));
+	// Receive the cipher text of the user's password (encrypted with D-H)
+	got = (session_recv(&times, connfd, szVC, VC_BUFF) != -1) && got;
+D(("PASS = %s", buff));
+	//recv(connfd, szVC, VC_BUFF, 0);
+	// Decrypt it to get the plain-text password from user
+	zdecrypt(szVC, pw, szVKey, Ssk);
+//D(("Pass = %s", pw));
+
+memset(buff, '\0', strlen(buff));
+	if(got)
+		PHASE(&times, PHASE_AUTH, authed = shadowauth(user, pw));
+
+	// Same for the password check (it can wait on a free CPU)
+	session_deadline(AUTH_TIMEOUT);
+
+	if(!authed)
+		zencrypt("FAIL", buff, szVKey, Ssk);
+	else
+		zencrypt("OK", buff, szVKey, Ssk);
+D(("buff = %s", buff));
+	session_send(&times, connfd, buff);
+
+done:
+	close(connfd);
+
+	times.ns[PHASE_TOTAL] = stats_now() - start;
+	stats_session(&times);
+
+	free(buff);
+	free(szP);
+	free(szG);
+	free(szB);
+	free(szA);
+	free(user);
+	free(pw);
+	free(szVC);
+	free(szVKey);
+	free(s);
+
+	mpz_clear(A);
+	mpz_clear(B);
+	mpz_clear(G);
+	mpz_clear(P);
+	mpz_wipe(Ss);
+	mpz_wipe(Ssk);
+	mpz_clear(tmp);
+
+	D(("Session arena: %lu allocations, %lu reallocs (%lu in place), %lu chunks, %lu bytes",
+		mem.allocs, mem.reallocs, mem.inplace, mem.chunks, mem.bytes));
+
+	arena_release(&mem);
+
+	return NULL;
+}
+
+int main(int argc, char *argv[]){
+//D(("shadowauth(love,godsex) = %d", shadowauth("love", "godsex")));
+
+	// Has to happen before anything touches GMP
+	arena_install();
+
+	// Has to happen before any other threads are started (see stats_init())
+	if(!stats_init())
+		return 1;
+
+	int serverfd, connfd;
 
 	struct addrinfo hints, *sinfo, *p;
 
@@ -95,30 +407,61 @@ int main(int argc, char *argv[]){
 
 	socklen_t sin_size;
 
-	struct sigaction sa;
+	pthread_t thread;
+
+	session *s = NULL;
 
 	int yes = 1;
 	int rv = 0;
 
-	char buffer[65535] = {'\0'};
+	uint64_t start = 0;
 
 	char *host = NULL;
-	char *port = (char*)malloc(sizeof(char) * 5); // sizeof(char) * (digits) [65535 = 5 digits]
+	char *port = (char*)malloc(sizeof(char) * 6); // sizeof(char) * (digits + 1) [65535 = 5 digits]
+
+	// Connections per second (& at once) each address gets, see ratelimit.h
+	double rate = RATE_PER_SEC;
+	int burst = RATE_BURST, opt = 0;
+	char *end = NULL;
+
+	uint64_t allowed = 0, limited = 0, evicted = 0;
+
+	while((opt = getopt(argc, argv, "r:b:k")) != -1){
+		if(opt == 'r'){
+			// Anything that isn't a number is turned down by rate_init()
+			rate = strtod(optarg, &end);
+
+			if((end == optarg) || *end)
+				rate = NAN;
+		} else if(opt == 'b')
+			burst = atoi(optarg);
+		else if(opt == 'k')
+			any_key = 1;
+		else{
+			printf("Usage: %s [-r rate] [-b burst] [-k] [host] [port]\n", argv[0]);
+			printf("\trate: connections/sec per address (default %d, 0 = no limit), burst: default %d\n",
+				RATE_PER_SEC, RATE_BURST);
+			printf("\t-k: clients can ask for keys bigger than %d bits (benchmarks only)\n", key);
+			return 1;
+		}
+	}
 
-	char srcip[INET6_ADDRSTRLEN];
+	// What's left is [host] port
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if(argc == 3){
-		host = (char*)malloc(sizeof(char) * strlen(argv[1]));
+		host = (char*)malloc(sizeof(char) * (strlen(argv[1]) + 1));
 
 		sprintf(host, "%s", argv[1]);
-		sprintf(port, "%s", argv[2]);
+		sprintf(port, "%.5s", argv[2]);
 	} else {
-		host = (char*)malloc(sizeof(char) * strlen("127.0.0.1"));
+		host = (char*)malloc(sizeof(char) * (strlen("0.0.0.0") + 1));
 
 		sprintf(host, "0.0.0.0");
 
 		if(argc == 2)
-			sprintf(port, "%s", argv[1]);
+			sprintf(port, "%.5s", argv[1]);
 		else
 			sprintf(port, "4309");
 	}
@@ -165,15 +508,44 @@ int main(int argc, char *argv[]){
 		return 1;
 	}
 
-	sa.sa_handler = sigchld_handler;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART;
+	// A client hanging up mid-send shouldn't take the whole server with it
+	signal(SIGPIPE, SIG_IGN);
+
+	group_init();
+
+	if(!powmq_init(&powmq, POWMQ_THREADS, POWMQ_BATCH, POWMQ_WAIT))
+		return 1;
+
+	if(!pairs_init(PAIRS_THREADS))
+		return 1;
+
+	resume_init();
+
+	if(sem_init(&auth_slots, 0, (sysconf(_SC_NPROCESSORS_ONLN) > 0) ? sysconf(_SC_NPROCESSORS_ONLN) : 1) == -1){
+		perror("sem_init()");
+		return 1;
+	}
+
+	// Only the header is looked at, however many accounts there are
+	start = stats_now();
+
+	if(acctdb_open(&accounts, ACCOUNTS_DB)){
+		D(("%s: %lu accounts, opened in %lu us", ACCOUNTS_DB, (unsigned long)accounts.hdr->count,
+			(unsigned long)((stats_now() - start) / 1000)));
+
+		auth_backend_add(ACCOUNTS_DB, accounts_lookup, &accounts);
+	}
+
+	auth_backend_add("/etc/shadow", shadow_lookup, NULL);
 
-	if(sigaction(SIGCHLD, &sa, NULL) == -1){
-		perror("sigaction");
+	if(!rate_init(rate, burst)){
+		printf("Can't limit connections to %g/sec, %d at once (see rate_init() in ratelimit.h)\n", rate, burst);
 		return 1;
 	}
 
+	if(rate > 0)
+		D(("Each address gets %.1f connections/sec, %d at once", rate, (burst < 1) ? 1 : burst));
+
 	while(1){
 		sin_size = sizeof(client_addr);
 
@@ -184,127 +556,46 @@ int main(int argc, char *argv[]){
 			continue;
 		}
 
-		inet_ntop(client_addr.ss_family, in_addr((struct sockaddr*)&client_addr), srcip, sizeof(srcip));
+		// Before anything is spent on it (the session thread, P & G, the exchange)
+		if(!rate_allow((struct sockaddr*)&client_addr)){
+			close(connfd);
 
-		D(("Accepted new connection from %s", srcip));
+			rate_stats(&allowed, &limited, &evicted);
 
-		if(!fork()){
-			close(serverfd);
-
-			memset(buff, '\0', MEMBUFF);
-
-			// Send the key bit strength to the client
-			sprintf(buff, "%d", key);
-D(("Sending %s", buff));
-			sendbufflen(connfd, strlen(buff));
-D(("--sendbuff() passed."));
-			sendall(connfd, buff);
-D(("Buffer sent"));
-			// Since otherwise this can cause problems, make sur buff is emptied again
-			memset(buff, '\0', 4);
-
-			// Generate P & G, as well as the sever's secret
-			gen_P(key, P);
-			gen_G(key, P, G);
+			// Only now & then, a flood would otherwise be a flood of these too
+			if(!(limited & (limited - 1)))
+				D(("Turned away %lu connections over the rate limit (%lu let through, %lu buckets evicted)",
+					limited, allowed, evicted));
 
-			birandom(key, Ss, 0);
+			continue;
+		}
 
-			// A = (G ^ Ss)(mod P)
-			mpz_powm_sec(A, G, Ss, P);
-			mpz2str(A, szA);
+		// Frames go out whole (see sendframe()), and the client answers each one before the next
+		setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
 
-			// Convert P & G to wire-transferable format, then send them to client
-			mpz2str(P, szP);
-			mpz2str(G, szG);
+		s = (session*)malloc(sizeof(session));
+		s->fd = connfd;
 
-			sendbufflen(connfd, strlen(szP));
-			sendall(connfd, szP);
+		inet_ntop(client_addr.ss_family, in_addr((struct sockaddr*)&client_addr), s->srcip, sizeof(s->srcip));
 
-			sendbufflen(connfd, strlen(szG));
-			sendall(connfd, szG);
+		D(("Accepted new connection from %s", s->srcip));
 
-			// Get the client's B value
-			bufflen = recvbufflen(connfd);
-			recvall(connfd, buff, bufflen);
-D(("B = %s", buff));
-			//recv(connfd, buff, bufflen, 0);
-			str2mpz(buff, B);
-
-			// Tell the client our A value
-			sendbufflen(connfd, strlen(szA));
-			sendall(connfd, szA);
-
-			// We generate our secret key with the same formulas as A
-			mpz_powm_sec(Ssk, B, Ss, P);
-
-			// Tell the client the key size of the Viegnere Cipher (26, 54, or 96)
-			sprintf(buff, "%d", vhkey);
-			sendbufflen(connfd, strlen(buff));
-			sendall(connfd, buff);
-
-			vc_key(VC_KEY, szVKey);
-			dh_encrypt(szVKey, buff, Ssk);
-			sendbufflen(connfd, strlen(buff));
-			sendall(connfd, buff);
-
-			// Get the username from the client
-			memset(buff, '\0', strlen(buff));
-			bufflen = recvbufflen(connfd);
-			recvall(connfd, buff, bufflen);
-D(("USER = %s", buff));
-			//recv(connfd, buff, bufflen, 0);
-			zdecrypt(buff, user, szVKey, Ssk);
+		if(pthread_create(&thread, NULL, handle_client, s) != 0){
+			perror("pthread_create");
 
-//D(("User = %s", user));
+			close(connfd);
+			free(s);
 
-			memset(szVC, '\0', strlen(szVC));
-			// Receive the cipher text of the user's password (encrypted with D-H)
-			bufflen = recvbufflen(connfd);
-			recvall(connfd, szVC, bufflen);
-D(("PASS = %s", buff));
-			//recv(connfd, szVC, VC_BUFF, 0);
-			// Decrypt it to get the plain-text password from user
-			zdecrypt(szVC, pw, szVKey, Ssk);
-//D(("Pass = %s", pw));
-
-memset(buff, '\0', strlen(buff));
-			if(!shadowauth(user, pw))
-				zencrypt("FAIL", buff, szVKey, Ssk);
-			else
-				zencrypt("OK", buff, szVKey, Ssk);
-D(("buff = %s", buff));
-			sendbufflen(connfd, strlen(buff));
-			sendall(connfd, buff);
-
-			//close(connfd);
-
-			exit(0);
+			continue;
 		}
 
-		close(connfd);
+		pthread_detach(thread);
 	}
 
 	close(serverfd);
 
-	free(buff);
-	free(szP);
-	free(szG);
-	free(szB);
-	free(szA);
-	free(pw);
-	free(szVC);
-	free(szVKey);
-
 	free(host);
 	free(port);
 
-	mpz_clear(A);
-	mpz_clear(B);
-	mpz_clear(G);
-	mpz_clear(P);
-	mpz_clear(Ss);
-	mpz_clear(Ssk);
-	mpz_clear(tmp);
-
 	return 0;
 }
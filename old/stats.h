@@ -0,0 +1,293 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+/*********************************
+ * Per-phase handshake latency.
+ *
+ * bottleneck() (debug.h) only prints how long one thing took.  To see where the tail latency of
+ * a handshake comes from, every session times each phase it goes through, and adds the results
+ * to one histogram per phase when it's done.
+ *
+ * The histograms are HDR-style (log-linear): each power of 2 is split into HIST_SUB buckets, so
+ * any value is recorded within ~6% of what it really was, from nanoseconds up to minutes, in a
+ * fixed amount of memory.  Recording is just atomic adds, no locks.
+ *
+ * stats_init() starts a thread that prints p50/p90/p99/max for every phase when the server gets
+ * SIGUSR1, and every STATS_INTERVAL seconds.
+ *********************************/
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include "debug.h"
+
+// Seconds between dumps (0 = only dump on SIGUSR1)
+#define STATS_INTERVAL	60
+
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(64 * HIST_SUB)
+
+enum {
+	PHASE_GEN_P,
+	PHASE_GEN_G,
+	PHASE_GROUP,
+	PHASE_BIRANDOM,
+	PHASE_POWM_A,
+	PHASE_POWM_SK,
+	PHASE_VC_KEY,
+	PHASE_DH_ENCRYPT,
+	PHASE_AUTH,
+	PHASE_SEND,
+	PHASE_RECV,
+	PHASE_TOTAL,
+	PHASES
+};
+
+const char *phase_names[PHASES] = {
+	"gen_P", "gen_G", "group_get", "birandom", "powm (A)", "powm (secret)",
+	"vc_key", "dh_encrypt", "shadowauth", "send", "recv", "total"
+};
+
+typedef struct __histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} histogram;
+
+histogram phase_hist[PHASES];
+
+/**
+ * struct __phase_times {}
+ *
+ * What a session has spent in each phase so far (nanoseconds).  Phases that happen more than
+ * once (send, recv) add up.
+ **/
+typedef struct __phase_times {
+	uint64_t ns[PHASES];
+} phase_times;
+
+/**
+ * PHASE()
+ * t:		Session's phase_times		[in/out]
+ * phase:	Phase being timed		[in]
+ * stmt:	Code that makes up the phase	[in]
+ *
+ * Runs stmt, adding how long it took to the session's time for phase.
+ **/
+#define PHASE(t, phase, stmt) do {					\
+		uint64_t __start = stats_now();				\
+		stmt;							\
+		(t)->ns[phase] += stats_now() - __start;		\
+	} while(0)
+
+/**
+ * stats_now()
+ *
+ * Returns a monotonic timestamp in nanoseconds.
+ **/
+uint64_t stats_now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * stats_bucket()
+ * v:	Value to find the bucket of	[in]
+ *
+ * Values under HIST_SUB get a bucket each, after that it's HIST_SUB buckets per power of 2.
+ **/
+int stats_bucket(uint64_t v){
+	int e = 0;
+
+	if(v < HIST_SUB)
+		return (int)v;
+
+	e = 63 - __builtin_clzll(v);
+
+	return ((e - HIST_SUB_BITS + 1) * HIST_SUB) + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * stats_value()
+ * i:	Bucket index	[in]
+ *
+ * Opposite of stats_bucket(), returns the highest value that lands in bucket i.
+ **/
+uint64_t stats_value(int i){
+	int e = 0;
+
+	if(i < HIST_SUB)
+		return (uint64_t)i;
+
+	e = (i / HIST_SUB) + HIST_SUB_BITS - 1;
+
+	return (((uint64_t)(HIST_SUB + (i % HIST_SUB)) + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+/**
+ * hist_record()
+ * h:	Histogram to add to	[in/out]
+ * ns:	How long it took	[in]
+ **/
+void hist_record(histogram *h, uint64_t ns){
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&h->counts[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+
+	while((ns > max) && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * stats_record()
+ * phase:	Phase the value is for	[in]
+ * ns:		How long it took	[in]
+ **/
+void stats_record(int phase, uint64_t ns){
+	hist_record(&phase_hist[phase], ns);
+}
+
+/**
+ * stats_session()
+ * t:	Phase times of a session that's done	[in]
+ *
+ * Records every phase the session went through.
+ **/
+void stats_session(phase_times *t){
+	int i = 0;
+
+	for(i = 0; i < PHASES; i++)
+		if(t->ns[i])
+			stats_record(i, t->ns[i]);
+}
+
+/**
+ * stats_percentile()
+ * h:	Histogram to look at		[in]
+ * p:	Percentile (0.0 - 100.0)	[in]
+ *
+ * Returns the value p percent of the recorded values are at or under.
+ **/
+uint64_t stats_percentile(histogram *h, double p){
+	uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED), seen = 0, want = 0;
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	int i = 0;
+
+	if(!total)
+		return 0;
+
+	want = (uint64_t)((p / 100.0) * total);
+
+	if(want < 1)
+		want = 1;
+
+	for(i = 0; i < HIST_BUCKETS; i++){
+		seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+
+		// Buckets report their upper bound, which can be past anything actually recorded
+		if(seen >= want)
+			return (stats_value(i) < max) ? stats_value(i) : max;
+	}
+
+	return max;
+}
+
+/**
+ * stats_table()
+ * hist:	Histograms to print		[in]
+ * names:	Name of each histogram		[in]
+ * n:		How many there are		[in]
+ *
+ * Prints p50/p90/p99/max (in microseconds) for every histogram that has something in it.
+ **/
+void stats_table(histogram *hist, const char **names, int n){
+	histogram *h = NULL;
+	int i = 0;
+
+	printf("%-14s %10s %12s %12s %12s %12s\n", "phase", "count", "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+
+	for(i = 0; i < n; i++){
+		h = &hist[i];
+
+		if(!h->total)
+			continue;
+
+		printf("%-14s %10lu %12.1f %12.1f %12.1f %12.1f\n", names[i], h->total,
+			stats_percentile(h, 50.0) / 1000.0, stats_percentile(h, 90.0) / 1000.0,
+			stats_percentile(h, 99.0) / 1000.0, h->max / 1000.0);
+	}
+
+	fflush(stdout);
+}
+
+/**
+ * stats_dump()
+ *
+ * Prints the server's phase histograms.
+ **/
+void stats_dump(){
+	stats_table(phase_hist, phase_names, PHASES);
+}
+
+/**
+ * stats_thread()
+ * arg:	Not used	[in]
+ *
+ * Waits for SIGUSR1 (or STATS_INTERVAL seconds) and dumps the histograms.
+ **/
+void *stats_thread(void *arg){
+	struct timespec ts;
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	ts.tv_sec = STATS_INTERVAL;
+	ts.tv_nsec = 0;
+
+	while(1){
+		if(STATS_INTERVAL)
+			sigtimedwait(&set, NULL, &ts);
+		else
+			sigwaitinfo(&set, NULL);
+
+		stats_dump();
+	}
+
+	return NULL;
+}
+
+/**
+ * stats_init()
+ *
+ * Blocks SIGUSR1 (so only the stats thread gets it) and starts the stats thread.  Call before
+ * any other threads are started, since they inherit the signal mask.
+ *
+ * Returns 1 on success, 0 on failure.
+ **/
+int stats_init(){
+	pthread_t t;
+	sigset_t set;
+
+	memset(phase_hist, 0, sizeof(phase_hist));
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if(pthread_create(&t, NULL, stats_thread, NULL) != 0){
+		perror("pthread_create()");
+		return 0;
+	}
+
+	pthread_detach(t);
+
+	return 1;
+}
+
+#endif
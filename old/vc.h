@@ -63,8 +63,10 @@
  * NOTES:
  * - 52 is harder to code as in ASCII scan code, it has two ranges, instead of just one.
  * It works better now than it did originally though.
+ *
+ * Each thread has its own MODULO, so sessions (one per thread) can each use a different one.
  **/
-int MODULO = 94;
+__thread int MODULO = 94;
 
 /**
  * struct __key {}
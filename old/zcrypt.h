@@ -66,9 +66,9 @@ void pad(char *s){
  **/
 void zencrypt(char *p, char *buff, char *vck, mpz_t dhs){
 //gmp_printf("DHS:	%Zd\n", dhs);
-	char *tmp = (char*)malloc(sizeof(char) * strlen(p));
+	char *tmp = (char*)malloc(sizeof(char) * (strlen(p) + 1));
 
-	memset(tmp, '\0', sizeof(tmp));
+	memset(tmp, '\0', strlen(p) + 1);
 
 	// First, we do the VG cipher
 	vc_encrypt(p, vck, tmp);
@@ -0,0 +1,327 @@
+/****************************
+ * Pool.h
+ *
+ * Worker pool for CPU-heavy work (D-H math, key generation, password checks).
+ *
+ * A socket read or write takes microseconds, a crypt() or an 8192-bit powm can take hundreds of
+ * milliseconds.  If the event loop did that work itself, every connection would wait behind it.
+ * Instead the loop hands a PoolJob to the pool, carries on, and gets the result back on its own
+ * thread (through NetLoopPost(), see event.h) when it's done.
+ *
+ * Each worker has its own queue.  Jobs are handed out round-robin, and a worker that runs out of
+ * jobs takes one from the back of another worker's queue, so one slow job only holds up the jobs
+ * behind it until an idle worker steals them.
+ *
+ * How long jobs wait in a queue and how long they take to run is kept in PoolStats() (and in each
+ * job, so the done() handler can look at it).
+ ****************************/
+#ifndef __POOL_H
+#define __POOL_H
+
+#include "event.h"
+
+// Defaults for PoolInit()
+#define POOL_THREADS	4
+#define POOL_DEPTH	1024	// Jobs waiting across every queue
+
+typedef struct __pooljob PoolJob;
+
+struct __pooljob {
+	// Must be first, done() runs as a NetTask on the loop's thread
+	NetTask task;
+
+	// Runs on a worker
+	void (*run)(PoolJob *j);
+
+	// Runs on the loop's thread once run() is done (frees the job)
+	void (*done)(NetLoop *l, PoolJob *j);
+
+	NetLoop *loop;
+
+	// Timestamps (see NetNow())
+	uint64_t queued;
+	uint64_t started;
+	uint64_t finished;
+};
+
+typedef struct __poolworker {
+	pthread_mutex_t lock;
+
+	// Ring of jobs waiting to run
+	PoolJob **jobs;
+	int head;
+	int count;
+	int size;
+
+	struct __pool *pool;
+
+	int id;
+
+	// Stats (atomic, PoolStats() reads them from another thread)
+	uint64_t ran;
+	uint64_t stolen;
+} PoolWorker;
+
+typedef struct __pool {
+	PoolWorker *workers;
+	int threads;
+	int depth;
+
+	// Workers sleep here when every queue is empty
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	int pending;
+
+	// Next queue to try (atomic, loops submit from their own threads)
+	unsigned int next;
+
+	// Stats (atomic)
+	uint64_t submitted;
+	uint64_t rejected;
+	uint64_t completed;
+	uint64_t wait_ns;
+	uint64_t wait_max;
+	uint64_t run_ns;
+	uint64_t run_max;
+} Pool;
+
+/**
+ * PoolMax()
+ * max:	Highest value seen so far	[in/out]
+ * v:	New value			[in]
+ **/
+void PoolMax(uint64_t *max, uint64_t v){
+	uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while((v > cur) && !__atomic_compare_exchange_n(max, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * PoolTake()
+ * w:		Queue to take from		[in/out]
+ * steal:	Take the newest job, not the oldest	[in]
+ *
+ * Returns a job, or NULL if the queue is empty.
+ **/
+PoolJob *PoolTake(PoolWorker *w, int steal){
+	PoolJob *j = NULL;
+
+	pthread_mutex_lock(&w->lock);
+
+	if(w->count > 0){
+		if(steal){
+			j = w->jobs[(w->head + w->count - 1) % w->size];
+		} else{
+			j = w->jobs[w->head];
+			w->head = (w->head + 1) % w->size;
+		}
+
+		w->count--;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	return j;
+}
+
+/**
+ * PoolThread()
+ * arg:	Worker this thread is	[in]
+ **/
+void *PoolThread(void *arg){
+	PoolWorker *w = (PoolWorker*)arg;
+	Pool *p = w->pool;
+	PoolJob *j = NULL;
+	uint64_t wait = 0, run = 0;
+	int i = 0;
+
+	while(1){
+		// Own queue first, then everyone else's
+		if(!(j = PoolTake(w, 0))){
+			for(i = 1; i < p->threads; i++){
+				if((j = PoolTake(&p->workers[(w->id + i) % p->threads], 1))){
+					__atomic_fetch_add(&w->stolen, 1, __ATOMIC_RELAXED);
+					break;
+				}
+			}
+		}
+
+		if(!j){
+			pthread_mutex_lock(&p->lock);
+
+			while(!p->pending)
+				pthread_cond_wait(&p->more, &p->lock);
+
+			pthread_mutex_unlock(&p->lock);
+
+			continue;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		p->pending--;
+		pthread_mutex_unlock(&p->lock);
+
+		j->started = NetNow();
+		j->run(j);
+		j->finished = NetNow();
+
+		wait = j->started - j->queued;
+		run = j->finished - j->started;
+
+		__atomic_fetch_add(&w->ran, 1, __ATOMIC_RELAXED);
+
+		__atomic_fetch_add(&p->completed, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&p->wait_ns, wait, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&p->run_ns, run, __ATOMIC_RELAXED);
+
+		PoolMax(&p->wait_max, wait);
+		PoolMax(&p->run_max, run);
+
+		NetLoopPost(j->loop, &j->task);
+	}
+
+	return NULL;
+}
+
+/**
+ * PoolDone()
+ * l:	Loop the job came from	[in/out]
+ * t:	The job			[in]
+ *
+ * NetTask handler for finished jobs, just passes them on to their done() function.
+ **/
+void PoolDone(NetLoop *l, NetTask *t){
+	PoolJob *j = (PoolJob*)t;
+
+	j->done(l, j);
+}
+
+/**
+ * PoolInit()
+ * p:		Pool to start					[out]
+ * threads:	Number of workers (0 = POOL_THREADS)		[in]
+ * depth:	Most jobs that can be waiting (0 = POOL_DEPTH)	[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int PoolInit(Pool *p, int threads, int depth){
+	pthread_t t;
+	int i = 0;
+
+	memset(p, 0, sizeof(Pool));
+
+	p->threads = (threads > 0) ? threads : POOL_THREADS;
+	p->depth = (depth > 0) ? depth : POOL_DEPTH;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->more, NULL);
+
+	if(!(p->workers = (PoolWorker*)calloc(p->threads, sizeof(PoolWorker))))
+		return 0;
+
+	for(i = 0; i < p->threads; i++){
+		PoolWorker *w = &p->workers[i];
+
+		w->pool = p;
+		w->id = i;
+		w->size = (p->depth + p->threads - 1) / p->threads;
+
+		pthread_mutex_init(&w->lock, NULL);
+
+		if(!(w->jobs = (PoolJob**)calloc(w->size, sizeof(PoolJob*))))
+			return 0;
+
+		if(pthread_create(&t, NULL, PoolThread, w) != 0){
+			perror("pthread_create()");
+			return 0;
+		}
+
+		pthread_detach(t);
+	}
+
+	D(("Started %d workers, %d jobs deep", p->threads, p->depth));
+
+	return 1;
+}
+
+/**
+ * PoolSubmit()
+ * p:	Pool to run the job on			[in/out]
+ * l:	Loop to hand the result back to		[in]
+ * c:	Connection the job is for (or NULL)	[in]
+ * j:	Job to run (run & done set)		[in]
+ *
+ * Queues j.  c is held (see NetConnHold()) until done() has run, but it may have been closed by
+ * then, so done() has to check c->closed.  Every loop (shard) can submit to the same pool at
+ * once, as long as it's from l's own thread.
+ *
+ * Returns 0 if every queue is full (the job isn't run), 1 on success.
+ **/
+int PoolSubmit(Pool *p, NetLoop *l, NetConn *c, PoolJob *j){
+	PoolWorker *w = NULL;
+	int i = 0, queued = 0;
+
+	j->loop = l;
+	j->task.fn = PoolDone;
+	j->task.conn = c;
+	j->queued = NetNow();
+
+	// Round-robin, skipping queues that are full
+	for(i = 0; (i < p->threads) && !queued; i++){
+		w = &p->workers[__atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) % p->threads];
+
+		pthread_mutex_lock(&w->lock);
+
+		if(w->count < w->size){
+			w->jobs[(w->head + w->count) % w->size] = j;
+			w->count++;
+
+			queued = 1;
+		}
+
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	if(!queued){
+		__atomic_fetch_add(&p->rejected, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	// Counted as well, so a closing connection waits for the answer (see NetConnUpdate())
+	if(c){
+		NetConnHold(c);
+		c->tasks++;
+	}
+
+	__atomic_fetch_add(&p->submitted, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&p->lock);
+	p->pending++;
+	pthread_cond_signal(&p->more);
+	pthread_mutex_unlock(&p->lock);
+
+	return 1;
+}
+
+/**
+ * PoolStats()
+ * p:	Pool to show stats of	[in]
+ **/
+void PoolStats(Pool *p){
+	uint64_t done = __atomic_load_n(&p->completed, __ATOMIC_RELAXED), stolen = 0;
+	int i = 0;
+
+	for(i = 0; i < p->threads; i++)
+		stolen += __atomic_load_n(&p->workers[i].stolen, __ATOMIC_RELAXED);
+
+	D(("%d workers: %lu jobs submitted, %lu done, %lu stolen, %lu rejected (queue full)",
+		p->threads, __atomic_load_n(&p->submitted, __ATOMIC_RELAXED), done, stolen,
+		__atomic_load_n(&p->rejected, __ATOMIC_RELAXED)));
+
+	if(done)
+		D(("Job wait %.1f us avg / %.1f us max, run %.1f us avg / %.1f us max",
+			(p->wait_ns / (double)done) / 1000.0, p->wait_max / 1000.0,
+			(p->run_ns / (double)done) / 1000.0, p->run_max / 1000.0));
+}
+
+#endif
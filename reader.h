@@ -0,0 +1,247 @@
+/****************************
+ * Reader.h
+ *
+ * Buffered, per-connection reader for frames (see NetSendn() in network.h).
+ *
+ * NetRecv() assumes each recv() lines up with a frame, which TCP doesn't promise: two frames can
+ * show up in one read, or one frame can be split over several.  NetReader instead does large
+ * reads into one buffer per connection, and pulls out every complete frame that's in it.
+ *
+ * Frames are handed out as (pointer, length) views into the buffer, nothing is copied.  A view
+ * is good until the next NetReaderFill().
+ *
+ * The buffer is used like a ring: data is read in at the tail, frames are taken off the head,
+ * and whatever is left over gets moved back to the front when the tail runs out of room.
+ *
+ * Frames bigger than the reader's max are refused as soon as their header is in, before any of
+ * their data is read.
+ ****************************/
+#ifndef __READER_H
+#define __READER_H
+
+#include "network.h"
+
+#include <poll.h>
+
+// Default buffer size (big enough for a few full frames)
+#define NET_READER_SIZE	(4 * (NET_HDRLEN + NET_MAXFRAME))
+
+typedef struct __netreader {
+	char *buff;
+
+	int size;
+	int head;	// Start of data that hasn't been handed out yet
+	int tail;	// End of data that has been read
+
+	int max;	// Largest frame accepted
+
+	int eof;	// Other side has stopped sending
+} NetReader;
+
+/**
+ * NetReaderInit()
+ * r:		Reader to set up			[out]
+ * size:	Size of the buffer (0 = NET_READER_SIZE)	[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetReaderInit(NetReader *r, int size){
+	r->size = (size > 0) ? size : NET_READER_SIZE;
+	r->head = 0;
+	r->tail = 0;
+	r->eof = 0;
+
+	r->max = r->size - NET_HDRLEN;
+
+	if(r->max > NET_MAXFRAME)
+		r->max = NET_MAXFRAME;
+
+	return (r->buff = mem(r->size)) != NULL;
+}
+
+/**
+ * NetReaderUse()
+ * r:		Reader to set up				[out]
+ * buff:	Buffer to read into (not freed by the reader)	[in]
+ * size:	Size of buff					[in]
+ * max:		Largest frame to accept				[in]
+ **/
+void NetReaderUse(NetReader *r, char *buff, int size, int max){
+	r->buff = buff;
+	r->size = size;
+	r->head = r->tail = 0;
+	r->eof = 0;
+
+	r->max = ((max > 0) && (max <= NET_MAXFRAME)) ? max : NET_MAXFRAME;
+
+	if(r->max > (size - NET_HDRLEN))
+		r->max = size - NET_HDRLEN;
+}
+
+/**
+ * NetReaderFree()
+ * r:	Reader to get rid of	[in/out]
+ **/
+void NetReaderFree(NetReader *r){
+	if(r->buff){
+		memset(r->buff, '\0', r->size);
+		free(r->buff);
+	}
+
+	r->buff = NULL;
+	r->size = r->head = r->tail = 0;
+}
+
+/**
+ * NetReaderCompact()
+ * r:	Reader to make room in	[in/out]
+ *
+ * Moves what hasn't been handed out yet to the front of the buffer.  Views handed out before
+ * this aren't good anymore.
+ **/
+void NetReaderCompact(NetReader *r){
+	if(r->head > 0){
+		if(r->tail > r->head)
+			memmove(r->buff, r->buff + r->head, r->tail - r->head);
+
+		r->tail -= r->head;
+		r->head = 0;
+	}
+}
+
+/**
+ * NetReaderFill()
+ * r:		Reader to read into	[in/out]
+ * sock:	Socket to read from	[in]
+ *
+ * Reads as much as the socket has (or as much as fits).  Non-blocking sockets are read until they
+ * would block, blocking sockets are read once.
+ *
+ * Returns the number of bytes read, 0 if nothing was ready, or -1 if the socket was closed or
+ * had an error (or the buffer is full of a frame that can't fit).  r->eof says whether it was
+ * just the other side being done sending.
+ **/
+int NetReaderFill(NetReader *r, int sock){
+	ssize_t got = 0;
+	int total = 0;
+
+	// Move what's left to the front, so the tail has as much room as possible
+	NetReaderCompact(r);
+
+	while(r->tail < r->size){
+		NetStatsAdd(recvs);
+
+		got = recv(sock, r->buff + r->tail, r->size - r->tail, MSG_DONTWAIT);
+
+		if(got > 0){
+			r->tail += got;
+			total += got;
+
+			// Short read, there's nothing more waiting right now
+			if(r->tail < r->size)
+				break;
+		} else if(got == 0){
+			D(("Socket %d closed by other side", sock));
+
+			r->eof = 1;
+
+			return total ? total : -1;
+		} else if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+			break;
+		} else if(errno != EINTR){
+			NetSockErr(errno);
+			return -1;
+		}
+	}
+
+	if(!total && (r->tail == r->size))
+		return -1;
+
+	return total;
+}
+
+/**
+ * NetReaderNext()
+ * r:		Reader to take a frame from	[in/out]
+ * data:	Set to the start of the frame	[out]
+ * len:		Set to the length of the frame	[out]
+ *
+ * Takes the next complete frame out of the buffer.  data is not \0 terminated.
+ *
+ * Returns 1 if a frame was found, 0 if more data is needed, -1 if the data isn't a valid frame.
+ **/
+int NetReaderNext(NetReader *r, char **data, int *len){
+	int avail = r->tail - r->head, n = 0, i = 0;
+	char *p = r->buff + r->head;
+
+	if(avail < NET_HDRLEN)
+		return 0;
+
+	for(i = 0; i < NET_HDRLEN; i++){
+		if((p[i] < '0') || (p[i] > '9')){
+			D(("Bad frame header from peer"));
+			return -1;
+		}
+
+		n = (n * 10) + (p[i] - '0');
+	}
+
+	if(n > r->max){
+		D(("Frame of %d bytes is over the limit (%d bytes)", n, r->max));
+		return -1;
+	}
+
+	if(avail < (NET_HDRLEN + n))
+		return 0;
+
+	*data = p + NET_HDRLEN;
+	*len = n;
+
+	r->head += NET_HDRLEN + n;
+
+	NetStatsAdd(frames_recv);
+
+	return 1;
+}
+
+/**
+ * NetReaderRecv()
+ * r:		Reader to use			[in/out]
+ * sock:	Blocking socket to read from	[in]
+ * buff:	Buffer to copy the frame into	[out]
+ * size:	Size of buff			[in]
+ *
+ * Blocking version of NetRecv() that goes through the reader, for code that just wants the next
+ * frame as a string.
+ *
+ * Returns the number of bytes of data received, or -1 on failure.
+ **/
+int NetReaderRecv(NetReader *r, int sock, char *buff, int size){
+	char *data = NULL;
+	int len = 0, ret = 0;
+
+	while(!(ret = NetReaderNext(r, &data, &len))){
+		// Nothing buffered, so wait for the socket (poll(), select() can't take fds past FD_SETSIZE)
+		struct pollfd pfd;
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if((poll(&pfd, 1, -1) == -1) && (errno != EINTR))
+			return -1;
+
+		if(NetReaderFill(r, sock) == -1)
+			return -1;
+	}
+
+	if((ret == -1) || (len >= size))
+		return -1;
+
+	memcpy(buff, data, len);
+	buff[len] = '\0';
+
+	return len;
+}
+
+#endif
@@ -0,0 +1,527 @@
+/****************************
+ * Resolve.h
+ *
+ * Name resolution for network.h.
+ *
+ * gethostbyname() blocks, hands back static storage and only does IPv4, and looking a name up
+ * for every connection adds a DNS round trip to each one.  NetResolve() uses getaddrinfo()
+ * (IPv4 & IPv6) and keeps the answers in a small cache for NET_RESOLVE_TTL seconds.  Once an
+ * entry is past NET_RESOLVE_REFRESH seconds old, the next lookup still gets the cached answer
+ * right away, and a background thread looks the name up again, so a busy client never waits on
+ * DNS once a name has been seen.  A name that doesn't resolve is remembered too, for
+ * NET_RESOLVE_NEGTTL seconds, so a client retrying a bad name doesn't send DNS a query every time.
+ *
+ * NetConnectAny() connects to the first address that answers, trying the others "happy eyeballs"
+ * style (RFC 8305): if an address hasn't connected within NET_EYEBALLS_DELAY ms, the next one is
+ * started alongside it, alternating IPv6 & IPv4.
+ *
+ * Unix domain sockets go through the same calls: a host of "unix:/path" (or any host starting
+ * with '/') resolves to that socket's path instead, and the port is ignored.
+ *
+ * Everything here is thread-safe.
+ ****************************/
+#ifndef __RESOLVE_H
+#define __RESOLVE_H
+
+#include "global.h"
+
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define NET_RESOLVE_MAX		8	// Addresses kept per name
+#define NET_RESOLVE_CACHE	64	// Names kept
+#define NET_RESOLVE_TTL		300	// Seconds an answer is used for
+#define NET_RESOLVE_REFRESH	240	// Seconds before it's looked up again in the background
+#define NET_RESOLVE_NEGTTL	5	// Seconds a failed lookup is remembered for
+#define NET_RESOLVE_HOSTMAX	255
+
+#define NET_EYEBALLS_DELAY	250	// ms before the next address is tried
+#define NET_CONNECT_TIMEOUT	10000	// ms before giving up on all of them
+
+/**
+ * struct __netaddrs {}
+ *
+ * Addresses a name resolved to, in the order they should be tried.
+ **/
+typedef struct __netaddrs {
+	int count;
+
+	struct sockaddr_storage addr[NET_RESOLVE_MAX];
+	socklen_t len[NET_RESOLVE_MAX];
+} NetAddrs;
+
+typedef struct __netresolveentry {
+	char host[NET_RESOLVE_HOSTMAX + 1];
+	int port;
+	int passive;
+
+	// No addresses = the lookup failed
+	NetAddrs addrs;
+
+	time_t resolved;
+	time_t used;
+	int refreshing;
+} NetResolveEntry;
+
+/**
+ * struct __netresolver {}
+ *
+ * The cache, and counters to see how much DNS it's saving.
+ **/
+struct __netresolver {
+	pthread_mutex_t lock;
+
+	NetResolveEntry entries[NET_RESOLVE_CACHE];
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t refreshes;
+	uint64_t failures;
+	uint64_t negative;
+} NetResolver = {PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * NetResolveNow()
+ *
+ * Returns seconds on the monotonic clock (cache ages).
+ **/
+time_t NetResolveNow(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/**
+ * NetAddrUnix()
+ * host:	Name, IP or unix socket to look at	[in]
+ *
+ * Returns the socket's path if host is a unix socket ("unix:/path" or "/path"), else NULL.
+ **/
+const char *NetAddrUnix(const char *host){
+	if(!host)
+		return NULL;
+
+	if(!strncmp(host, "unix:", 5))
+		return host + 5;
+
+	return (host[0] == '/') ? host : NULL;
+}
+
+/**
+ * NetResolveUnix()
+ * path:	Path of the unix socket		[in]
+ * addrs:	Where to put its address	[out]
+ *
+ * Returns 0 on failure (path too long), 1 on success.
+ **/
+int NetResolveUnix(const char *path, NetAddrs *addrs){
+	struct sockaddr_un *un = (struct sockaddr_un*)&addrs->addr[0];
+
+	memset(addrs, 0, sizeof(NetAddrs));
+
+	if(!path[0] || (strlen(path) >= sizeof(un->sun_path))){
+		D(("Unix socket path %s is empty or too long", path));
+		return 0;
+	}
+
+	un->sun_family = AF_UNIX;
+	strcpy(un->sun_path, path);
+
+	addrs->len[0] = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+	addrs->count = 1;
+
+	return 1;
+}
+
+/**
+ * NetResolveLookup()
+ * host:	Name or IP to look up			[in]
+ * port:	Port to put in the addresses		[in]
+ * passive:	Addresses are for bind(), not connect()	[in]
+ * addrs:	Where to put the addresses		[out]
+ *
+ * Does the actual getaddrinfo() call (no cache).  For connect(), the addresses are ordered
+ * IPv6, IPv4, IPv6, ... (as RFC 8305 asks), keeping getaddrinfo()'s order within each family.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetResolveLookup(const char *host, int port, int passive, NetAddrs *addrs){
+	struct addrinfo hints, *res = NULL, *ai = NULL;
+	struct addrinfo *v6[NET_RESOLVE_MAX], *v4[NET_RESOLVE_MAX];
+	char service[8];
+	int n6 = 0, n4 = 0, i = 0, j = 0, err = 0;
+
+	memset(&hints, 0, sizeof(hints));
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_ADDRCONFIG | (passive ? AI_PASSIVE : 0);
+
+	snprintf(service, sizeof(service), "%d", port);
+
+	if((err = getaddrinfo(host, service, &hints, &res)) != 0){
+		D(("Unable to resolve %s: %s", host, gai_strerror(err)));
+		return 0;
+	}
+
+	for(ai = res; ai; ai = ai->ai_next){
+		if((ai->ai_family == AF_INET6) && (n6 < NET_RESOLVE_MAX))
+			v6[n6++] = ai;
+		else if((ai->ai_family == AF_INET) && (n4 < NET_RESOLVE_MAX))
+			v4[n4++] = ai;
+	}
+
+	memset(addrs, 0, sizeof(NetAddrs));
+
+	// bind() takes the first address, and "0.0.0.0" shouldn't turn into "::"
+	if(passive){
+		for(ai = res; ai && (addrs->count < NET_RESOLVE_MAX); ai = ai->ai_next){
+			if((ai->ai_family != AF_INET) && (ai->ai_family != AF_INET6))
+				continue;
+
+			memcpy(&addrs->addr[addrs->count], ai->ai_addr, ai->ai_addrlen);
+			addrs->len[addrs->count++] = ai->ai_addrlen;
+		}
+	} else{
+		while((addrs->count < NET_RESOLVE_MAX) && ((i < n6) || (j < n4))){
+			if(i < n6){
+				memcpy(&addrs->addr[addrs->count], v6[i]->ai_addr, v6[i]->ai_addrlen);
+				addrs->len[addrs->count++] = v6[i++]->ai_addrlen;
+			}
+
+			if((j < n4) && (addrs->count < NET_RESOLVE_MAX)){
+				memcpy(&addrs->addr[addrs->count], v4[j]->ai_addr, v4[j]->ai_addrlen);
+				addrs->len[addrs->count++] = v4[j++]->ai_addrlen;
+			}
+		}
+	}
+
+	freeaddrinfo(res);
+
+	return (addrs->count > 0);
+}
+
+/**
+ * NetResolveFind()
+ *
+ * Returns the cache entry for host/port/passive, or NULL.  Caller holds NetResolver.lock.
+ **/
+NetResolveEntry *NetResolveFind(const char *host, int port, int passive){
+	int i = 0;
+
+	for(i = 0; i < NET_RESOLVE_CACHE; i++){
+		NetResolveEntry *e = &NetResolver.entries[i];
+
+		if(e->host[0] && (e->port == port) && (e->passive == passive) && streq(e->host, host))
+			return e;
+	}
+
+	return NULL;
+}
+
+/**
+ * NetResolveRefresh()
+ * arg:	Entry to look up again	[in]
+ *
+ * Background refresh thread.  The entry keeps serving the old answer until this is done, and
+ * does so for good if the lookup fails (until its TTL runs out).
+ **/
+void *NetResolveRefresh(void *arg){
+	NetResolveEntry *e = (NetResolveEntry*)arg;
+	char host[NET_RESOLVE_HOSTMAX + 1];
+	NetAddrs addrs;
+	int port = 0, passive = 0, ok = 0;
+
+	pthread_mutex_lock(&NetResolver.lock);
+
+	strcpy(host, e->host);
+	port = e->port;
+	passive = e->passive;
+
+	pthread_mutex_unlock(&NetResolver.lock);
+
+	ok = NetResolveLookup(host, port, passive, &addrs);
+
+	pthread_mutex_lock(&NetResolver.lock);
+
+	// The entry could have been handed to another name while we were looking this one up
+	if(ok && (e->port == port) && (e->passive == passive) && streq(e->host, host)){
+		e->addrs = addrs;
+		e->resolved = NetResolveNow();
+	}
+
+	if(!ok)
+		NetResolver.failures++;
+
+	e->refreshing = 0;
+
+	pthread_mutex_unlock(&NetResolver.lock);
+
+	return NULL;
+}
+
+/**
+ * NetResolve()
+ * host:	Name or IP to look up			[in]
+ * port:	Port to put in the addresses		[in]
+ * passive:	Addresses are for bind(), not connect()	[in]
+ * addrs:	Where to put the addresses		[out]
+ *
+ * Cached getaddrinfo() (see above).  Unix sockets aren't looked up, or cached.
+ *
+ * Returns 0 on failure (addrs isn't touched), 1 on success.
+ **/
+int NetResolve(const char *host, int port, int passive, NetAddrs *addrs){
+	NetResolveEntry *e = NULL, *oldest = NULL;
+	pthread_attr_t attr;
+	pthread_t thread;
+	time_t now = NetResolveNow();
+	const char *path = NULL;
+	NetAddrs found;
+	int i = 0, ok = 0;
+
+	if(!host || (strlen(host) > NET_RESOLVE_HOSTMAX))
+		return 0;
+
+	if((path = NetAddrUnix(host)))
+		return NetResolveUnix(path, addrs);
+
+	pthread_mutex_lock(&NetResolver.lock);
+
+	e = NetResolveFind(host, port, passive);
+
+	// Failed not long ago, it'll fail again
+	if(e && !e->addrs.count && ((now - e->resolved) < NET_RESOLVE_NEGTTL)){
+		NetResolver.negative++;
+
+		pthread_mutex_unlock(&NetResolver.lock);
+
+		return 0;
+	}
+
+	if(e && e->addrs.count && ((now - e->resolved) < NET_RESOLVE_TTL)){
+		*addrs = e->addrs;
+		e->used = now;
+
+		NetResolver.hits++;
+
+		// Getting old, look it up again without making anyone wait on it
+		if(((now - e->resolved) >= NET_RESOLVE_REFRESH) && !e->refreshing){
+			e->refreshing = 1;
+			NetResolver.refreshes++;
+
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+			if(pthread_create(&thread, &attr, NetResolveRefresh, e) != 0)
+				e->refreshing = 0;
+
+			pthread_attr_destroy(&attr);
+		}
+
+		pthread_mutex_unlock(&NetResolver.lock);
+
+		return 1;
+	}
+
+	NetResolver.misses++;
+
+	pthread_mutex_unlock(&NetResolver.lock);
+
+	if(!(ok = NetResolveLookup(host, port, passive, &found)))
+		__atomic_fetch_add(&NetResolver.failures, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&NetResolver.lock);
+
+	// Reuse this name's entry, else an empty one, else the one used longest ago
+	if(!(e = NetResolveFind(host, port, passive))){
+		for(i = 0; i < NET_RESOLVE_CACHE; i++){
+			NetResolveEntry *c = &NetResolver.entries[i];
+
+			// Don't pull an entry out from under its refresh thread
+			if(c->refreshing)
+				continue;
+
+			if(!c->host[0]){
+				oldest = c;
+				break;
+			}
+
+			if(!oldest || (c->used < oldest->used))
+				oldest = c;
+		}
+
+		if((e = oldest)){
+			strcpy(e->host, host);
+			e->port = port;
+			e->passive = passive;
+		}
+	}
+
+	// Cached either way, a failure just has no addresses
+	if(e){
+		if(ok)
+			e->addrs = found;
+		else
+			memset(&e->addrs, 0, sizeof(NetAddrs));
+
+		e->resolved = e->used = now;
+	}
+
+	pthread_mutex_unlock(&NetResolver.lock);
+
+	// addrs is only touched on success
+	if(ok)
+		*addrs = found;
+
+	return ok;
+}
+
+/**
+ * NetAddrString()
+ * addr:	Address to show			[in]
+ * buff:	Where to put it			[out]
+ * size:	Size of buff (INET6_ADDRSTRLEN)	[in]
+ *
+ * Returns buff.
+ **/
+char *NetAddrString(struct sockaddr_storage *addr, char *buff, int size){
+	if(addr->ss_family == AF_UNIX)
+		snprintf(buff, size, "unix:%s", ((struct sockaddr_un*)addr)->sun_path);
+	else if(addr->ss_family == AF_INET6)
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*)addr)->sin6_addr, buff, size);
+	else
+		inet_ntop(AF_INET, &((struct sockaddr_in*)addr)->sin_addr, buff, size);
+
+	return buff;
+}
+
+/**
+ * NetConnectAny()
+ * addrs:	Addresses to try, in order		[in]
+ * timeout:	ms to give up after (0 = default)	[in]
+ * which:	Index of the address that won (or NULL)	[out]
+ *
+ * Happy eyeballs connect (see above).  The socket that wins is put back in blocking mode, the
+ * rest are closed.
+ *
+ * Returns the connected socket, or -1 on failure.
+ **/
+int NetConnectAny(NetAddrs *addrs, int timeout, int *which){
+	struct pollfd fds[NET_RESOLVE_MAX];
+	int idx[NET_RESOLVE_MAX];
+	int next = 0, n = 0, i = 0, k = 0, wait = 0, err = 0, sock = -1;
+	socklen_t errlen = sizeof(err);
+	time_t start = 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+
+	if(timeout <= 0)
+		timeout = NET_CONNECT_TIMEOUT;
+
+	while((sock == -1) && ((next < addrs->count) || n)){
+		// Start the next address: right away if nothing's going, else when the delay's up
+		if((next < addrs->count) && (k <= 0)){
+			int family = addrs->addr[next].ss_family;
+
+			// Unix sockets connect right away, or say EAGAIN (not EINPROGRESS) if the server's backlog
+			// is full, so those block until there's room instead
+			int s = socket(family, SOCK_STREAM | SOCK_CLOEXEC | ((family == AF_UNIX) ? 0 : SOCK_NONBLOCK), 0);
+
+			if(s != -1){
+				if((connect(s, (struct sockaddr*)&addrs->addr[next], addrs->len[next]) == 0) || (errno == EINPROGRESS)){
+					fds[n].fd = s;
+					fds[n].events = POLLOUT;
+					idx[n++] = next;
+				} else
+					close(s);
+			}
+
+			next++;
+
+			if(!n)
+				continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		wait = timeout - (int)(((ts.tv_sec * 1000) + (ts.tv_nsec / 1000000)) - start);
+
+		if(wait <= 0)
+			break;
+
+		if((next < addrs->count) && (wait > NET_EYEBALLS_DELAY))
+			wait = NET_EYEBALLS_DELAY;
+
+		if((k = poll(fds, n, wait)) == -1){
+			if(errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		for(i = 0; (i < n) && (k > 0); i++){
+			if(!fds[i].revents)
+				continue;
+
+			err = 0;
+			getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+
+			if(!err && (sock == -1)){
+				sock = fds[i].fd;
+
+				if(which)
+					*which = idx[i];
+
+				continue;
+			}
+
+			// Refused, unreachable, etc.  Don't wait on the delay to start the next one
+			close(fds[i].fd);
+
+			fds[i] = fds[--n];
+			idx[i] = idx[n];
+			i--;
+			k = 0;
+		}
+	}
+
+	for(i = 0; i < n; i++)
+		if(fds[i].fd != sock)
+			close(fds[i].fd);
+
+	if(sock != -1)
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+
+	return sock;
+}
+
+/**
+ * NetResolveStats()
+ *
+ * Shows how many lookups the cache saved.
+ **/
+void NetResolveStats(){
+	pthread_mutex_lock(&NetResolver.lock);
+
+	D(("Resolver: %lu cached, %lu looked up, %lu refreshed in the background, %lu failed (%lu more answered from a failure)",
+		NetResolver.hits, NetResolver.misses, NetResolver.refreshes, NetResolver.failures, NetResolver.negative));
+
+	pthread_mutex_unlock(&NetResolver.lock);
+}
+
+#endif
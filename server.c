@@ -1,69 +1,424 @@
-#include "network.h"
-#include <pthread.h>
+#include "pool.h"
+#include "shard.h"
+#include "auth.h"
+#include <signal.h>
+#include <ctype.h>
 
-void *handle_client(void *sock){
-	D(("\tInside thread"));
+/**
+ * Where a connection is in its conversation with the server.
+ *
+ * CONN_GREETING:	Just connected, greeting hasn't been queued yet
+ * CONN_WAITING:	Greeting is queued/sent, waiting on a username
+ * CONN_USER:		Got the username, waiting on the password
+ * CONN_AUTH:		Password is being checked by the pool
+ * CONN_PIPELINE:	Client asked for pipelining, every frame is a whole login (see below)
+ *
+ * Once the answer is queued, the connection goes back to CONN_WAITING, so a client can keep a
+ * connection open and log in over it as many times as it wants (see authpool.h).
+ *
+ * Pipelining:
+ * Instead of a username, the client can send PIPELINE (the server answers PIPELINE).  From then
+ * on each frame is "<id> <username> <password>", and is answered with "<id> OK", "<id> FAIL",
+ * "<id> BUSY" or "<id> DENIED" as soon as that password has been checked, so answers can come back in any order.
+ * The id is picked by the client (up to 9 digits), and is only used to match up the answer.  A
+ * connection can have up to PIPE_MAX logins being checked at once.
+ *
+ * Local peers:
+ * Listening on a unix socket ("unix:/path"), the kernel tells us which user is on the other end.
+ * A trusted one (root, i.e. the PAM module, or the user the server runs as) gets a single LOCAL
+ * frame instead of the greeting, and is pipelining from the start, so a login costs one round
+ * trip on a fresh connection.  Anyone else gets the usual greeting.
+ *
+ * A trusted local peer can also send SHMRING (instead of a login), and carry on over shared
+ * memory rings (see shmring.h).  Logins & answers are the same frames as on the socket.
+ *
+ * Passwords go over the connection as they are, so they're only checked for trusted local peers.
+ * Anyone else (TCP, or another user on the unix socket) can still connect & pipeline, but every
+ * login is answered DENIED ("<id> DENIED" pipelined) without the password being looked at, so
+ * nobody can sniff them off the network or use the server to guess them.
+ *
+ * Deadlines:
+ * A client that's holding up its side gets closed (see NetConnDeadline()): HANDSHAKE_TIMEOUT
+ * for a username after the greeting, AUTH_TIMEOUT for the password after the username, and
+ * IDLE_TIMEOUT for the next login after an answer (or the last pipelined frame).  There's no
+ * deadline while the pool is checking a password, that's on us.
+ **/
+enum {
+	CONN_GREETING,
+	CONN_WAITING,
+	CONN_USER,
+	CONN_AUTH,
+	CONN_PIPELINE
+};
 
-	int s = *((int*)sock);
+#define USER_MAX	64
+#define PASS_MAX	256
 
-	NetSend(s, "We are testing a send.");
-	NetSend(s, "Testing another send.");
+#define PIPE_MAX	256
+#define PIPE_IDMAX	9
 
-	D(("\tLeaving thread"));
+// How long a client has for each step (ms)
+#define HANDSHAKE_TIMEOUT	10000
+#define AUTH_TIMEOUT		10000
+#define IDLE_TIMEOUT		60000
+
+// Biggest frame a client has any reason to send (a pipelined login), bigger ones are dropped
+#define FRAME_MAX	(PIPE_IDMAX + 1 + USER_MAX + 1 + PASS_MAX)
+
+/**
+ * struct __authjob {}
+ *
+ * Password check handed to the pool.
+ **/
+typedef struct __authjob {
+	PoolJob job;
+
+	char user[USER_MAX + 1];
+	char pass[PASS_MAX + 1];
+
+	int authed;
+
+	// Pipelined login, answer is tagged with id
+	int pipelined;
+	unsigned long id;
+} authjob;
+
+/**
+ * struct __pipeline {}
+ *
+ * c->data of a pipelined connection.
+ **/
+typedef struct __pipeline {
+	int inflight;
+} pipeline;
+
+// Password checks only, so a slow hash never waits behind anything else
+Pool pool;
+
+// Compiled account database (see old/acctdb.h), used before /etc/shadow if it's there
+#define ACCOUNTS_DB	"accounts.db"
+
+acctdb accounts;
+
+/**
+ * auth_run()
+ * j:	Password check (authjob)	[in/out]
+ *
+ * Runs on a pool worker.  shadowauth() is reentrant (see auth.h), so the workers all check
+ * passwords at the same time.
+ **/
+void auth_run(PoolJob *j){
+	authjob *a = (authjob*)j;
+
+	a->authed = shadowauth(a->user, a->pass);
+
+	memset(a->pass, '\0', sizeof(a->pass));
 }
 
-int main(int argc, char *argv[]){
-	fd_set active_fd, read_fd;
+/**
+ * pipe_answer()
+ * c:		Pipelined connection	[in/out]
+ * id:		Login being answered	[in]
+ * answer:	OK, FAIL or BUSY	[in]
+ **/
+int pipe_answer(NetConn *c, unsigned long id, char *answer){
+	char buff[PIPE_IDMAX + 8];
 
-	int socket = NetServerCreate(argv[1], atoi(argv[2]));
+	snprintf(buff, sizeof(buff), "%lu %s", id, answer);
 
-	int i, status, client;
+	return NetConnQueueStr(c, buff);
+}
 
-	pthread_t mthread;
+void auth_done(NetLoop *l, PoolJob *j){
+	authjob *a = (authjob*)j;
+	NetConn *c = j->task.conn;
 
-	if(!socket){
-		D(("Unable to create socket for server.  Exiting."));
+	// Client could have left while the password was being checked
+	if(!c->closed){
+		D(("%s %s as %s", c->ip, a->authed ? "authenticated" : "failed to authenticate", a->user));
 
-		return 0;
+		if(a->pipelined){
+			((pipeline*)c->data)->inflight--;
+
+			if(!pipe_answer(c, a->id, a->authed ? "OK" : "FAIL"))
+				NetConnClose(l, c);
+		} else if(!NetConnQueueStr(c, a->authed ? "OK" : "FAIL")){
+			NetConnClose(l, c);
+		} else
+			c->state = CONN_WAITING;
+
+		// Nothing to wait on if it was just closed
+		if(!c->closed)
+			NetConnDeadline(c, IDLE_TIMEOUT);
 	}
 
-	FD_ZERO(&active_fd);
-	FD_SET(socket, &active_fd);
+	memset(a, 0, sizeof(authjob));
+	free(a);
+}
 
-	while(1){
-		read_fd = active_fd;
+/**
+ * local_trusted()
+ * c:	New connection	[in]
+ *
+ * Returns 1 if c is a unix socket peer running as root or as us, else 0.
+ **/
+int local_trusted(NetConn *c){
+	return c->local && ((c->cred.uid == 0) || (c->cred.uid == geteuid()));
+}
 
-		if(select(FD_SETSIZE, &read_fd, NULL, NULL, NULL) == -1){
-			perror("select()");
-			close(socket);
+int on_open(NetLoop *l, NetConn *c){
+	c->state = CONN_GREETING;
 
+	if(local_trusted(c)){
+		if(!(c->data = calloc(1, sizeof(pipeline))))
 			return 0;
-		}
 
-		for(i = 0; i < FD_SETSIZE; ++i){
-			if(FD_ISSET(i, &read_fd)){
-				if(i == socket){
-					//size = sizeof(client);
+		c->state = CONN_PIPELINE;
+		NetConnDeadline(c, IDLE_TIMEOUT);
+
+		return NetConnQueueStr(c, "LOCAL");
+	}
+
+	if(!NetConnQueueStr(c, "We are testing a send.") || !NetConnQueueStr(c, "Testing another send."))
+		return 0;
+
+	c->state = CONN_WAITING;
+	NetConnDeadline(c, HANDSHAKE_TIMEOUT);
+
+	return 1;
+}
+
+/**
+ * pipe_frame()
+ * l:		Loop the connection belongs to		[in/out]
+ * c:		Pipelined connection			[in/out]
+ * data:	"<id> <username> <password>" frame	[in]
+ * len:		Length of data				[in]
+ *
+ * A frame without an id can't be answered, so it closes the connection.  Once the id is there,
+ * a login that can't be right (no username, or either one too long) is just answered "FAIL",
+ * the other logins on the connection go on.
+ *
+ * Returns 0 if the frame is bad (connection should be closed), 1 otherwise.
+ **/
+int pipe_frame(NetLoop *l, NetConn *c, char *data, int len){
+	pipeline *p = (pipeline*)c->data;
+	authjob *a = NULL;
+	unsigned long id = 0;
+	int i = 0, user = 0, ulen = 0, pass = 0;
+
+	for(i = 0; (i < len) && (i < PIPE_IDMAX) && isdigit((unsigned char)data[i]); i++)
+		id = (id * 10) + (data[i] - '0');
+
+	if(!i || (i >= len) || (data[i] != ' '))
+		return 0;
+
+	user = ++i;
+
+	while((i < len) && (data[i] != ' '))
+		i++;
+
+	ulen = i - user;
+	pass = i + 1;
+
+	// Usernames & passwords are C strings from here on, a '\0' would cut them short
+	if(!ulen || (ulen > USER_MAX) || (pass > len) || ((len - pass) > PASS_MAX) ||
+	   memchr(data + user, '\0', len - user))
+		return pipe_answer(c, id, "FAIL");
+
+	if(!local_trusted(c))
+		return pipe_answer(c, id, "DENIED");
+
+	if(p->inflight >= PIPE_MAX)
+		return pipe_answer(c, id, "BUSY");
+
+	if(!(a = (authjob*)calloc(1, sizeof(authjob))))
+		return 0;
+
+	memcpy(a->user, data + user, ulen);
+	memcpy(a->pass, data + pass, len - pass);
+
+	a->pipelined = 1;
+	a->id = id;
+	a->job.run = auth_run;
+	a->job.done = auth_done;
+
+	if(!PoolSubmit(&pool, l, c, &a->job)){
+		memset(a, 0, sizeof(authjob));
+		free(a);
+
+		return pipe_answer(c, id, "BUSY");
+	}
+
+	p->inflight++;
+
+	return 1;
+}
+
+int on_frame(NetLoop *l, NetConn *c, char *data, int len){
+	authjob *a = NULL;
+
+	switch(c->state){
+		case CONN_PIPELINE:
+			NetConnDeadline(c, IDLE_TIMEOUT);
+
+			if((len == 7) && !memcmp(data, "SHMRING", 7) && local_trusted(c))
+				return NetShmAccept(l, c, 0);
+
+			return pipe_frame(l, c, data, len);
+
+		case CONN_WAITING:
+			if((len == 8) && !memcmp(data, "PIPELINE", 8)){
+				if(!(c->data = calloc(1, sizeof(pipeline))))
+					return 0;
+
+				c->state = CONN_PIPELINE;
+				NetConnDeadline(c, IDLE_TIMEOUT);
 
-					if(!(client = NetAccept(socket))){
-						perror("NetAccept() failed.");
-						close(socket);
+				return NetConnQueueStr(c, "PIPELINE");
+			}
+
+			if((len > USER_MAX) || !(a = (authjob*)calloc(1, sizeof(authjob))))
+				return 0;
+
+			memcpy(a->user, data, len);
+
+			c->data = a;
+			c->state = CONN_USER;
+			NetConnDeadline(c, AUTH_TIMEOUT);
+
+			return 1;
+
+		case CONN_USER:
+			a = (authjob*)c->data;
+			c->data = NULL;
+
+			if(len > PASS_MAX){
+				free(a);
+				return 0;
+			}
+
+			// Not checked, see "Local peers" above
+			if(!local_trusted(c)){
+				free(a);
 
-						return 0;
-					}
+				c->state = CONN_WAITING;
+				NetConnDeadline(c, IDLE_TIMEOUT);
+
+				return NetConnQueueStr(c, "DENIED");
+			}
 
-					pthread_create(&mthread, NULL, handle_client, (void*)&client);
-					pthread_join(mthread, NULL);
+			memcpy(a->pass, data, len);
 
-					FD_SET(client, &active_fd);
-				} else{
-					// do socket handling stuff here
+			a->job.run = auth_run;
+			a->job.done = auth_done;
 
-					close(client);
-					FD_CLR(client, &active_fd);
-				}
+			if(!PoolSubmit(&pool, l, c, &a->job)){
+				memset(a, 0, sizeof(authjob));
+				free(a);
+
+				c->state = CONN_WAITING;
+				NetConnDeadline(c, IDLE_TIMEOUT);
+
+				return NetConnQueueStr(c, "BUSY");
 			}
-		}
+
+			c->state = CONN_AUTH;
+			NetConnDeadline(c, 0);
+
+			return 1;
+	}
+
+	// Nothing else should come in
+	return 0;
+}
+
+void on_close(NetLoop *l, NetConn *c){
+	// Username came in but no password, or pipeline state
+	if(c->data){
+		free(c->data);
+		c->data = NULL;
+	}
+
+	// Last one out shows the stats
+	if(!l->conns){
+		NetLoopStats(l);
+#ifdef NET_URING
+		NetRingStats(l);
+#endif
+		NetStatsPrint();
+		PoolStats(&pool);
+		SpCacheStats();
+	}
+}
+
+int main(int argc, char *argv[]){
+	NetShard *shards = NULL;
+	sigset_t set;
+
+	int n = 0, i = 0, backlog = 0, budget = 0;
+
+	if(argc < 3){
+		printf("Usage: %s <address | unix:/path> <port> [workers] [queue depth] [shards] [backlog] [budget]\n", argv[0]);
+		return 0;
+	}
+
+	NetRaiseFdLimit();
+
+	n = (argc > 5) ? atoi(argv[5]) : 0;
+	backlog = (argc > 6) ? atoi(argv[6]) : 0;
+	budget = (argc > 7) ? atoi(argv[7]) : 0;
+
+	if(n <= 0)
+		n = NetShardCount();
+
+	// Only this thread gets SIGUSR1 (the shards & workers inherit the mask)
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	// Password hashes come out of memory from here on (see spcache.h)
+	if(!SpCacheStart(SP_CACHE_PATH))
+		D(("Not indexing %s, logins will read it every time", SP_CACHE_PATH));
+
+	// Only the header is looked at, however many accounts there are
+	if(acctdb_open(&accounts, ACCOUNTS_DB)){
+		D(("%s: %lu accounts", ACCOUNTS_DB, (unsigned long)accounts.hdr->count));
+
+		auth_backend_add(ACCOUNTS_DB, accounts_lookup, &accounts);
+	}
+
+	auth_backend_add(SP_CACHE_PATH, cache_lookup, NULL);
+
+	if(!PoolInit(&pool, (argc > 3) ? atoi(argv[3]) : 0, (argc > 4) ? atoi(argv[4]) : 0))
+		return 0;
+
+	if(!(shards = (NetShard*)calloc(n, sizeof(NetShard))))
+		return 0;
+
+	for(i = 0; i < n; i++){
+		shards[i].on_open = on_open;
+		shards[i].on_frame = on_frame;
+		shards[i].on_close = on_close;
+
+		shards[i].maxframe = FRAME_MAX;
+		shards[i].budget = budget;
+	}
+
+	if(!NetShardStart(shards, n, argv[1], atoi(argv[2]), backlog)){
+		D(("Unable to create socket for server.  Exiting."));
+
+		return 0;
+	}
+
+	// kill -USR1 shows how the connections are spread over the shards
+	while(1){
+		if(sigwaitinfo(&set, NULL) == -1)
+			continue;
+
+		NetShardStats(shards, n);
+		PoolStats(&pool);
+		SpCacheStats();
 	}
 
 	return 0;
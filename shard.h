@@ -0,0 +1,211 @@
+/****************************
+ * Shard.h
+ *
+ * Runs one event loop per core.
+ *
+ * With one listening socket, one thread accepts every connection, and a burst can fill its
+ * backlog before it gets to them.  Here every shard has its own listening socket on the same
+ * address (SO_REUSEPORT), so the kernel spreads new connections across the shards' accept
+ * queues.  Each shard has its own loop on its own thread (pinned to a core), and a connection
+ * stays on the shard that accepted it until it's closed, so shards never share connections.
+ *
+ * Unix sockets can't do SO_REUSEPORT, so for those one listening socket is made and every shard
+ * waits on its own copy of it (dup()): they still spread the load, the first shard to get to a
+ * connection takes it.
+ *
+ * NetShardStats() shows how many connections each shard has accepted, to check the balance.
+ ****************************/
+#ifndef __SHARD_H
+#define __SHARD_H
+
+#include <sched.h>
+#include "event.h"
+
+typedef struct __netshard {
+	int id;
+	int cpu;
+
+	NetLoop loop;
+	pthread_t thread;
+
+	// Where to listen
+	char *addr;
+	int port;
+	int backlog;
+	int reuseport;
+
+	// Listening socket every shard shares (unix sockets, -1 = each listens on its own)
+	int shared;
+
+	// Per-connection limits (see NetLoopLimits(), 0 = defaults)
+	int maxframe;
+	int budget;
+
+	int (*on_open)(NetLoop *l, NetConn *c);
+	int (*on_frame)(NetLoop *l, NetConn *c, char *data, int len);
+	void (*on_close)(NetLoop *l, NetConn *c);
+
+	// Set once the shard is listening (or failed to)
+	int ready;
+	int ok;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} NetShard;
+
+/**
+ * NetShardThread()
+ * arg:	Shard this thread runs	[in]
+ **/
+void *NetShardThread(void *arg){
+	NetShard *s = (NetShard*)arg;
+	cpu_set_t set;
+	int sock = 0;
+
+	CPU_ZERO(&set);
+	CPU_SET(s->cpu, &set);
+
+	if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		D(("Shard %d couldn't be pinned to CPU %d", s->id, s->cpu));
+
+	if(s->shared != -1){
+		if((sock = dup(s->shared)) == -1)
+			sock = 0;
+	} else
+		sock = NetServerListen(s->addr, s->port, s->backlog, s->reuseport);
+
+	if(sock && NetLoopInit(&s->loop, sock)){
+		s->loop.on_open = s->on_open;
+		s->loop.on_frame = s->on_frame;
+		s->loop.on_close = s->on_close;
+		s->loop.id = s->id;
+
+		NetLoopLimits(&s->loop, s->maxframe, s->budget);
+
+		s->ok = 1;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->ready = 1;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	if(!s->ok){
+		if(sock)
+			close(sock);
+
+		return NULL;
+	}
+
+	NetLoopRun(&s->loop);
+
+	close(sock);
+
+	return NULL;
+}
+
+/**
+ * NetShardCount()
+ *
+ * Returns the number of CPUs this process can run on.
+ **/
+int NetShardCount(){
+	cpu_set_t set;
+
+	if(sched_getaffinity(0, sizeof(set), &set) == 0)
+		return CPU_COUNT(&set);
+
+	return 1;
+}
+
+/**
+ * NetShardStart()
+ * shards:	Shards to start (handlers & limits set, see NetShard)	[in/out]
+ * n:		Number of shards (0 = one per CPU)		[in]
+ * addr:	Address to listen on				[in]
+ * port:	Port to listen on				[in]
+ * backlog:	listen() backlog for each shard (0 = default)	[in]
+ *
+ * Starts each shard on its own thread, and waits until they're all listening.
+ *
+ * Returns 0 if any shard failed to start, 1 on success.
+ **/
+int NetShardStart(NetShard *shards, int n, char *addr, int port, int backlog){
+	cpu_set_t set;
+	int i = 0, cpus = 0, ok = 1, shared = -1;
+	int cpu[CPU_SETSIZE];
+
+	// Pin to the CPUs we're allowed on, in order
+	sched_getaffinity(0, sizeof(set), &set);
+
+	for(i = 0; i < CPU_SETSIZE; i++)
+		if(CPU_ISSET(i, &set))
+			cpu[cpus++] = i;
+
+	if(!cpus)
+		cpu[cpus++] = 0;
+
+	if(NetAddrUnix(addr) && (n > 1) && !(shared = NetServerListen(addr, port, backlog, 0)))
+		return 0;
+
+	for(i = 0; i < n; i++){
+		NetShard *s = &shards[i];
+
+		s->id = i;
+		s->cpu = cpu[i % cpus];
+		s->addr = addr;
+		s->port = port;
+		s->backlog = backlog;
+		s->reuseport = (n > 1);
+		s->shared = shared;
+		s->ready = s->ok = 0;
+
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+
+		if(pthread_create(&s->thread, NULL, NetShardThread, s) != 0){
+			perror("pthread_create()");
+			return 0;
+		}
+
+		pthread_mutex_lock(&s->lock);
+
+		while(!s->ready)
+			pthread_cond_wait(&s->cond, &s->lock);
+
+		pthread_mutex_unlock(&s->lock);
+
+		ok = ok && s->ok;
+	}
+
+	// Every shard has its own copy
+	if(shared != -1)
+		close(shared);
+
+	D(("Started %d shards on %s:%d", n, addr, port));
+
+	return ok;
+}
+
+/**
+ * NetShardStats()
+ * shards:	Shards to show stats of	[in]
+ * n:		Number of shards	[in]
+ *
+ * Shows each shard's share of the accepted connections.
+ **/
+void NetShardStats(NetShard *shards, int n){
+	uint64_t accepted[CPU_SETSIZE], total = 0;
+	int i = 0;
+
+	for(i = 0; (i < n) && (i < CPU_SETSIZE); i++){
+		accepted[i] = __atomic_load_n(&shards[i].loop.accepted, __ATOMIC_RELAXED);
+		total += accepted[i];
+	}
+
+	for(i = 0; (i < n) && (i < CPU_SETSIZE); i++)
+		D(("Shard %d (CPU %d): %lu accepted (%.1f%%), %lu open, peak %lu", i, shards[i].cpu, accepted[i],
+			total ? (100.0 * accepted[i]) / total : 0.0,
+			__atomic_load_n(&shards[i].loop.conns, __ATOMIC_RELAXED), shards[i].loop.peak));
+}
+
+#endif
@@ -0,0 +1,825 @@
+/****************************
+ * ShmRing.h
+ *
+ * Shared memory transport for clients on the same host (included by event.h).
+ *
+ * Even over a unix socket every request is a send() & recv() on each side, and two copies
+ * through the kernel.  Here client & server share a segment (memfd) holding two single-producer,
+ * single-consumer rings, one each way, carrying the same frames the sockets do (see NetSendn()).
+ * Sending a frame is a copy and a store of the ring's tail.  The reader only has to be woken
+ * (futex) if it went to sleep, and it only sleeps on an empty ring.  A writer that finds the ring
+ * full sleeps the same way (clients only, the server never waits on a client).
+ *
+ * Setting up: a trusted local peer (see server.c) sends SHMRING over its unix socket, and the
+ * server answers SHMRING with the segment's fd attached (SCM_RIGHTS).  The socket stays open,
+ * it's how either side finds out the other one is gone.
+ *
+ * On the server the rings go through the loop like a socket does: a doorbell thread per
+ * connection sleeps on the request ring and posts a task to the loop when frames come in, which
+ * hands them to on_frame().  What the connection queues goes into the answer ring instead of the
+ * socket (see NetShmFlush()).  So the server isn't syscall-free: every batch costs a futex wake
+ * of the doorbell (if it was asleep), a post to the loop (eventfd write & the loop waking up) and
+ * a futex wake back once it's drained.  A batch is everything in the ring by the time the loop
+ * gets to it, so the busier the connection, the more frames share that cost.
+ *
+ * It's a thread per connection because a futex only waits on one word, and there's one per ring.
+ * They're meant for a few long-lived trusted local peers (e.g. an AuthPool's connections), not
+ * for every client.  Closing doesn't wait for the thread: it's told to stop, and its last act is
+ * to post the rings back to the loop to be freed (see NetShmClose()).
+ *
+ * Neither side trusts what the other one writes in the segment: positions are kept locally, and
+ * anything that doesn't add up closes the connection.
+ ****************************/
+#ifndef __SHMRING_H
+#define __SHMRING_H
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define NET_SHM_RING	(64 * 1024)	// Default bytes in each ring (power of 2)
+#define NET_SHM_MAGIC	0x52484356	// "VCHR"
+#define NET_SHM_WAIT	100		// ms a client sleeps before checking the server is still there
+
+/**
+ * struct __netshmring {}
+ *
+ * One direction's positions (in the segment).  Positions only ever go up, the offset in the
+ * ring is position % size.
+ **/
+typedef struct __netshmring {
+	// Reader's side
+	uint64_t head __attribute__((aligned(64)));
+	uint32_t sleeping;	// Reader is waiting on data
+	uint32_t data;		// Futex, bumped to wake it
+
+	// Writer's side
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t full;		// Writer is waiting on room
+	uint32_t room;		// Futex, bumped to wake it
+} NetShmRing;
+
+/**
+ * struct __netshmseg {}
+ *
+ * Start of the segment.  The rings' data follows at NET_SHM_DATA, client to server first.
+ **/
+typedef struct __netshmseg {
+	uint32_t magic;
+	uint32_t size;
+
+	NetShmRing ring[2];
+} NetShmSeg;
+
+#define NET_SHM_DATA	((sizeof(NetShmSeg) + 4095) & ~(size_t)4095)
+
+/**
+ * struct __netshm {}
+ *
+ * One side's view of a segment.
+ **/
+typedef struct __netshm {
+	NetShmSeg *seg;
+	size_t len;
+	uint32_t size;
+
+	// Ring we read & the one we write, with our own copies of where we are in them
+	NetShmRing *in;
+	NetShmRing *out;
+	char *inbuf;
+	char *outbuf;
+	uint64_t rpos;
+	uint64_t wpos;
+
+	// Socket the segment was set up over
+	int sock;
+} NetShm;
+
+/**
+ * NetFutexWait()
+ * addr:	Futex word			[in]
+ * val:		Sleep only if it's still this	[in]
+ * ms:		Longest to sleep (-1 = forever)	[in]
+ * private:	Word isn't shared between processes	[in]
+ *
+ * Returns 0 if it was woken (or the word had changed), -1 on timeout/error.
+ **/
+int NetFutexWait(uint32_t *addr, uint32_t val, int ms, int private){
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+
+	if((syscall(SYS_futex, addr, private ? FUTEX_WAIT_PRIVATE : FUTEX_WAIT, val, (ms >= 0) ? &ts : NULL, NULL, 0) == -1) &&
+	   (errno != EAGAIN) && (errno != EINTR))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * NetFutexWake()
+ * addr:	Futex word to bump & wake on		[in/out]
+ * private:	Word isn't shared between processes	[in]
+ **/
+void NetFutexWake(uint32_t *addr, int private){
+	__atomic_fetch_add(addr, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, addr, private ? FUTEX_WAKE_PRIVATE : FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * NetShmMap()
+ * s:		Where to put the mapping		[out]
+ * fd:		Segment (memfd)				[in]
+ * server:	Map it as the server (else the client)	[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetShmMap(NetShm *s, int fd, int server){
+	struct stat st;
+	uint32_t size = 0;
+
+	memset(s, 0, sizeof(NetShm));
+	s->sock = -1;
+
+	if((fstat(fd, &st) == -1) || (st.st_size <= (off_t)NET_SHM_DATA))
+		return 0;
+
+	// Size comes from the file, the segment's copy is only checked against it
+	size = (st.st_size - NET_SHM_DATA) / 2;
+
+	if((size < 4096) || (size & (size - 1)) || ((off_t)(NET_SHM_DATA + ((size_t)size * 2)) != st.st_size))
+		return 0;
+
+	if((s->seg = (NetShmSeg*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+		perror("mmap()");
+		s->seg = NULL;
+		return 0;
+	}
+
+	s->len = st.st_size;
+	s->size = size;
+
+	if((s->seg->magic != NET_SHM_MAGIC) || (s->seg->size != size)){
+		munmap(s->seg, s->len);
+		s->seg = NULL;
+		return 0;
+	}
+
+	s->in = &s->seg->ring[server ? 0 : 1];
+	s->out = &s->seg->ring[server ? 1 : 0];
+	s->inbuf = (char*)s->seg + NET_SHM_DATA + (server ? 0 : size);
+	s->outbuf = (char*)s->seg + NET_SHM_DATA + (server ? size : 0);
+
+	return 1;
+}
+
+/**
+ * NetShmCreate()
+ * s:		Where to put the server's mapping	[out]
+ * size:	Bytes in each ring (0 = default)	[in]
+ *
+ * Returns the segment's fd (to hand to the client, then close), or -1 on failure.
+ **/
+int NetShmCreate(NetShm *s, int size){
+	NetShmSeg seg;
+	int fd = -1;
+
+	if(size <= 0)
+		size = NET_SHM_RING;
+
+	if((fd = memfd_create("vc-shmring", MFD_CLOEXEC)) == -1){
+		perror("memfd_create()");
+		return -1;
+	}
+
+	memset(&seg, 0, sizeof(seg));
+	seg.magic = NET_SHM_MAGIC;
+	seg.size = size;
+
+	if((ftruncate(fd, NET_SHM_DATA + ((size_t)size * 2)) == -1) || (pwrite(fd, &seg, sizeof(seg), 0) != sizeof(seg)) ||
+	   !NetShmMap(s, fd, 1)){
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * NetShmUnmap()
+ * s:	Segment to let go of	[in/out]
+ **/
+void NetShmUnmap(NetShm *s){
+	if(s->seg)
+		munmap(s->seg, s->len);
+
+	s->seg = NULL;
+}
+
+/**
+ * NetShmCopyIn()
+ *
+ * Copies n bytes to the out ring at position pos, wrapping around its end.
+ **/
+void NetShmCopyIn(NetShm *s, uint64_t pos, const char *data, uint32_t n){
+	uint32_t off = pos & (s->size - 1), first = ((s->size - off) < n) ? (s->size - off) : n;
+
+	memcpy(s->outbuf + off, data, first);
+	memcpy(s->outbuf, data + first, n - first);
+}
+
+/**
+ * NetShmCopyOut()
+ *
+ * Copies n bytes from the in ring at position pos, wrapping around its end.
+ **/
+void NetShmCopyOut(NetShm *s, uint64_t pos, char *data, uint32_t n){
+	uint32_t off = pos & (s->size - 1), first = ((s->size - off) < n) ? (s->size - off) : n;
+
+	memcpy(data, s->inbuf + off, first);
+	memcpy(data + first, s->inbuf, n - first);
+}
+
+/**
+ * NetShmRoom()
+ * s:	Segment to write to	[in]
+ *
+ * Returns the free bytes in the out ring, or -1 if the reader's head makes no sense.
+ **/
+int64_t NetShmRoom(NetShm *s){
+	uint64_t head = __atomic_load_n(&s->out->head, __ATOMIC_ACQUIRE);
+
+	if((head > s->wpos) || ((s->wpos - head) > s->size))
+		return -1;
+
+	return s->size - (s->wpos - head);
+}
+
+/**
+ * NetShmPublish()
+ * s:	Segment written to		[in/out]
+ * n:	Bytes copied in past the tail	[in]
+ *
+ * Makes them visible to the reader, and wakes it if it's asleep.
+ **/
+void NetShmPublish(NetShm *s, uint32_t n){
+	s->wpos += n;
+
+	// Has to be ordered against reading the flag (the reader does the opposite, see NetShmWaitData())
+	__atomic_store_n(&s->out->tail, s->wpos, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&s->out->sleeping, __ATOMIC_SEQ_CST))
+		NetFutexWake(&s->out->data, 0);
+}
+
+/**
+ * NetShmWrite()
+ * s:		Segment to write to	[in/out]
+ * data:	Framed bytes		[in]
+ * n:		Number of bytes		[in]
+ *
+ * Returns 1 on success, 0 if there isn't room, -1 if the segment is broken.
+ **/
+int NetShmWrite(NetShm *s, const char *data, uint32_t n){
+	int64_t room = NetShmRoom(s);
+
+	if(room < 0)
+		return -1;
+
+	if(room < n)
+		return 0;
+
+	NetShmCopyIn(s, s->wpos, data, n);
+	NetShmPublish(s, n);
+
+	return 1;
+}
+
+/**
+ * NetShmPut()
+ * s:		Segment to write to	[in/out]
+ * data:	Data to send		[in]
+ * len:		Number of bytes in data	[in]
+ *
+ * Writes a frame (header & data) to the out ring.
+ *
+ * Returns 1 on success, 0 if there isn't room, -1 on failure.
+ **/
+int NetShmPut(NetShm *s, const char *data, int len){
+	char hdr[NET_HDRLEN + 1];
+	int64_t room = 0;
+
+	if((len < 0) || (len > NET_MAXFRAME) || ((NET_HDRLEN + len) > (int)s->size))
+		return -1;
+
+	if((room = NetShmRoom(s)) < 0)
+		return -1;
+
+	if(room < (NET_HDRLEN + len))
+		return 0;
+
+	snprintf(hdr, sizeof(hdr), "%0*d", NET_HDRLEN, len);
+
+	NetShmCopyIn(s, s->wpos, hdr, NET_HDRLEN);
+	NetShmCopyIn(s, s->wpos + NET_HDRLEN, data, len);
+	NetShmPublish(s, NET_HDRLEN + len);
+
+	return 1;
+}
+
+/**
+ * NetShmReady()
+ * s:	Segment to read from	[in]
+ *
+ * Returns 1 if there's something in the in ring.
+ **/
+int NetShmReady(NetShm *s){
+	return __atomic_load_n(&s->in->tail, __ATOMIC_ACQUIRE) != s->rpos;
+}
+
+/**
+ * NetShmNext()
+ * s:		Segment to read from		[in/out]
+ * buff:	Where to copy the frame		[out]
+ * size:	Size of buff			[in]
+ * len:		Set to the length of the frame	[out]
+ *
+ * Takes the next frame out of the in ring (\0 terminated).  Frames are published whole, so
+ * there's never half of one.
+ *
+ * Returns 1 if a frame was found, 0 if the ring is empty, -1 if the data isn't a valid frame.
+ **/
+int NetShmNext(NetShm *s, char *buff, int size, int *len){
+	char hdr[NET_HDRLEN];
+	uint64_t tail = __atomic_load_n(&s->in->tail, __ATOMIC_ACQUIRE), avail = tail - s->rpos;
+	int n = 0, i = 0;
+
+	if(!avail)
+		return 0;
+
+	if((tail < s->rpos) || (avail > s->size) || (avail < NET_HDRLEN))
+		return -1;
+
+	NetShmCopyOut(s, s->rpos, hdr, NET_HDRLEN);
+
+	for(i = 0; i < NET_HDRLEN; i++){
+		if((hdr[i] < '0') || (hdr[i] > '9'))
+			return -1;
+
+		n = (n * 10) + (hdr[i] - '0');
+	}
+
+	if((n >= size) || ((uint64_t)(NET_HDRLEN + n) > avail))
+		return -1;
+
+	NetShmCopyOut(s, s->rpos + NET_HDRLEN, buff, n);
+	buff[n] = '\0';
+
+	s->rpos += NET_HDRLEN + n;
+	*len = n;
+
+	__atomic_store_n(&s->in->head, s->rpos, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&s->in->full, __ATOMIC_SEQ_CST))
+		NetFutexWake(&s->in->room, 0);
+
+	NetStatsAdd(frames_recv);
+
+	return 1;
+}
+
+/**
+ * NetShmWaitData()
+ * s:		Segment to wait on			[in/out]
+ * stop:	Don't sleep if this is set (or NULL)	[in]
+ * ms:		Longest to sleep (-1 = forever)		[in]
+ *
+ * Sleeps until the in ring has something in it.
+ *
+ * Returns 0 if it timed out, 1 otherwise (something may have come in).
+ **/
+int NetShmWaitData(NetShm *s, int *stop, int ms){
+	uint32_t seq = __atomic_load_n(&s->in->data, __ATOMIC_ACQUIRE);
+	int ret = 1;
+
+	// Flag first, then look again: either we see the new tail, or the writer sees the flag
+	__atomic_store_n(&s->in->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	if((__atomic_load_n(&s->in->tail, __ATOMIC_SEQ_CST) == s->rpos) && !(stop && __atomic_load_n(stop, __ATOMIC_ACQUIRE)))
+		ret = (NetFutexWait(&s->in->data, seq, ms, 0) == 0);
+
+	__atomic_store_n(&s->in->sleeping, 0, __ATOMIC_RELAXED);
+
+	return ret;
+}
+
+/**
+ * NetShmWaitRoom()
+ * s:		Segment to wait on		[in/out]
+ * need:	Bytes that have to fit		[in]
+ * ms:		Longest to sleep (-1 = forever)	[in]
+ *
+ * Returns 0 if it timed out, 1 otherwise.
+ **/
+int NetShmWaitRoom(NetShm *s, int need, int ms){
+	uint32_t seq = __atomic_load_n(&s->out->room, __ATOMIC_ACQUIRE);
+	int ret = 1;
+
+	__atomic_store_n(&s->out->full, 1, __ATOMIC_SEQ_CST);
+
+	if((NetShmRoom(s) >= 0) && (NetShmRoom(s) < need))
+		ret = (NetFutexWait(&s->out->room, seq, ms, 0) == 0);
+
+	__atomic_store_n(&s->out->full, 0, __ATOMIC_RELAXED);
+
+	return ret;
+}
+
+/**
+ * NetShmAlive()
+ * s:	Segment to check	[in]
+ *
+ * Returns 1 if the other side's socket is still open.
+ **/
+int NetShmAlive(NetShm *s){
+	struct pollfd p;
+
+	p.fd = s->sock;
+	p.events = POLLRDHUP;
+	p.revents = 0;
+
+	return (poll(&p, 1, 0) == 0);
+}
+
+/**
+ * NetShmConnect()
+ * sock:	Unix socket the server sent LOCAL on	[in]
+ * s:		Where to put the segment		[out]
+ *
+ * Asks the server to move the connection over to shared memory (see above), and maps the segment
+ * it sends back.  From then on, frames go through NetShmSend() & NetShmRecv().
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetShmConnect(int sock, NetShm *s){
+	char buff[NET_HDRLEN + 8], ctl[CMSG_SPACE(sizeof(int))];
+	const char *want = "0007SHMRING";
+	struct cmsghdr *cm = NULL;
+	struct msghdr msg;
+	struct iovec iov;
+	int fd = -1, got = 0, n = 0, ok = 0;
+
+	if(!NetSend(sock, "SHMRING"))
+		return 0;
+
+	// The fd comes with the first byte of the answer
+	while(got < (int)strlen(want)){
+		memset(&msg, 0, sizeof(msg));
+
+		iov.iov_base = buff + got;
+		iov.iov_len = strlen(want) - got;
+
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl;
+		msg.msg_controllen = sizeof(ctl);
+
+		if((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) <= 0){
+			if((n == -1) && (errno == EINTR))
+				continue;
+
+			break;
+		}
+
+		for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+			if((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_RIGHTS) && (fd == -1))
+				memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+
+		got += n;
+	}
+
+	if((got == (int)strlen(want)) && !memcmp(buff, want, got) && (fd != -1))
+		ok = NetShmMap(s, fd, 0);
+
+	if(fd != -1)
+		close(fd);
+
+	if(!ok){
+		D(("Server didn't give socket %d a shared memory ring", sock));
+		return 0;
+	}
+
+	s->sock = sock;
+
+	D(("Socket %d moved to a shared memory ring (%u bytes each way)", sock, s->size));
+
+	return 1;
+}
+
+/**
+ * NetShmSend()
+ * s:		Segment to send on	[in/out]
+ * data:	Data to send		[in]
+ * len:		Number of bytes in data	[in]
+ *
+ * Sends a frame, waiting for room if the ring is full.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetShmSend(NetShm *s, const char *data, int len){
+	int ret = 0;
+
+	while(!(ret = NetShmPut(s, data, len)))
+		if(!NetShmWaitRoom(s, NET_HDRLEN + len, NET_SHM_WAIT) && !NetShmAlive(s))
+			return 0;
+
+	if(ret == 1)
+		NetStatsAdd(frames_sent);
+
+	return (ret == 1);
+}
+
+/**
+ * NetShmRecv()
+ * s:		Segment to read from		[in/out]
+ * buff:	Buffer to copy the frame into	[out]
+ * size:	Size of buff			[in]
+ *
+ * Blocking, like NetReaderRecv().
+ *
+ * Returns the number of bytes of data received, or -1 on failure.
+ **/
+int NetShmRecv(NetShm *s, char *buff, int size){
+	int len = 0, ret = 0;
+
+	while(!(ret = NetShmNext(s, buff, size, &len)))
+		if(!NetShmWaitData(s, NULL, NET_SHM_WAIT) && !NetShmAlive(s))
+			return -1;
+
+	return (ret == 1) ? len : -1;
+}
+
+/**
+ * struct __netshmconn {}
+ *
+ * Server side of a connection that's moved to shared memory (NetConn.shm).
+ **/
+struct __netshmconn {
+	// Must be first, the drain gets to the loop as a NetTask
+	NetTask task;
+
+	NetShm shm;
+
+	NetLoop *loop;
+	NetConn *conn;
+
+	// Frame being handed to on_frame() (loop's max frame size)
+	char *frame;
+
+	// Doorbell thread: stop, the loop's done with the last drain
+	pthread_t thread;
+	int stop;
+	uint32_t drained;
+
+	// Posted by the doorbell as it exits, frees all of this on the loop's thread
+	NetTask done;
+};
+
+/**
+ * NetShmRelease()
+ * l:	Loop the connection belongs to	[in/out]
+ * sh:	Rings to free			[in]
+ **/
+void NetShmRelease(NetLoop *l, NetShmConn *sh){
+	NetConn *c = sh->conn;
+
+	c->shm = NULL;
+
+	NetShmUnmap(&sh->shm);
+
+	free(sh->frame);
+	free(sh);
+
+	NetConnRelease(l, c);
+}
+
+/**
+ * NetShmDrain()
+ * l:	Loop the connection belongs to	[in/out]
+ * t:	The connection's NetShmConn	[in]
+ *
+ * Hands everything in the request ring to on_frame(), then sends what came of it.
+ **/
+void NetShmDrain(NetLoop *l, NetTask *t){
+	NetShmConn *sh = (NetShmConn*)t;
+	NetConn *c = sh->conn;
+	int len = 0, ret = 0;
+
+	// Closed while this was on its way, the doorbell's done task frees it (it comes after this)
+	if(c->closed)
+		return;
+
+	while(!c->closed && ((ret = NetShmNext(&sh->shm, sh->frame, l->maxframe + 1, &len)) == 1)){
+		if(!l->on_frame(l, c, sh->frame, len)){
+			ret = -1;
+			break;
+		}
+	}
+
+	if(ret == -1){
+		NetConnClose(l, c);
+		return;
+	}
+
+	// Everything answered right away goes out together
+	NetConnUpdate(l, c);
+
+	if(!c->closed){
+		__atomic_store_n(&sh->drained, 1, __ATOMIC_RELEASE);
+		NetFutexWake(&sh->drained, 1);
+	}
+}
+
+/**
+ * NetShmDone()
+ * l:	Loop the connection belongs to		[in/out]
+ * t:	The NetShmConn's done task		[in]
+ *
+ * The doorbell has exited, nothing else can point at the rings.
+ **/
+void NetShmDone(NetLoop *l, NetTask *t){
+	NetShmRelease(l, (NetShmConn*)((char*)t - offsetof(NetShmConn, done)));
+}
+
+/**
+ * NetShmDoorbell()
+ * arg:	Connection's NetShmConn	[in]
+ *
+ * Sleeps on the request ring, and posts a drain to the loop whenever something comes in.  Only
+ * one drain is out at a time: the next one waits until the loop has emptied the ring.  Once
+ * it's stopped, it posts the done task and doesn't touch sh again.
+ **/
+void *NetShmDoorbell(void *arg){
+	NetShmConn *sh = (NetShmConn*)arg;
+
+	while(!__atomic_load_n(&sh->stop, __ATOMIC_ACQUIRE)){
+		if(!NetShmReady(&sh->shm)){
+			NetShmWaitData(&sh->shm, &sh->stop, -1);
+			continue;
+		}
+
+		__atomic_store_n(&sh->drained, 0, __ATOMIC_RELEASE);
+
+		NetLoopPost(sh->loop, &sh->task);
+
+		while(!__atomic_load_n(&sh->drained, __ATOMIC_ACQUIRE) && !__atomic_load_n(&sh->stop, __ATOMIC_ACQUIRE))
+			NetFutexWait(&sh->drained, 0, -1, 1);
+	}
+
+	// Tasks run in the order they're posted, so a drain that's still on its way runs first
+	NetLoopPost(sh->loop, &sh->done);
+
+	return NULL;
+}
+
+/**
+ * NetShmSendFd()
+ * sock:	Socket to send on	[in]
+ * fd:		fd to pass along	[in]
+ * data:	Frame it goes with	[in]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetShmSendFd(int sock, int fd, const char *data){
+	char buff[NET_HDRLEN + 64], ctl[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cm = NULL;
+	struct msghdr msg;
+	struct iovec iov;
+	int len = snprintf(buff, sizeof(buff), "%0*d%s", NET_HDRLEN, (int)strlen(data), data);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(ctl, 0, sizeof(ctl));
+
+	iov.iov_base = buff;
+	iov.iov_len = len;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+	NetStatsAdd(sends);
+
+	return (sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == len);
+}
+
+/**
+ * NetShmAccept()
+ * l:		Loop the connection belongs to		[in/out]
+ * c:		Connection that asked for SHMRING	[in/out]
+ * size:	Bytes in each ring (0 = default)	[in]
+ *
+ * Moves c over to shared memory (see above).  Nothing can be waiting to go out on the socket,
+ * the answer has to be next.  Loop's thread only.
+ *
+ * Returns 0 on failure (connection should be closed), 1 on success.
+ **/
+int NetShmAccept(NetLoop *l, NetConn *c, int size){
+	NetShmConn *sh = NULL;
+	int fd = -1;
+
+	if(c->shm || (c->outpos < c->outlen))
+		return 0;
+
+	if(!(sh = (NetShmConn*)calloc(1, sizeof(NetShmConn))) || !(sh->frame = (char*)malloc(l->maxframe + 1)))
+		goto fail;
+
+	if((fd = NetShmCreate(&sh->shm, size)) == -1)
+		goto fail;
+
+	sh->task.fn = NetShmDrain;
+	sh->done.fn = NetShmDone;
+	sh->loop = l;
+	sh->conn = c;
+
+	if(!NetShmSendFd(c->fd, fd, "SHMRING") || (pthread_create(&sh->thread, NULL, NetShmDoorbell, sh) != 0))
+		goto fail;
+
+	// Nobody waits for it, see NetShmClose()
+	pthread_detach(sh->thread);
+
+	close(fd);
+
+	// Held until the doorbell has exited (see NetShmDone())
+	NetConnHold(c);
+	c->shm = sh;
+
+	D(("%s moved to a shared memory ring (%u bytes each way)", c->ip, sh->shm.size));
+
+	return 1;
+
+fail:
+	if(fd != -1)
+		close(fd);
+
+	if(sh){
+		NetShmUnmap(&sh->shm);
+		free(sh->frame);
+		free(sh);
+	}
+
+	return 0;
+}
+
+/**
+ * NetShmFlush()
+ * c:	Connection on shared memory	[in/out]
+ *
+ * Moves what's queued (already framed) into the answer ring.
+ *
+ * Returns -1 if it doesn't fit (the client isn't reading) or the ring is broken, 1 otherwise.
+ **/
+int NetShmFlush(NetConn *c){
+	if(c->outpos >= c->outlen)
+		return 1;
+
+	if(NetShmWrite(&c->shm->shm, c->out + c->outpos, c->outlen - c->outpos) != 1){
+		D(("%s isn't reading its shared memory ring", c->ip));
+		return -1;
+	}
+
+	NetConnSent(c);
+
+	return 1;
+}
+
+/**
+ * NetShmClose()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection being closed		[in/out]
+ *
+ * Tells the doorbell to stop, without waiting for it (the loop carries on, the rings are freed
+ * once its done task comes in).  Called before c is marked closed.
+ **/
+void NetShmClose(NetLoop *l, NetConn *c){
+	NetShmConn *sh = c->shm;
+
+	__atomic_store_n(&sh->stop, 1, __ATOMIC_SEQ_CST);
+
+	// Wherever it's sleeping
+	NetFutexWake(&sh->shm.in->data, 0);
+
+	__atomic_store_n(&sh->drained, 1, __ATOMIC_RELEASE);
+	NetFutexWake(&sh->drained, 1);
+}
+
+#endif
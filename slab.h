@@ -0,0 +1,113 @@
+/****************************
+ * Slab.h
+ *
+ * Fixed-size buffers for connections' readers.
+ *
+ * A connection only needs a read buffer while part of a frame is sitting in it, most of the time
+ * it has nothing.  Each loop keeps a free list of same-sized slabs (HDRLEN + the loop's largest
+ * frame): a connection takes one when data comes in and gives it back as soon as every frame in
+ * it has been handled, so memory goes with how many connections are busy right now, not how many
+ * are open.  Up to NET_SLAB_KEEP free slabs are kept around for the next burst, past that they
+ * go back to the heap.
+ *
+ * Slabs belong to one loop, and are only touched from its thread (no locking).
+ ****************************/
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include "global.h"
+
+#define NET_SLAB_KEEP	1024	// Free slabs kept per loop
+
+typedef struct __netslabs {
+	int size;
+
+	// Free slabs, linked through their first bytes
+	void *free;
+	int nfree;
+
+	// Stats
+	uint64_t inuse;
+	uint64_t peak;
+	uint64_t allocs;
+} NetSlabs;
+
+/**
+ * NetSlabInit()
+ * s:		Slabs to set up		[out]
+ * size:	Size of each slab	[in]
+ **/
+void NetSlabInit(NetSlabs *s, int size){
+	memset(s, 0, sizeof(NetSlabs));
+
+	// Room for the free list's link, and keep them aligned
+	s->size = (size < (int)sizeof(void*)) ? (int)sizeof(void*) : size;
+	s->size = (s->size + 63) & ~63;
+}
+
+/**
+ * NetSlabGet()
+ * s:	Slabs to take from	[in/out]
+ *
+ * Returns a slab of s->size bytes, or NULL on failure.
+ **/
+char *NetSlabGet(NetSlabs *s){
+	void *p = NULL;
+
+	if((p = s->free)){
+		s->free = *(void**)p;
+		s->nfree--;
+	} else if((p = malloc(s->size)))
+		s->allocs++;
+	else
+		return NULL;
+
+	if(++s->inuse > s->peak)
+		s->peak = s->inuse;
+
+	return (char*)p;
+}
+
+/**
+ * NetSlabPut()
+ * s:	Slabs p came from	[in/out]
+ * p:	Slab to give back	[in]
+ *
+ * Whatever was in the slab is wiped (it could have held a password).
+ **/
+void NetSlabPut(NetSlabs *s, char *p){
+	if(!p)
+		return;
+
+	memset(p, '\0', s->size);
+
+	s->inuse--;
+
+	if(s->nfree >= NET_SLAB_KEEP){
+		free(p);
+		return;
+	}
+
+	*(void**)p = s->free;
+	s->free = p;
+	s->nfree++;
+}
+
+/**
+ * NetSlabFree()
+ * s:	Slabs to give back to the heap	[in/out]
+ *
+ * Frees the free list (slabs still in use are left alone).
+ **/
+void NetSlabFree(NetSlabs *s){
+	void *p = NULL;
+
+	while((p = s->free)){
+		s->free = *(void**)p;
+		free(p);
+	}
+
+	s->nfree = 0;
+}
+
+#endif
@@ -0,0 +1,496 @@
+/****************************
+ * SpCache.h
+ *
+ * In-memory index of /etc/shadow.
+ *
+ * getspnam_r() reads /etc/shadow from the top for every login, so a lookup costs a scan of the
+ * whole file.  Instead the file is read once into a hash table (username -> password hash), and
+ * a lookup is a probe or two into it, without taking any locks.
+ *
+ * When the file changes (inotify on its directory, since passwd & friends replace it with a
+ * rename), a new table is built off to the side and swapped in with one atomic exchange.  The
+ * old one is freed once no lookup can still be using it (RCU-style): a thread doing a lookup
+ * marks its slot in readers[] with the epoch it started in, and the reload waits until no slot
+ * is left in an older epoch.  Lookups never wait on a reload.
+ *
+ * A name that isn't in the table might still come from somewhere else (NIS, LDAP, ...), in which
+ * case the caller should ask getspnam_r().  If nsswitch.conf says shadow entries only come from
+ * files, a name that isn't in the table doesn't exist.
+ ****************************/
+#ifndef __SPCACHE_H
+#define __SPCACHE_H
+
+#include "global.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define SP_CACHE_PATH	"/etc/shadow"
+#define SP_NSSWITCH	"/etc/nsswitch.conf"
+
+#define SP_READERS	256	// Threads that can use the table (any more use getspnam_r())
+#define SP_SETTLE	50	// ms to let the rest of a change land before reloading
+
+typedef struct __spentry {
+	// FNV-1a of the name (0 = empty slot), and where the name & hash are in the table's text
+	uint64_t hash;
+	uint32_t name;
+	uint32_t pass;
+} SpEntry;
+
+typedef struct __sptable {
+	SpEntry *slots;
+	uint32_t mask;
+	uint32_t count;
+
+	// The file itself, with the name & hash of each line \0 terminated in place
+	char *text;
+	size_t size;
+} SpTable;
+
+typedef struct __spreader {
+	// Epoch the thread's lookup started in (0 = not looking anything up)
+	uint64_t epoch;
+
+	char pad[64 - sizeof(uint64_t)];
+} SpReader;
+
+typedef struct __spcache {
+	char path[PATH_MAX];
+
+	SpTable *table;
+	uint64_t epoch;
+
+	// Nothing but files in nsswitch.conf, so a name that isn't in the table isn't anywhere
+	int complete;
+
+	SpReader readers[SP_READERS];
+	int nreaders;
+
+	int fd;
+	pthread_t thread;
+
+	// Stats
+	uint32_t entries;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t unknown;
+	uint64_t reloads;
+	uint64_t failed;
+	uint64_t reload_ns;
+} SpCache;
+
+SpCache spcache;
+
+// This thread's slot in spcache.readers (-1 = hasn't asked for one, -2 = none left)
+__thread int sp_reader = -1;
+
+/**
+ * SpHash()
+ * s:	Name to hash	[in]
+ *
+ * FNV-1a, never 0 (that marks an empty slot).
+ **/
+uint64_t SpHash(const char *s){
+	uint64_t h = 14695981039346656037ULL;
+
+	while(*s){
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
+	}
+
+	return h ? h : 1;
+}
+
+/**
+ * SpTableFree()
+ * t:	Table nothing is using anymore	[in]
+ *
+ * Wipes the hashes before giving the memory back.
+ **/
+void SpTableFree(SpTable *t){
+	if(!t)
+		return;
+
+	memset(t->text, '\0', t->size);
+
+	free(t->text);
+	free(t->slots);
+	free(t);
+}
+
+/**
+ * SpTableBuild()
+ * path:	Shadow file to read	[in]
+ *
+ * Lines are "name:hash:...", NIS lines (+/-) and anything without a hash are skipped.  If a
+ * name is in there twice, the first one wins (same as getspnam()).
+ *
+ * Returns the table, or NULL on failure.
+ **/
+SpTable *SpTableBuild(const char *path){
+	struct stat st;
+	SpTable *t = NULL;
+	SpEntry *e = NULL;
+	char *line = NULL, *next = NULL, *name = NULL, *pass = NULL, *end = NULL;
+	uint32_t lines = 0, cap = 16;
+	ssize_t got = 0;
+	size_t pos = 0;
+	uint64_t h = 0;
+	int fd = -1;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1){
+		perror("open()");
+		return NULL;
+	}
+
+	if((fstat(fd, &st) == -1) || !(t = (SpTable*)calloc(1, sizeof(SpTable))))
+		goto fail;
+
+	t->size = st.st_size + 1;
+
+	if(!(t->text = (char*)malloc(t->size)))
+		goto fail;
+
+	while(pos < (size_t)st.st_size){
+		if((got = read(fd, t->text + pos, st.st_size - pos)) <= 0){
+			if((got == -1) && (errno == EINTR))
+				continue;
+
+			break;
+		}
+
+		pos += got;
+	}
+
+	t->text[pos] = '\0';
+
+	close(fd);
+	fd = -1;
+
+	for(line = t->text; *line; line++)
+		if(*line == '\n')
+			lines++;
+
+	// At most half full
+	while(cap < (lines + 1) * 2)
+		cap *= 2;
+
+	if(!(t->slots = (SpEntry*)calloc(cap, sizeof(SpEntry))))
+		goto fail;
+
+	t->mask = cap - 1;
+
+	for(line = t->text; line && *line; line = next){
+		if((next = strchr(line, '\n')))
+			*next++ = '\0';
+
+		if((*line == '+') || (*line == '-') || !(end = strchr(line, ':')))
+			continue;
+
+		*end = '\0';
+		name = line;
+		pass = end + 1;
+
+		if((end = strchr(pass, ':')))
+			*end = '\0';
+
+		if(!*name || !*pass)
+			continue;
+
+		h = SpHash(name);
+
+		for(e = &t->slots[h & t->mask]; e->hash; e = &t->slots[(e - t->slots + 1) & t->mask])
+			if((e->hash == h) && streq(t->text + e->name, name))
+				break;
+
+		if(e->hash)
+			continue;
+
+		e->hash = h;
+		e->name = name - t->text;
+		e->pass = pass - t->text;
+
+		t->count++;
+	}
+
+	return t;
+
+fail:
+	if(fd != -1)
+		close(fd);
+
+	if(t){
+		free(t->text);
+		free(t);
+	}
+
+	return NULL;
+}
+
+/**
+ * SpFilesOnly()
+ *
+ * Returns 1 if nsswitch.conf's shadow line (or passwd's, which shadow falls back on) only lists
+ * files, 0 otherwise.
+ **/
+int SpFilesOnly(){
+	char line[512], *tok = NULL, *save = NULL;
+	int files = 0, other = 0, found = 0;
+	FILE *fp = NULL;
+
+	if(!(fp = fopen(SP_NSSWITCH, "re")))
+		return 0;
+
+	while(!found && fgets(line, sizeof(line), fp)){
+		if(strneq(line, "shadow:", 7))
+			found = 1;
+		else if(!strneq(line, "passwd:", 7))
+			continue;
+
+		files = other = 0;
+
+		for(tok = strtok_r(line + 7, " \t\n", &save); tok && (*tok != '#'); tok = strtok_r(NULL, " \t\n", &save)){
+			if(streq(tok, "files"))
+				files = 1;
+			else if(*tok != '[')
+				other = 1;
+		}
+	}
+
+	fclose(fp);
+
+	return files && !other;
+}
+
+/**
+ * SpCacheSwap()
+ * t:	New table (NULL = none)	[in]
+ *
+ * Puts t in, and frees the old table once every lookup that could have seen it is done.
+ **/
+void SpCacheSwap(SpTable *t){
+	SpTable *old = __atomic_exchange_n(&spcache.table, t, __ATOMIC_SEQ_CST);
+	uint64_t epoch = __atomic_add_fetch(&spcache.epoch, 1, __ATOMIC_SEQ_CST), e = 0;
+	int n = __atomic_load_n(&spcache.nreaders, __ATOMIC_SEQ_CST), i = 0;
+
+	if(n > SP_READERS)
+		n = SP_READERS;
+
+	// Lookups are a few probes long, so this doesn't wait for long
+	for(i = 0; i < n; i++)
+		while((e = __atomic_load_n(&spcache.readers[i].epoch, __ATOMIC_SEQ_CST)) && (e < epoch))
+			sched_yield();
+
+	SpTableFree(old);
+}
+
+/**
+ * SpCacheReload()
+ *
+ * Builds a new table from the file and swaps it in.  If the file can't be read, the old table
+ * stays.
+ **/
+void SpCacheReload(){
+	struct timespec s, e;
+	SpTable *t = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+
+	spcache.complete = SpFilesOnly();
+
+	if(!(t = SpTableBuild(spcache.path))){
+		spcache.failed++;
+
+		D(("Unable to read %s, keeping the old index", spcache.path));
+		return;
+	}
+
+	spcache.entries = t->count;
+
+	SpCacheSwap(t);
+
+	clock_gettime(CLOCK_MONOTONIC, &e);
+
+	spcache.reloads++;
+	spcache.reload_ns = ((e.tv_sec - s.tv_sec) * 1000000000ULL) + e.tv_nsec - s.tv_nsec;
+
+	D(("Indexed %u entries from %s in %.2f ms", spcache.entries, spcache.path, spcache.reload_ns / 1e6));
+}
+
+/**
+ * SpCacheThread()
+ * arg:	Name of the file in the directory being watched	[in]
+ *
+ * Reloads the table whenever the file is written, replaced or removed.
+ **/
+void *SpCacheThread(void *arg){
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *name = (const char*)arg;
+	struct inotify_event *ev = NULL;
+	struct pollfd pfd;
+	ssize_t n = 0;
+	char *p = NULL;
+	int changed = 0;
+
+	pfd.fd = spcache.fd;
+	pfd.events = POLLIN;
+
+	while(1){
+		if((n = read(spcache.fd, buff, sizeof(buff))) <= 0){
+			if((n == -1) && (errno == EINTR))
+				continue;
+
+			perror("read()");
+			break;
+		}
+
+		for(p = buff; p < buff + n; p += sizeof(struct inotify_event) + ev->len){
+			ev = (struct inotify_event*)p;
+
+			if((ev->mask & IN_Q_OVERFLOW) || (ev->len && streq(ev->name, name)))
+				changed = 1;
+		}
+
+		if(!changed)
+			continue;
+
+		// Tools write a lock file, a copy & the new file one after the other, let them finish
+		while(poll(&pfd, 1, SP_SETTLE) > 0)
+			if(read(spcache.fd, buff, sizeof(buff)) <= 0)
+				break;
+
+		SpCacheReload();
+
+		changed = 0;
+	}
+
+	return NULL;
+}
+
+/**
+ * SpCacheStart()
+ * path:	Shadow file to index (SP_CACHE_PATH)	[in]
+ *
+ * Builds the table and starts watching for changes.  Lookups fall back to getspnam_r() if this
+ * fails (i.e.: not root).
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int SpCacheStart(const char *path){
+	static char name[NAME_MAX + 1];
+	char dir[PATH_MAX], *slash = NULL;
+
+	memset(&spcache, 0, sizeof(SpCache));
+
+	spcache.epoch = 1;
+	spcache.fd = -1;
+
+	snprintf(spcache.path, sizeof(spcache.path), "%s", path);
+	snprintf(dir, sizeof(dir), "%s", path);
+
+	if(!(slash = strrchr(dir, '/')) || !slash[1])
+		return 0;
+
+	snprintf(name, sizeof(name), "%s", slash + 1);
+
+	if(slash == dir)
+		slash++;
+
+	*slash = '\0';
+
+	SpCacheReload();
+
+	if(!spcache.table)
+		return 0;
+
+	// The file gets replaced rather than written to, so it's the directory that's watched
+	if(((spcache.fd = inotify_init1(IN_CLOEXEC)) == -1) ||
+		(inotify_add_watch(spcache.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) == -1)){
+		perror("inotify");
+		return 0;
+	}
+
+	if(pthread_create(&spcache.thread, NULL, SpCacheThread, name) != 0){
+		perror("pthread_create()");
+		return 0;
+	}
+
+	pthread_detach(spcache.thread);
+
+	return 1;
+}
+
+/**
+ * SpCacheFind()
+ * user:	Username to look up		[in]
+ * pass:	Buffer for the password hash	[out]
+ * size:	Size of pass			[in]
+ *
+ * Returns 1 if the user was found, 0 if there's no such user, -1 if the table can't say (not
+ * built, user might be somewhere other than the file, or this thread has no reader slot).
+ **/
+int SpCacheFind(const char *user, char *pass, size_t size){
+	SpReader *r = NULL;
+	SpTable *t = NULL;
+	SpEntry *e = NULL;
+	uint64_t h = SpHash(user);
+	int ret = -1;
+
+	if(sp_reader == -1){
+		sp_reader = __atomic_fetch_add(&spcache.nreaders, 1, __ATOMIC_SEQ_CST);
+
+		if(sp_reader >= SP_READERS)
+			sp_reader = -2;
+	}
+
+	if(sp_reader < 0)
+		return -1;
+
+	r = &spcache.readers[sp_reader];
+
+	__atomic_store_n(&r->epoch, __atomic_load_n(&spcache.epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+
+	if((t = __atomic_load_n(&spcache.table, __ATOMIC_SEQ_CST))){
+		for(e = &t->slots[h & t->mask]; e->hash; e = &t->slots[(e - t->slots + 1) & t->mask])
+			if((e->hash == h) && streq(t->text + e->name, user))
+				break;
+
+		if(!e->hash)
+			ret = spcache.complete ? 0 : -1;
+		else if(strlen(t->text + e->pass) < size){
+			strcpy(pass, t->text + e->pass);
+			ret = 1;
+		}
+	}
+
+	// Done with t, a reload can free it now
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+
+	if(ret == 1)
+		__atomic_fetch_add(&spcache.hits, 1, __ATOMIC_RELAXED);
+	else if(ret == 0)
+		__atomic_fetch_add(&spcache.misses, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&spcache.unknown, 1, __ATOMIC_RELAXED);
+
+	return ret;
+}
+
+/**
+ * SpCacheStats()
+ **/
+void SpCacheStats(){
+	D(("Shadow index: %u entries, %lu hits, %lu misses, %lu left to getspnam_r(); %lu reloads (last took %.2f ms), %lu failed",
+		spcache.entries, spcache.hits, spcache.misses, spcache.unknown, spcache.reloads,
+		spcache.reload_ns / 1e6, spcache.failed));
+}
+
+#endif
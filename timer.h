@@ -0,0 +1,284 @@
+/****************************
+ * Timer.h
+ *
+ * Deadlines for connections (hierarchical timer wheel).
+ *
+ * Every connection that's waiting on its peer has a deadline, and most deadlines get pushed back
+ * (or dropped) long before they're due, so setting & clearing one has to be cheap no matter how
+ * many there are.  A sorted structure would be O(log n) each time, here it's O(1):
+ *
+ * Time is counted in ticks of NET_TIMER_TICK ms.  There are NET_TIMER_LEVELS wheels of
+ * NET_TIMER_SLOTS slots each: level 0 has a slot per tick, level 1 a slot per 64 ticks, and so
+ * on (64^4 ticks is ~46 hours).  A timer goes in the level that covers how far off it is, in the
+ * slot for its tick.  Each time a level's slot comes up, the timers in it are moved down to the
+ * level below (they're closer now), and whatever is in level 0's slot for the current tick is
+ * due.  A timer is moved at most NET_TIMER_LEVELS - 1 times, however long it's set for.
+ *
+ * Timers are linked straight into the slots (nothing is allocated), and can be taken out without
+ * knowing where they are.  A wheel belongs to one loop, and is only touched from its thread (no
+ * locking).
+ ****************************/
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include "global.h"
+
+#define NET_TIMER_TICK		10	// ms
+#define NET_TIMER_BITS		6
+#define NET_TIMER_SLOTS		(1 << NET_TIMER_BITS)
+#define NET_TIMER_MASK		(NET_TIMER_SLOTS - 1)
+#define NET_TIMER_LEVELS	4
+
+// Furthest out a timer can be set, in ticks (longer ones are cut down to this)
+#define NET_TIMER_MAX		((1ULL << (NET_TIMER_BITS * NET_TIMER_LEVELS)) - 1)
+
+typedef struct __nettimer {
+	// Tick the timer is due at (0 = not set)
+	uint64_t expires;
+
+	// Slot (or due list) it's in, pprev points at whatever points at it
+	struct __nettimer *next;
+	struct __nettimer **pprev;
+} NetTimer;
+
+typedef struct __nettimers {
+	// NetNow() at tick 0, and the tick the wheel has been run up to
+	uint64_t start;
+	uint64_t now;
+
+	NetTimer *slots[NET_TIMER_LEVELS][NET_TIMER_SLOTS];
+
+	// Timers that have come due, but haven't been handed out by NetTimerPop() yet
+	NetTimer *due;
+
+	// Timers that are set (including due ones)
+	uint64_t count;
+
+	// Stats
+	uint64_t added;
+	uint64_t fired;
+	uint64_t moved;
+} NetTimers;
+
+/**
+ * NetTimersInit()
+ * w:	Wheel to set up			[out]
+ * now:	Current time (see NetNow())	[in]
+ **/
+void NetTimersInit(NetTimers *w, uint64_t now){
+	memset(w, 0, sizeof(NetTimers));
+
+	w->start = now;
+}
+
+/**
+ * NetTimerTick()
+ * w:	Wheel to go by		[in]
+ * now:	Time (see NetNow())	[in]
+ *
+ * Returns which tick now falls in.
+ **/
+uint64_t NetTimerTick(NetTimers *w, uint64_t now){
+	return (now > w->start) ? (now - w->start) / (NET_TIMER_TICK * 1000000ULL) : 0;
+}
+
+/**
+ * NetTimerLink()
+ * head:	List to put t at the front of	[in/out]
+ * t:		Timer				[in/out]
+ **/
+void NetTimerLink(NetTimer **head, NetTimer *t){
+	if((t->next = *head))
+		t->next->pprev = &t->next;
+
+	*head = t;
+	t->pprev = head;
+}
+
+/**
+ * NetTimerUnlink()
+ * t:	Timer to take out of whatever list it's in	[in/out]
+ **/
+void NetTimerUnlink(NetTimer *t){
+	if((*t->pprev = t->next))
+		t->next->pprev = t->pprev;
+
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/**
+ * NetTimerPlace()
+ * w:	Wheel to put the timer in		[in/out]
+ * t:	Timer that's due after w->now		[in/out]
+ *
+ * Level n holds timers that are due within 64^(n + 1) ticks.
+ **/
+void NetTimerPlace(NetTimers *w, NetTimer *t){
+	uint64_t delta = t->expires - w->now;
+	int level = 0;
+
+	while((level < NET_TIMER_LEVELS - 1) && (delta >> (NET_TIMER_BITS * (level + 1))))
+		level++;
+
+	NetTimerLink(&w->slots[level][(t->expires >> (NET_TIMER_BITS * level)) & NET_TIMER_MASK], t);
+}
+
+/**
+ * NetTimerDel()
+ * w:	Wheel the timer is in	[in/out]
+ * t:	Timer to clear		[in/out]
+ *
+ * Safe to call on a timer that isn't set.
+ **/
+void NetTimerDel(NetTimers *w, NetTimer *t){
+	if(!t->pprev)
+		return;
+
+	NetTimerUnlink(t);
+
+	t->expires = 0;
+	w->count--;
+}
+
+/**
+ * NetTimerAdd()
+ * w:	Wheel to put the timer in	[in/out]
+ * t:	Timer (set or not)		[in/out]
+ * ms:	How long from now it's due	[in]
+ * now:	Current time (see NetNow())	[in]
+ *
+ * (Re)sets t, it comes due on the first tick at least ms from now.
+ **/
+void NetTimerAdd(NetTimers *w, NetTimer *t, int ms, uint64_t now){
+	uint64_t tick = NetTimerTick(w, now), ticks = 0;
+
+	NetTimerDel(w, t);
+
+	// Nothing was set, so nothing has been run up to the current tick
+	if(!w->count && (tick > w->now))
+		w->now = tick;
+
+	ticks = (ms > 0) ? ((uint64_t)ms + NET_TIMER_TICK - 1) / NET_TIMER_TICK : 1;
+
+	if(ticks > NET_TIMER_MAX)
+		ticks = NET_TIMER_MAX;
+
+	// A tick that's partly gone by doesn't count
+	t->expires = ((tick > w->now) ? tick : w->now) + ticks + 1;
+
+	NetTimerPlace(w, t);
+
+	w->count++;
+	w->added++;
+}
+
+/**
+ * NetTimerCascade()
+ * w:		Wheel to move timers in		[in/out]
+ * level:	Level whose slot just came up	[in]
+ *
+ * Moves the timers in level's current slot down to where they belong now.
+ **/
+void NetTimerCascade(NetTimers *w, int level){
+	NetTimer **slot = &w->slots[level][(w->now >> (NET_TIMER_BITS * level)) & NET_TIMER_MASK];
+	NetTimer *t = NULL;
+
+	while((t = *slot)){
+		NetTimerUnlink(t);
+		NetTimerPlace(w, t);
+
+		w->moved++;
+	}
+}
+
+/**
+ * NetTimerAdvance()
+ * w:	Wheel to run	[in/out]
+ * now:	Current time	[in]
+ *
+ * Runs the wheel up to now's tick.  Timers that came due go on the due list (see NetTimerPop()).
+ **/
+void NetTimerAdvance(NetTimers *w, uint64_t now){
+	uint64_t tick = NetTimerTick(w, now);
+	NetTimer **slot = NULL;
+	NetTimer *t = NULL;
+	int level = 0, top = 0;
+
+	while(w->now < tick){
+		// Nothing left on the wheel, skip straight to now
+		if(w->count == 0){
+			w->now = tick;
+			break;
+		}
+
+		w->now++;
+
+		// Highest level that came around to a new slot, its timers have to be moved before the
+		// levels under it are looked at, since some of them belong in those levels' current slots
+		for(top = 0; (top < NET_TIMER_LEVELS - 1) && !(w->now & ((1ULL << (NET_TIMER_BITS * (top + 1))) - 1)); top++);
+
+		for(level = top; level > 0; level--)
+			NetTimerCascade(w, level);
+
+		slot = &w->slots[0][w->now & NET_TIMER_MASK];
+
+		while((t = *slot)){
+			NetTimerUnlink(t);
+			NetTimerLink(&w->due, t);
+		}
+	}
+}
+
+/**
+ * NetTimerPop()
+ * w:	Wheel to take a due timer from	[in/out]
+ *
+ * Returns a timer that has come due (no longer set), or NULL if there are none.
+ **/
+NetTimer *NetTimerPop(NetTimers *w){
+	NetTimer *t = w->due;
+
+	if(!t)
+		return NULL;
+
+	NetTimerDel(w, t);
+
+	w->fired++;
+
+	return t;
+}
+
+/**
+ * NetTimerWait()
+ * w:	Wheel to look at	[in]
+ * now:	Current time		[in]
+ *
+ * How long a loop can sleep before it has to run the wheel again.  Only looks one turn of level 0
+ * ahead, after that it's when level 1 comes around.
+ *
+ * Returns ms to wait, or -1 if no timers are set.
+ **/
+int NetTimerWait(NetTimers *w, uint64_t now){
+	uint64_t next = 0, at = 0;
+	int i = 0;
+
+	if(!w->count)
+		return -1;
+
+	if(w->due)
+		return 0;
+
+	for(i = 1; i <= NET_TIMER_SLOTS; i++){
+		next = w->now + i;
+
+		if(w->slots[0][next & NET_TIMER_MASK] || !(next & NET_TIMER_MASK))
+			break;
+	}
+
+	at = w->start + (next * NET_TIMER_TICK * 1000000ULL);
+
+	return (at > now) ? (int)((at - now + 999999) / 1000000) : 0;
+}
+
+#endif
@@ -0,0 +1,672 @@
+/****************************
+ * Uring.h
+ *
+ * io_uring backend for the event loop (build with -DNET_URING, see event.h).
+ *
+ * The epoll loop makes a syscall for every accept, every read and every write, and the
+ * handshake is a lot of small messages.  Here the loop only makes one syscall per trip around
+ * (io_uring_enter()), which submits every request that's been queued up and waits for results.
+ *
+ *	Accept:	One multishot accept, each new connection comes back as its own completion (one
+ *		accept at a time on kernels that don't have multishot)
+ *	Read:	The first URING_SLOTS connections always have a read waiting, into buffers registered
+ *		with the kernel up front (IORING_OP_READ_FIXED).  The rest wait with IORING_OP_POLL_ADD
+ *		and are read like epoll does (NetLoopRead()), so they only hold a slab while they're
+ *		in the middle of a frame
+ *	Send:	IORING_OP_SEND straight out of the connection's queue (not a registered buffer, the
+ *		queue grows as it needs to), one at a time per connection
+ *	Wake:	A read on the loop's eventfd, so NetLoopPost() works the same as with epoll
+ *	Timer:	A timeout for when the next deadline is due, only while there are deadlines set
+ *
+ * Every request holds its connection (see NetConnHold()), and a connection's socket isn't closed
+ * until the connection is freed, so a request still waiting to be submitted can't end up on a
+ * socket accept() has given the same number to.
+ *
+ * Talks to the kernel directly (io_uring_setup(), io_uring_enter(), io_uring_register()),
+ * liburing isn't needed.
+ ****************************/
+#ifndef __URING_H
+#define __URING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+
+// Submission queue size (completion queue is twice that)
+#define URING_ENTRIES	4096
+
+// Registered read buffers, and how big each one is (has to hold a full frame)
+#define URING_SLOTS	512
+#define URING_SLOT_SIZE	16384
+
+// What a completion is for (low bits of user_data, the rest is the NetConn)
+#define URING_ACCEPT	1
+#define URING_READ	2
+#define URING_SEND	3
+#define URING_WAKE	4
+#define URING_TIMER	5
+#define URING_POLL	6
+#define URING_OP_MASK	7
+
+typedef struct __netring {
+	int fd;
+	unsigned int entries;
+
+	// Submission queue
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int pending;
+
+	// Completion queue
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+
+	// Registered buffers
+	char *bufs;
+	int *free_slots;
+	int nfree;
+
+	uint64_t wake;
+
+	// Accepts are multishot until the kernel says it can't do that, -1 once accept() is broken
+	int multishot;
+
+	// Timeout for the next deadline, and when it goes off (0 = none queued)
+	struct __kernel_timespec ts;
+	uint64_t timer_at;
+
+	// Stats
+	uint64_t enters;
+	uint64_t submitted;
+	uint64_t completed;
+} NetRing;
+
+/**
+ * NetRingSubmit()
+ * r:		Ring to submit to			[in/out]
+ * wait:	Number of completions to wait for	[in]
+ *
+ * Hands everything that's been queued to the kernel (one syscall).
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetRingSubmit(NetRing *r, int wait){
+	int ret = 0;
+
+	r->enters++;
+
+	ret = syscall(__NR_io_uring_enter, r->fd, r->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+	if(ret < 0){
+		if((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+			return 1;
+
+		NetSockErr(errno);
+		return 0;
+	}
+
+	r->submitted += ret;
+	r->pending -= (ret < (int)r->pending) ? ret : r->pending;
+
+	return 1;
+}
+
+/**
+ * NetRingGet()
+ * r:	Ring to get a submission entry from	[in/out]
+ *
+ * Returns an empty entry (submitting what's queued first if the queue is full).
+ **/
+struct io_uring_sqe *NetRingGet(NetRing *r){
+	unsigned int tail = *r->sq_tail, head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe = NULL;
+
+	while((tail - head) >= r->entries){
+		NetRingSubmit(r, 0);
+		head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	}
+
+	sqe = &r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+
+	// Kernel doesn't look at it until io_uring_enter(), but it has to see the entry filled in
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	r->pending++;
+
+	return sqe;
+}
+
+/**
+ * NetRingInit()
+ * r:	Ring to set up	[out]
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetRingInit(NetRing *r){
+	struct io_uring_params p;
+	struct iovec *iov = NULL;
+	int i = 0;
+
+	memset(r, 0, sizeof(NetRing));
+	memset(&p, 0, sizeof(p));
+
+	if((r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0){
+		perror("io_uring_setup()");
+		return 0;
+	}
+
+	r->entries = p.sq_entries;
+	r->multishot = 1;
+
+	r->sq_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	r->cq_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+
+		r->cq_size = r->sq_size;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+
+	if(r->sq_ptr == MAP_FAILED){
+		perror("mmap()");
+		return 0;
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		r->cq_ptr = r->sq_ptr;
+	} else if((r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED){
+		perror("mmap()");
+		return 0;
+	}
+
+	if((r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES)) == MAP_FAILED){
+		perror("mmap()");
+		return 0;
+	}
+
+	r->sq_head = (unsigned int*)((char*)r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned int*)((char*)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned int*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int*)((char*)r->sq_ptr + p.sq_off.array);
+
+	r->cq_head = (unsigned int*)((char*)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned int*)((char*)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned int*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+
+	// Registered buffers are optional, connections just use IORING_OP_RECV without them
+	if((r->bufs = (char*)mmap(NULL, (size_t)URING_SLOTS * URING_SLOT_SIZE, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+		r->bufs = NULL;
+		return 1;
+	}
+
+	iov = (struct iovec*)calloc(URING_SLOTS, sizeof(struct iovec));
+	r->free_slots = (int*)calloc(URING_SLOTS, sizeof(int));
+
+	for(i = 0; iov && r->free_slots && (i < URING_SLOTS); i++){
+		iov[i].iov_base = r->bufs + ((size_t)i * URING_SLOT_SIZE);
+		iov[i].iov_len = URING_SLOT_SIZE;
+
+		r->free_slots[i] = URING_SLOTS - 1 - i;
+	}
+
+	if(iov && r->free_slots && (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) == 0)){
+		r->nfree = URING_SLOTS;
+	} else{
+		perror("io_uring_register()");
+
+		munmap(r->bufs, (size_t)URING_SLOTS * URING_SLOT_SIZE);
+		r->bufs = NULL;
+	}
+
+	free(iov);
+
+	D(("io_uring set up: %u entries, %d registered buffers", r->entries, r->nfree));
+
+	return 1;
+}
+
+/**
+ * NetRingAccept()
+ * l:	Loop to accept connections for	[in/out]
+ *
+ * Queues a multishot accept (it keeps going until the kernel says otherwise), or a single one.
+ **/
+void NetRingAccept(NetLoop *l){
+	NetRing *r = (NetRing*)l->ring;
+	struct io_uring_sqe *sqe = NULL;
+
+	if(r->multishot < 0)
+		return;
+
+	sqe = NetRingGet(r);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = l->listen;
+	sqe->ioprio = r->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = URING_ACCEPT;
+}
+
+/**
+ * NetRingWake()
+ * l:	Loop to wait for posted tasks on	[in/out]
+ **/
+void NetRingWake(NetLoop *l){
+	NetRing *r = (NetRing*)l->ring;
+	struct io_uring_sqe *sqe = NetRingGet(r);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = l->wakefd;
+	sqe->addr = (uint64_t)(uintptr_t)&r->wake;
+	sqe->len = sizeof(r->wake);
+	sqe->user_data = URING_WAKE;
+}
+
+/**
+ * NetRingTimeout()
+ * l:	Loop to wait for deadlines on	[in/out]
+ *
+ * Makes sure the loop wakes up when the next deadline is due (see NetTimerWait()).
+ **/
+void NetRingTimeout(NetLoop *l){
+	NetRing *r = (NetRing*)l->ring;
+	struct io_uring_sqe *sqe = NULL;
+	uint64_t now = NetNow(), at = 0;
+	int ms = NetTimerWait(&l->timers, now);
+
+	if(ms < 0)
+		return;
+
+	at = now + (ms * 1000000ULL);
+
+	// One that's already queued goes off in time
+	if(r->timer_at && (r->timer_at <= at))
+		return;
+
+	// The kernel copies it when the entry is submitted
+	r->ts.tv_sec = ms / 1000;
+	r->ts.tv_nsec = (ms % 1000) * 1000000LL;
+
+	sqe = NetRingGet(r);
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t)(uintptr_t)&r->ts;
+	sqe->len = 1;
+	sqe->user_data = URING_TIMER;
+
+	r->timer_at = at;
+}
+
+/**
+ * NetRingRead()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection to read from		[in/out]
+ *
+ * Queues a read into whatever room is left in c's reader.
+ **/
+void NetRingRead(NetLoop *l, NetConn *c){
+	struct io_uring_sqe *sqe = NetRingGet((NetRing*)l->ring);
+
+	NetReaderCompact(&c->in);
+
+	if(c->slot >= 0){
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = c->slot;
+	} else
+		sqe->opcode = IORING_OP_RECV;
+
+	sqe->fd = c->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(c->in.buff + c->in.tail);
+	sqe->len = c->in.size - c->in.tail;
+	sqe->user_data = (uint64_t)(uintptr_t)c | URING_READ;
+
+	NetStatsAdd(recvs);
+	NetConnHold(c);
+}
+
+/**
+ * NetRingPoll()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection without a registered buffer	[in/out]
+ *
+ * Queues a wait for c to have something to read (one shot).
+ **/
+void NetRingPoll(NetLoop *l, NetConn *c){
+	struct io_uring_sqe *sqe = NetRingGet((NetRing*)l->ring);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = c->fd;
+	sqe->poll32_events = POLLIN | POLLRDHUP;
+	sqe->user_data = (uint64_t)(uintptr_t)c | URING_POLL;
+
+	NetConnHold(c);
+}
+
+/**
+ * NetLoopInit()
+ * l:		Loop to set up		[out]
+ * listen:	Listening socket	[in]
+ *
+ * The handlers have to be set by the caller afterwards.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetLoopInit(NetLoop *l, int listen){
+	if(!NetLoopSetup(l, listen))
+		return 0;
+
+	if(!(l->ring = calloc(1, sizeof(NetRing))) || !NetRingInit((NetRing*)l->ring))
+		return 0;
+
+	if(listen >= 0)
+		NetRingAccept(l);
+
+	NetRingWake(l);
+
+	return 1;
+}
+
+/**
+ * NetConnAttach()
+ * l:	Loop to watch the connection	[in/out]
+ * c:	New connection			[in]
+ *
+ * Gives c a registered buffer and starts reading, or (none left) starts waiting for c to be
+ * readable.
+ *
+ * Returns 0 on failure, 1 on success.
+ **/
+int NetConnAttach(NetLoop *l, NetConn *c){
+	NetRing *r = (NetRing*)l->ring;
+
+	if(r->nfree > 0){
+		c->slot = r->free_slots[--r->nfree];
+
+		NetReaderUse(&c->in, r->bufs + ((size_t)c->slot * URING_SLOT_SIZE), URING_SLOT_SIZE, l->maxframe);
+		NetRingRead(l, c);
+	} else
+		NetRingPoll(l, c);
+
+	return 1;
+}
+
+/**
+ * NetConnFlush()
+ * c:	Connection to send to	[in/out]
+ *
+ * Queues a send for what's waiting, unless one is already on its way.
+ *
+ * Returns 0 if something is still waiting (or being sent), 1 if everything was sent.
+ **/
+int NetConnFlush(NetConn *c){
+	struct io_uring_sqe *sqe = NULL;
+
+	if(c->sending)
+		return 0;
+
+	if(c->outpos >= c->outlen){
+		if(c->out)
+			NetConnSent(c);
+
+		return 1;
+	}
+
+	sqe = NetRingGet((NetRing*)c->loop->ring);
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = c->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(c->out + c->outpos);
+	sqe->len = c->outlen - c->outpos;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uint64_t)(uintptr_t)c | URING_SEND;
+
+	c->sending = sqe->len;
+
+	NetStatsAdd(sends);
+	NetConnHold(c);
+
+	return 0;
+}
+
+/**
+ * NetConnShut()
+ * l:	Loop the connection belongs to	[in/out]
+ * c:	Connection being closed		[in/out]
+ *
+ * Requests still in flight (or not even submitted yet) use c->fd, so it's only shut down here to
+ * make them finish.  It's closed by NetConnFree(), once they're all done.
+ **/
+void NetConnShut(NetLoop *l, NetConn *c){
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+/**
+ * NetConnFree()
+ * c:	Closed connection nothing points at anymore	[in]
+ **/
+void NetConnFree(NetConn *c){
+	NetRing *r = (NetRing*)c->loop->ring;
+
+	close(c->fd);
+
+	if(c->slot >= 0)
+		r->free_slots[r->nfree++] = c->slot;
+	else
+		NetSlabPut(&c->loop->slabs, c->in.buff);
+
+	free(c->outprev);
+	free(c->out);
+	free(c);
+}
+
+/**
+ * NetRingComplete()
+ * l:	Loop the completion is for	[in/out]
+ * cqe:	Completion			[in]
+ **/
+void NetRingComplete(NetLoop *l, struct io_uring_cqe *cqe){
+	NetRing *r = (NetRing*)l->ring;
+	NetConn *c = (NetConn*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+	int op = cqe->user_data & URING_OP_MASK;
+
+	switch(op){
+		case URING_ACCEPT:
+			if(cqe->res >= 0){
+				NetConnOpen(l, cqe->res, NULL);
+			} else if((cqe->res == -EINVAL) && r->multishot){
+				D(("Kernel doesn't do multishot accepts, taking them one at a time"));
+				r->multishot = 0;
+			} else if((cqe->res == -EINVAL) || (cqe->res == -EBADF) || (cqe->res == -ENOTSOCK) ||
+				  (cqe->res == -EOPNOTSUPP)){
+				// Queueing it again would just fail again, forever
+				D(("Accept failed for good (%s), not taking any more connections", strerror(-cqe->res)));
+				r->multishot = -1;
+			} else if(cqe->res != -EAGAIN)
+				NetSockErr(-cqe->res);
+
+			// Kernel stopped the multishot (i.e.: out of fds), or it was a single one, start another
+			if(!(cqe->flags & IORING_CQE_F_MORE))
+				NetRingAccept(l);
+
+			return;
+
+		case URING_WAKE:
+			NetLoopTasks(l);
+			NetRingWake(l);
+
+			return;
+
+		// Deadlines are run after every batch (see NetLoopRun()), this was only to wake up
+		case URING_TIMER:
+			((NetRing*)l->ring)->timer_at = 0;
+
+			return;
+
+		case URING_READ:
+			if(!c->closed){
+				if(cqe->res > 0){
+					c->in.tail += cqe->res;
+
+					if(NetLoopFrames(l, c))
+						NetRingRead(l, c);
+					else
+						NetConnClose(l, c);
+				} else if(cqe->res == 0){
+					// Half closed, no more reads, but replies still go out (see NetConnUpdate())
+					c->rdhup = 1;
+					c->closing = 1;
+				} else
+					NetConnClose(l, c);
+			}
+
+			break;
+
+		case URING_POLL:
+			if(!c->closed){
+				if((cqe->res < 0) || !NetLoopRead(l, c))
+					NetConnClose(l, c);
+				else if(c->rdhup)
+					c->closing = 1;
+				else
+					NetRingPoll(l, c);
+			}
+
+			break;
+
+		case URING_SEND:
+			c->sending = 0;
+
+			if(c->outprev){
+				free(c->outprev);
+				c->outprev = NULL;
+			}
+
+			if(!c->closed){
+				if(cqe->res > 0)
+					c->outpos += cqe->res;
+				else
+					NetConnClose(l, c);
+			}
+
+			break;
+	}
+
+	NetConnUpdate(l, c);
+	NetConnRelease(l, c);
+}
+
+/**
+ * NetLoopFree()
+ * l:	Loop to free (stopped, every connection closed)	[in/out]
+ *
+ * Closed connections can still have reads & sends in flight (their sockets are shut down, so
+ * they finish right away), those are waited for so the connections get freed.  Doesn't free l
+ * itself.
+ **/
+void NetLoopFree(NetLoop *l){
+	NetRing *r = (NetRing*)l->ring;
+	unsigned int head = 0, tail = 0;
+
+	NetLoopReap(l);
+
+	while((l->freed < l->closed) && NetRingSubmit(r, 1)){
+		head = *r->cq_head;
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+		for(; head != tail; head++){
+			NetRingComplete(l, &r->cqes[head & *r->cq_mask]);
+			__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+		}
+
+		NetLoopReap(l);
+	}
+
+	if(r->bufs)
+		munmap(r->bufs, (size_t)URING_SLOTS * URING_SLOT_SIZE);
+
+	munmap(r->sqes, r->sqes_size);
+
+	if(r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+
+	munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+
+	free(r->free_slots);
+	free(r);
+
+	l->ring = NULL;
+
+	NetLoopTeardown(l);
+}
+
+/**
+ * NetLoopRun()
+ * l:	Loop to run	[in/out]
+ *
+ * Handles completions until NetLoopStop() is called (or io_uring_enter() fails).
+ **/
+void NetLoopRun(NetLoop *l){
+	NetRing *r = (NetRing*)l->ring;
+	unsigned int head = 0, tail = 0;
+
+	l->running = 1;
+
+	while(l->running){
+		NetRingTimeout(l);
+
+		// Everything queued since last time goes in with this one call
+		if(!NetRingSubmit(r, 1))
+			break;
+
+		head = *r->cq_head;
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+		while(head != tail){
+			NetRingComplete(l, &r->cqes[head & *r->cq_mask]);
+
+			head++;
+			r->completed++;
+
+			// Let the kernel reuse the entry
+			__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		NetLoopExpire(l);
+		NetLoopReap(l);
+	}
+}
+
+/**
+ * NetRingStats()
+ * l:	Loop to show io_uring stats of	[in]
+ **/
+void NetRingStats(NetLoop *l){
+	NetRing *r = (NetRing*)l->ring;
+
+	D(("io_uring: %lu io_uring_enter() calls, %lu submitted, %lu completed (%.1f per call)",
+		r->enters, r->submitted, r->completed, r->enters ? r->completed / (double)r->enters : 0.0));
+}
+
+#endif